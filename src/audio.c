@@ -0,0 +1,375 @@
+//
+// audio.c
+//
+// Streams samples into the core's audio buffer. The core raises IRQ 4
+// whenever its buffer runs low. The FPGA com task then sends whatever
+// has been prepared in one of two buffers. The audio task refills these
+// from the current sources: a WAV file from SD card and synthesized
+// floppy step sounds. File system access thus never happens in the
+// interrupt path. The audio task holds the file system lock for at
+// most one 512 byte read at a time, so sector requests of the core
+// are delayed by no more than that.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ff.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#endif
+
+#include "audio.h"
+#include "spi.h"
+#include "sdc.h"
+#include "inifile.h"
+#include "mcu_hw.h"
+#include "debug.h"
+
+#define AUDIO_CHUNK       1024   // samples per buffer, ~46ms
+#define AUDIO_MAX_WRITE    SPI_MAX_TRANSFER   // samples per SPI transaction
+
+// floppy sounds. Head movement is derived from the sectors requested,
+// assuming double sided disks with 9 sectors per track
+#define AUDIO_FLOPPY_SPC    18   // sectors per cylinder
+#define AUDIO_STEP_LEN      44   // samples of a single click, 2ms
+#define AUDIO_STEP_PERIOD   66   // samples between clicks, 3ms step rate
+#define AUDIO_STEP_MAX       8   // max steps played per seek
+
+#define AUDIO_CMD_REFILL     0   // a buffer has been sent to the core
+#define AUDIO_CMD_WAV        1
+#define AUDIO_CMD_STOP       2
+#define AUDIO_CMD_STEP       3
+
+typedef struct {
+  unsigned char cmd;
+  int steps;
+  char *name;
+} audio_cmd_t;
+
+static QueueHandle_t audio_queue = NULL;
+static bool audio_ok = false;           // core supports audio
+static bool audio_enabled = false;      // core irq enabled, audio task only
+
+// double buffering between audio task and FPGA com task. A buffer
+// with non-zero length is full and owned by the com task
+static int8_t audio_buf[2][AUDIO_CHUNK];
+static volatile int audio_len[2] = { 0, 0 };
+static int audio_play = 0, audio_pos = 0;     // com task only
+static int audio_fill = 0;                    // audio task only
+
+// currently played WAV file
+static struct {
+  FIL *file;
+  unsigned long left;         // bytes left in data chunk
+  int channels, bits;
+  uint32_t step, phase;       // 16.16 resampling
+  int cur;
+  unsigned char raw[512];
+  int raw_len, raw_pos;
+} wav;
+
+// floppy step clicks
+static int steps = 0, step_pos = 0;
+static uint8_t lfsr = 0xa5;
+static long last_cyl[MAX_DRIVES];
+
+static void audio_spi_begin(unsigned char cmd) {
+  spi_begin(SPI_PRIO_AUDIO);
+  mcu_hw_spi_tx_u08(SPI_TARGET_AUDIO);
+  mcu_hw_spi_tx_u08(cmd);
+}
+
+static void audio_enable(bool on) {
+  audio_debugf("%s", on?"enable":"disable");
+  audio_spi_begin(SPI_AUDIO_ENABLE);
+  mcu_hw_spi_tx_u08(on?1:0);
+  spi_end();
+  audio_enabled = on;
+}
+
+// get free space in core's buffer. Optionally also return its total size
+static int audio_get_free(int *size) {
+  audio_spi_begin(SPI_AUDIO_BUFFER);
+  int space = mcu_hw_spi_tx_u08(0) << 8;
+  space |= mcu_hw_spi_tx_u08(0);
+  int total = mcu_hw_spi_tx_u08(0) << 8;
+  total |= mcu_hw_spi_tx_u08(0);
+  spi_end();
+
+  if(size) *size = total;
+  return space;
+}
+
+static void audio_cmd(unsigned char cmd, int steps, char *name) {
+  audio_cmd_t c = { cmd, steps, name };
+  if(audio_queue && xQueueSendToBack(audio_queue, &c, 0) != pdTRUE && name)
+    free(name);
+}
+
+// ------------------------------ WAV files ---------------------------------
+
+static void audio_wav_close(void) {
+  if(!wav.file) return;
+
+  sdc_lock();
+  f_close(wav.file);
+  sdc_unlock();
+  free(wav.file);
+  wav.file = NULL;
+}
+
+static bool audio_wav_read(void *buf, UINT len) {
+  UINT br;
+  sdc_lock();
+  FRESULT res = f_read(wav.file, buf, len, &br);
+  sdc_unlock();
+  return res == FR_OK && br == len;
+}
+
+static uint32_t audio_le(const unsigned char *p, int len) {
+  uint32_t val = 0;
+  while(len--) val = (val << 8) | p[len];
+  return val;
+}
+
+static int audio_wav_open(const char *name) {
+  audio_wav_close();
+
+  wav.file = malloc(sizeof(FIL));
+  if(!wav.file) return -1;
+
+  sdc_lock();
+  FRESULT res = f_open(wav.file, name, FA_OPEN_EXISTING | FA_READ);
+  sdc_unlock();
+  if(res != FR_OK) {
+    audio_debugf("Cannot open %s", name);
+    free(wav.file);
+    wav.file = NULL;
+    return -1;
+  }
+
+  // search for format and data chunks
+  unsigned char hdr[16];
+  bool fmt = false;
+  if(audio_wav_read(hdr, 12) && !memcmp(hdr, "RIFF", 4) && !memcmp(hdr+8, "WAVE", 4)) {
+    while(audio_wav_read(hdr, 8)) {
+      uint32_t size = audio_le(hdr+4, 4);
+
+      if(!memcmp(hdr, "fmt ", 4) && size >= 16 && audio_wav_read(hdr, 16)) {
+	wav.channels = audio_le(hdr+2, 2);
+	wav.bits = audio_le(hdr+14, 2);
+	wav.step = ((uint64_t)audio_le(hdr+4, 4) << 16) / AUDIO_RATE;
+	fmt = audio_le(hdr, 2) == 1 && wav.channels &&
+	  (wav.bits == 8 || wav.bits == 16) && wav.step &&
+	  wav.channels * wav.bits / 8 <= (int)sizeof(wav.raw);
+	size -= 16;
+      } else if(!memcmp(hdr, "data", 4)) {
+	if(!fmt) break;
+
+	wav.left = size;
+	wav.raw_len = wav.raw_pos = 0;
+	wav.phase = 0x10000;   // fetch first frame immediately
+	wav.cur = 0;
+	audio_debugf("Playing %s, %d channels, %d bits", name, wav.channels, wav.bits);
+	return 0;
+      }
+
+      // skip chunk incl. padding
+      sdc_lock();
+      res = f_lseek(wav.file, f_tell(wav.file) + size + (size & 1));
+      sdc_unlock();
+      if(res != FR_OK) break;
+    }
+  }
+
+  audio_debugf("Unsupported WAV file %s", name);
+  audio_wav_close();
+  return -1;
+}
+
+// get the first channel of the next frame as signed 8 bit
+static bool audio_wav_frame(int *sample) {
+  int bytes = wav.channels * wav.bits / 8;
+
+  if(wav.raw_pos + bytes > wav.raw_len) {
+    // keep the start of a frame crossing the buffer end
+    int rest = wav.raw_len - wav.raw_pos;
+    memmove(wav.raw, wav.raw + wav.raw_pos, rest);
+
+    UINT len = sizeof(wav.raw) - rest;
+    if(wav.left < len) len = wav.left;
+    if(rest + len < (UINT)bytes || !audio_wav_read(wav.raw + rest, len)) return false;
+    wav.left -= len;
+    wav.raw_len = rest + len;
+    wav.raw_pos = 0;
+  }
+
+  if(wav.bits == 8) *sample = wav.raw[wav.raw_pos] - 128;
+  else              *sample = (int8_t)wav.raw[wav.raw_pos+1];
+  wav.raw_pos += bytes;
+  return true;
+}
+
+static int audio_wav_sample(void) {
+  // nearest neighbour resampling to the core's rate
+  while(wav.file && wav.phase >= 0x10000) {
+    if(!audio_wav_frame(&wav.cur)) {
+      audio_wav_close();
+      return 0;
+    }
+    wav.phase -= 0x10000;
+  }
+  wav.phase += wav.step;
+  return wav.cur;
+}
+
+// ---------------------------- floppy sounds -------------------------------
+
+// a short burst of decaying noise per head step
+static int audio_step_sample(void) {
+  if(!steps) return 0;
+
+  int val = 0;
+  if(step_pos < AUDIO_STEP_LEN) {
+    lfsr = (lfsr >> 1) ^ ((lfsr & 1)?0xb8:0);
+    int amp = 96 * (AUDIO_STEP_LEN - step_pos) / AUDIO_STEP_LEN;
+    val = (lfsr & 1)?amp:-amp;
+  }
+
+  if(++step_pos == AUDIO_STEP_PERIOD) {
+    step_pos = 0;
+    steps--;
+  }
+  return val;
+}
+
+// called by the SD card handler for every sector the core requests
+void audio_floppy_access(int drive, unsigned long sector) {
+  if(!audio_ok || !(inifile_option_get(INIFILE_OPTION_FLOPPY_SOUND) & (1<<drive)))
+    return;
+
+  long cyl = sector / AUDIO_FLOPPY_SPC;
+  if(cyl == last_cyl[drive]) return;
+
+  int n = labs(cyl - last_cyl[drive]);
+  last_cyl[drive] = cyl;
+  audio_cmd(AUDIO_CMD_STEP, (n > AUDIO_STEP_MAX)?AUDIO_STEP_MAX:n, NULL);
+}
+
+// ------------------------------ audio task --------------------------------
+
+static void audio_fill_buffer(int i) {
+  for(int n=0;n<AUDIO_CHUNK;n++) {
+    int s = audio_wav_sample() + audio_step_sample();
+    audio_buf[i][n] = (s > 127)?127:(s < -128)?-128:s;
+  }
+  audio_len[i] = AUDIO_CHUNK;
+}
+
+static void audio_task(__attribute__((unused)) void *parms) {
+  audio_cmd_t cmd;
+
+  for(;;) {
+    xQueueReceive(audio_queue, &cmd, portMAX_DELAY);
+
+    switch(cmd.cmd) {
+    case AUDIO_CMD_WAV:
+      audio_wav_open(cmd.name);
+      free(cmd.name);
+      break;
+
+    case AUDIO_CMD_STOP:
+      audio_wav_close();
+      steps = 0;
+      break;
+
+    case AUDIO_CMD_STEP:
+      steps += cmd.steps;
+      if(steps > AUDIO_STEP_MAX) steps = AUDIO_STEP_MAX;
+      break;
+    }
+
+    // refill empty buffers in the order they are played
+    while((wav.file || steps) && !audio_len[audio_fill]) {
+      audio_fill_buffer(audio_fill);
+      audio_fill ^= 1;
+    }
+
+    // let the core request data as long as there's something to play
+    bool busy = audio_len[0] || audio_len[1];
+    if(busy != audio_enabled)
+      audio_enable(busy);
+  }
+}
+
+// ---------------------------- FPGA com task -------------------------------
+
+// the core's buffer runs low
+void audio_handle_event(void) {
+  if(!audio_ok) return;
+
+  int space = audio_get_free(NULL);
+  while(space && audio_len[audio_play]) {
+    int n = audio_len[audio_play] - audio_pos;
+    if(n > space) n = space;
+    if(n > AUDIO_MAX_WRITE) n = AUDIO_MAX_WRITE;
+
+    audio_spi_begin(SPI_AUDIO_WRITE);
+    mcu_hw_spi_tx_buf((unsigned char*)audio_buf[audio_play] + audio_pos, n);
+    spi_end();
+
+    space -= n;
+    audio_pos += n;
+    if(audio_pos == audio_len[audio_play]) {
+      // return buffer to the audio task
+      audio_len[audio_play] = 0;
+      audio_pos = 0;
+      audio_play ^= 1;
+      audio_cmd(AUDIO_CMD_REFILL, 0, NULL);
+    }
+  }
+
+  // nothing left to send, let the audio task disable the irq
+  if(!audio_len[audio_play])
+    audio_cmd(AUDIO_CMD_REFILL, 0, NULL);
+}
+
+// play a WAV file given relative to the root of the sd card
+int audio_play_wav(const char *name) {
+  if(!audio_ok) return -1;
+
+  char *n = malloc(strlen(CARD_MOUNTPOINT) + strlen(name) + 2);
+  if(!n) return -1;
+  strcpy(n, CARD_MOUNTPOINT);
+  strcat(n, "/");
+  strcat(n, name);
+  audio_cmd(AUDIO_CMD_WAV, 0, n);
+  return 0;
+}
+
+void audio_stop(void) {
+  audio_cmd(AUDIO_CMD_STOP, 0, NULL);
+}
+
+void audio_init(void) {
+  // cores without audio support report a buffer size of 0
+  int size;
+  audio_get_free(&size);
+  audio_debugf("Core audio buffer: %d samples", size);
+  if(!size) return;
+
+  for(int i=0;i<MAX_DRIVES;i++) last_cyl[i] = 0;
+
+  audio_queue = xQueueCreate(8, sizeof(audio_cmd_t));
+  xTaskCreate(audio_task, (char *)"audio_task", 2048, NULL, configMAX_PRIORITIES-2, NULL);
+  audio_ok = true;
+}
@@ -0,0 +1,18 @@
+/*
+  audio.h
+
+  Audio output via the core, e.g. for floppy sounds
+*/
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#define AUDIO_RATE   22050   // samples per second, signed 8 bit mono
+
+void audio_init(void);
+void audio_handle_event(void);
+int  audio_play_wav(const char *name);
+void audio_stop(void);
+void audio_floppy_access(int drive, unsigned long sector);
+
+#endif // AUDIO_H
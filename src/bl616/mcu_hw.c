@@ -16,6 +16,7 @@
 #include "../sysctrl.h"
 #include "../debug.h"
 #include "../mcu_hw.h"
+#include "../trace.h"
 
 extern uint32_t __HeapBase;
 extern uint32_t __HeapLimit;
@@ -82,7 +83,8 @@ static struct bflb_device_s *gpio;
 #include <queue.h>
 #include <hardware/bl616.h>
 
-#define MAX_REPORT_SIZE   8
+#define MAX_REPORT_SIZE  64
+#define MAX_REPORT_DESC 256
 #define XBOX_REPORT_SIZE 20
 
 #define STATE_NONE      0 
@@ -90,15 +92,6 @@ static struct bflb_device_s *gpio;
 #define STATE_RUNNING   2
 #define STATE_FAILED    3
 
-#define XINPUT_GAMEPAD_DPAD_UP 0x0001
-#define XINPUT_GAMEPAD_DPAD_DOWN 0x0002
-#define XINPUT_GAMEPAD_DPAD_LEFT 0x0004
-#define XINPUT_GAMEPAD_DPAD_RIGHT 0x0008
-#define XINPUT_GAMEPAD_START 0x0010
-#define XINPUT_GAMEPAD_BACK 0x0020
-#define XINPUT_GAMEPAD_LEFT_SHOULDER 0x0100
-#define XINPUT_GAMEPAD_RIGHT_SHOULDER 0x0200
-
 extern struct bflb_device_s *gpio;
 extern void shell_init_with_task(struct bflb_device_s *shell);
 
@@ -120,11 +113,7 @@ static struct usb_config {
     struct usb_config *usb;
     SemaphoreHandle_t sem;
     TaskHandle_t task_handle;    
-    unsigned char last_state;
-    unsigned char js_index;
-    unsigned char last_state_btn_extra;
-    int16_t last_state_x;
-    int16_t last_state_y;
+    struct hid_xinput_state_S pad;
     #ifdef RATE_CHECK
     TickType_t rate_start;
     unsigned long rate_events;
@@ -137,7 +126,7 @@ static struct usb_config {
     struct usbh_hid *class;
     uint8_t *buffer;
     int nbytes;
-    hid_report_t report;
+    hid_iface_t iface;
     struct usb_config *usb;
     SemaphoreHandle_t sem;
     TaskHandle_t task_handle;    
@@ -145,22 +134,12 @@ static struct usb_config {
     TickType_t rate_start;
     unsigned long rate_events;
 #endif
-    hid_state_t hid_state;
   } hid_info[CONFIG_USBHOST_MAX_HID_CLASS];
 } usb_config;
   
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t hid_buffer[CONFIG_USBHOST_MAX_HID_CLASS][MAX_REPORT_SIZE];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t xbox_buffer[CONFIG_USBHOST_MAX_XBOX_CLASS][XBOX_REPORT_SIZE];
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t report_desc[CONFIG_USBHOST_MAX_HID_CLASS][128];
-
-uint8_t byteScaleAnalog(int16_t xbox_val)
-{
-  // Scale the xbox value from [-32768, 32767] to [1, 255]
-  // Offset by 32768 to get in range [0, 65536], then divide by 256 to get in range [1, 255]
-  uint8_t scale_val = (xbox_val + 32768) / 256;
-  if (scale_val == 0) return 1;
-  return scale_val;
-}
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t report_desc[CONFIG_USBHOST_MAX_HID_CLASS][MAX_REPORT_DESC];
 
 void usbh_hid_callback(void *arg, int nbytes) {
   struct hid_info_S *hid = (struct hid_info_S *)arg;
@@ -185,13 +164,16 @@ static void usbh_update(struct usb_config *usb) {
     if(usb->hid_info[i].class && usb->hid_info[i].state == STATE_NONE) {
       usb_debugf("NEW HID %d", i);
 
-      usb_debugf("Interval: %d", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].ep[0].ep_desc.bInterval);
+      usb_debugf("Interval: %d", usb->hid_info[i].class->hport->config.intf[usb->hid_info[i].class->intf].altsetting[0].ep[0].ep_desc.bInterval);
 	 
       usb_debugf("Interface %d", usb->hid_info[i].class->intf);
-      usb_debugf("  class %d", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceClass);
-      usb_debugf("  subclass %d", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceSubClass);
-      usb_debugf("  protocol %d", usb->hid_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceProtocol);
-      int rep_desc = usbh_hid_get_report_descriptor(usb->hid_info[i].class, report_desc[i], 128);
+      usb_debugf("  class %d", usb->hid_info[i].class->hport->config.intf[usb->hid_info[i].class->intf].altsetting[0].intf_desc.bInterfaceClass);
+      usb_debugf("  subclass %d", usb->hid_info[i].class->hport->config.intf[usb->hid_info[i].class->intf].altsetting[0].intf_desc.bInterfaceSubClass);
+      usb_debugf("  protocol %d", usb->hid_info[i].class->hport->config.intf[usb->hid_info[i].class->intf].altsetting[0].intf_desc.bInterfaceProtocol);
+      // the parser stops at the first zero byte after the descriptor. Make
+      // sure no leftovers of a previous descriptor follow
+      memset(report_desc[i], 0, MAX_REPORT_DESC);
+      int rep_desc = usbh_hid_get_report_descriptor(usb->hid_info[i].class, report_desc[i], MAX_REPORT_DESC);
       if (rep_desc < 0) {
         usb_debugf("usbh_hid_get_report_descriptor issue");}
       bool skip = false;
@@ -202,7 +184,7 @@ static void usbh_update(struct usb_config *usb) {
       }
       // parse report descriptor ...
       usb_debugf("report descriptor: %p", report_desc[i]);
-      if(skip || !parse_report_descriptor(report_desc[i], 128, &usb->hid_info[i].report, NULL)) {
+      if(skip || !hid_iface_init(&usb->hid_info[i].iface, report_desc[i], MAX_REPORT_DESC)) {
 	usb->hid_info[i].state = STATE_FAILED;   // parsing failed, don't use
 	return;
       }
@@ -214,11 +196,7 @@ static void usbh_update(struct usb_config *usb) {
       usb_debugf("HID LOST %d", i);
       vTaskDelete( usb->hid_info[i].task_handle );
       usb->hid_info[i].state = STATE_NONE;
-
-      if(usb->hid_info[i].report.type == REPORT_TYPE_JOYSTICK) {
-	usb_debugf("Joystick %d gone", usb->hid_info[i].hid_state.joystick.js_index);
-	hid_release_joystick(usb->hid_info[i].hid_state.joystick.js_index);
-      }
+      hid_iface_release(&usb->hid_info[i].iface);
     }
   }
 
@@ -231,12 +209,12 @@ static void usbh_update(struct usb_config *usb) {
     if(usb->xbox_info[i].class && usb->xbox_info[i].state == STATE_NONE) {
       usb_debugf("NEW XBOX %d", i);
 
-      usb_debugf("Interval: %d", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].ep[0].ep_desc.bInterval);
+      usb_debugf("Interval: %d", usb->xbox_info[i].class->hport->config.intf[usb->xbox_info[i].class->intf].altsetting[0].ep[0].ep_desc.bInterval);
 	 
       usb_debugf("Interface %d", usb->xbox_info[i].class->intf);
-      usb_debugf("  class %d", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceClass);
-      usb_debugf("  subclass %d", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceSubClass);
-      usb_debugf("  protocol %d", usb->xbox_info[i].class->hport->config.intf[i].altsetting[0].intf_desc.bInterfaceProtocol);
+      usb_debugf("  class %d", usb->xbox_info[i].class->hport->config.intf[usb->xbox_info[i].class->intf].altsetting[0].intf_desc.bInterfaceClass);
+      usb_debugf("  subclass %d", usb->xbox_info[i].class->hport->config.intf[usb->xbox_info[i].class->intf].altsetting[0].intf_desc.bInterfaceSubClass);
+      usb_debugf("  protocol %d", usb->xbox_info[i].class->hport->config.intf[usb->xbox_info[i].class->intf].altsetting[0].intf_desc.bInterfaceProtocol);
 	
       usb->xbox_info[i].state = STATE_DETECTED;
     }
@@ -246,8 +224,8 @@ static void usbh_update(struct usb_config *usb) {
       vTaskDelete( usb->xbox_info[i].task_handle );
       usb->xbox_info[i].state = STATE_NONE;
       
-      usb_debugf("Joystick %d gone", usb->xbox_info[i].js_index);
-      hid_release_joystick(usb->xbox_info[i].js_index);
+      usb_debugf("Joystick %d gone", usb->xbox_info[i].pad.js_index);
+      xinput_release(&usb->xbox_info[i].pad);
     }
   }
 
@@ -255,8 +233,8 @@ static void usbh_update(struct usb_config *usb) {
   int mice = 0, keyboards = 0;  
   for(int i=0;i<CONFIG_USBHOST_MAX_HID_CLASS;i++) {
     if(usb->hid_info[i].state == STATE_RUNNING) {
-      if(usb->hid_info[i].report.type == REPORT_TYPE_MOUSE)    mice++;
-      if(usb->hid_info[i].report.type == REPORT_TYPE_KEYBOARD) keyboards++;      
+      if(hid_iface_has(&usb->hid_info[i].iface, REPORT_TYPE_MOUSE))    mice++;
+      if(hid_iface_has(&usb->hid_info[i].iface, REPORT_TYPE_KEYBOARD)) keyboards++;      
     }
   }
 
@@ -281,57 +259,9 @@ static void xbox_parse(struct xbox_info_S *xbox) {
   if(xbox->buffer[0] != 0 || xbox->buffer[1] != 20)
     return;
 
-  uint16_t wButtons = xbox->buffer[3] << 8 | xbox->buffer[2];
-
-  // build new state
-  unsigned char state =
-    ((wButtons & XINPUT_GAMEPAD_DPAD_UP   )?0x08:0x00) |
-    ((wButtons & XINPUT_GAMEPAD_DPAD_DOWN )?0x04:0x00) |
-    ((wButtons & XINPUT_GAMEPAD_DPAD_LEFT )?0x02:0x00) |
-    ((wButtons & XINPUT_GAMEPAD_DPAD_RIGHT)?0x01:0x00) |
-    ((wButtons & 0xf000) >> 8); // Y, X, B, A
-
-  // build extra button new state
-  unsigned char state_btn_extra =
-    ((wButtons & XINPUT_GAMEPAD_LEFT_SHOULDER  )?0x01:0x00) |
-    ((wButtons & XINPUT_GAMEPAD_RIGHT_SHOULDER )?0x02:0x00) |
-    ((wButtons & XINPUT_GAMEPAD_BACK           )?0x10:0x00) | // Rumblepad 2 / Dual Action compatibility
-    ((wButtons & XINPUT_GAMEPAD_START          )?0x20:0x00);
-
-  // build analog stick x,y state
-  int16_t sThumbLX = xbox->buffer[7] << 8 | xbox->buffer[6];
-  int16_t sThumbLY = xbox->buffer[9] << 8 | xbox->buffer[8];
-  uint8_t ax = byteScaleAnalog(sThumbLX);
-  uint8_t ay = ~byteScaleAnalog(sThumbLY);
-
-  // map analog stick directions to digital
-  if(ax > (uint8_t) 0xc0) state |= 0x01;
-  if(ax < (uint8_t) 0x40) state |= 0x02;
-  if(ay > (uint8_t) 0xc0) state |= 0x04;
-  if(ay < (uint8_t) 0x40) state |= 0x08;
-
-  // submit if state has changed
-  if(state != xbox->last_state ||
-    state_btn_extra != xbox->last_state_btn_extra ||
-    sThumbLX != xbox->last_state_x ||
-    sThumbLY != xbox->last_state_y) {
-
-    xbox->last_state = state;
-    xbox->last_state_btn_extra = state_btn_extra;
-    xbox->last_state_x = sThumbLX;
-    xbox->last_state_y = sThumbLY;
-    usb_debugf("XBOX Joy%d: B %02x EB %02x X %02x Y %02x", xbox->js_index, state, state_btn_extra, ax, ay);
-
-    mcu_hw_spi_begin();
-    mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-    mcu_hw_spi_tx_u08(SPI_HID_JOYSTICK);
-    mcu_hw_spi_tx_u08(xbox->js_index);
-    mcu_hw_spi_tx_u08(state);
-    mcu_hw_spi_tx_u08(ax); // gamepad analog X
-    mcu_hw_spi_tx_u08(ay); // gamepad analog Y
-    mcu_hw_spi_tx_u08(state_btn_extra); // gamepad extra buttons
-    mcu_hw_spi_end();
-  }
+  xinput_parse(&xbox->pad, xbox->buffer[3] << 8 | xbox->buffer[2],
+	       xbox->buffer[7] << 8 | xbox->buffer[6],
+	       xbox->buffer[9] << 8 | xbox->buffer[8]);
 }
 
 // each HID client gets itws own thread which submits urbs
@@ -349,7 +279,7 @@ static void usbh_hid_client_thread(void *argument) {
       // Wait for result
       xSemaphoreTake(hid->sem, 0xffffffffUL);
       if(hid->nbytes > 0)
-	hid_parse(&hid->report, &hid->hid_state, hid->buffer, hid->nbytes);
+	hid_parse(&hid->iface, hid->buffer, hid->nbytes);
       
       hid->nbytes = 0;
     }      
@@ -443,13 +373,13 @@ static void usbh_hid_thread(void *argument) {
   // in the long term the core is supposed to return its HID demands
   // (keyboard matrix type, joystick type and number, ...)
   
-  mcu_hw_spi_begin();
+  spi_begin(SPI_PRIO_HID);
   mcu_hw_spi_tx_u08(SPI_TARGET_HID);
   mcu_hw_spi_tx_u08(SPI_HID_STATUS);
   mcu_hw_spi_tx_u08(0x00);
   usb_debugf("HID status #0: %02x", mcu_hw_spi_tx_u08(0x00));
   usb_debugf("HID status #1: %02x", mcu_hw_spi_tx_u08(0x00));
-  mcu_hw_spi_end();
+  spi_end();
 
   while (1) {
     usbh_update(usb);
@@ -459,16 +389,11 @@ static void usbh_hid_thread(void *argument) {
 	usb_debugf("NEW HID device %d", i);
 	usb->hid_info[i].state = STATE_RUNNING; 
 
-	if( usb->hid_info[i].report.type == REPORT_TYPE_JOYSTICK ) {	
-	  usb->hid_info[i].hid_state.joystick.js_index = hid_allocate_joystick();
-	  usb_debugf("  -> joystick %d", usb->hid_info[i].hid_state.joystick.js_index);
-	}
-	  
 #if 0
 	// set report protocol 1 if subclass != BOOT_INTF
 	// CherryUSB doesn't report the InterfaceSubClass (HID_BOOT_INTF_SUBCLASS)
 	// we thus set boot protocol on keyboards
-	if( usb->hid_info[i].report.type == REPORT_TYPE_KEYBOARD ) {	
+	if( hid_iface_has(&usb->hid_info[i].iface, REPORT_TYPE_KEYBOARD) ) {	
 	  // /* 0x0 = boot protocol, 0x1 = report protocol */
 	  usb_debugf("setting boot protocol");
 	  ret = usbh_hid_set_protocol(usb->hid_info[i].class, HID_PROTOCOL_BOOT);
@@ -480,12 +405,19 @@ static void usbh_hid_thread(void *argument) {
 	}
 #endif
 
-	// setup urb
+	// setup urb large enough for the biggest report
+	int size = 0;
+	for(int r=0;r<usb->hid_info[i].iface.reports.count;r++) {
+	  hid_report_t *report = &usb->hid_info[i].iface.reports.report[r];
+	  if(report->report_size + (report->report_id_present ? 1:0) > size)
+	    size = report->report_size + (report->report_id_present ? 1:0);
+	}
+	if(size > MAX_REPORT_SIZE) size = MAX_REPORT_SIZE;
+	
 	usbh_int_urb_fill(&usb->hid_info[i].class->intin_urb,
 			  usb->hid_info[i].class->hport,
 			  usb->hid_info[i].class->intin, usb->hid_info[i].buffer,
-			  usb->hid_info[i].report.report_size + (usb->hid_info[i].report.report_id_present ? 1:0),
-			  0, usbh_hid_callback, &usb->hid_info[i]);
+			  size, 0, usbh_hid_callback, &usb->hid_info[i]);
 
 #ifdef RATE_CHECK
 	usb->hid_info[i].rate_start = xTaskGetTickCount();
@@ -504,8 +436,8 @@ static void usbh_hid_thread(void *argument) {
 	usb->xbox_info[i].state = STATE_RUNNING; 
 
 	// search for free joystick slot
-	usb->xbox_info[i].js_index = hid_allocate_joystick();
-	usb_debugf("  -> joystick %d", usb->xbox_info[i].js_index);
+	xinput_init(&usb->xbox_info[i].pad);
+	usb_debugf("  -> joystick %d", usb->xbox_info[i].pad.js_index);
 	
 	// setup urb
 	usbh_int_urb_fill(&usb->xbox_info[i].class->intin_urb,
@@ -564,7 +496,6 @@ void usb_host(void) {
 /* ============================================================================================= */
 
 extern TaskHandle_t com_task_handle;
-static SemaphoreHandle_t spi_sem;
 static struct bflb_device_s *spi_dev;
 
 #ifdef M0S_DOCK
@@ -609,6 +540,7 @@ void spi_isr(uint8_t pin) {
   if (pin == SPI_PIN_IRQ) {
     // disable further interrupts until thread has processed the current message
     bflb_irq_disable(gpio->irq_num);
+    trace_event(TRACE_IRQ, 0);
 
     if(com_task_handle) {    
       BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -618,10 +550,23 @@ void spi_isr(uint8_t pin) {
   }
 }
 
+static struct bflb_spi_config_s spi_cfg = {
+  .freq = 20000000,   // 20MHz
+  .role = SPI_ROLE_MASTER,
+  .mode = SPI_MODE1,         // mode 1: idle state low, data sampled on falling edge
+  .data_width = SPI_DATA_WIDTH_8BIT,
+  .bit_order = SPI_BIT_MSB,
+  .byte_order = SPI_BYTE_LSB,
+  .tx_fifo_threshold = 0,
+  .rx_fifo_threshold = 0,
+};
+
 static void mcu_hw_spi_init(void) {
   // when FPGA sets data on rising edge:
   // stable with long cables up to 20Mhz
   // short cables up to 32MHz
+  // The clock is raised at runtime if the core supports the SPI
+  // link calibration
 
   /* spi miso */
   bflb_gpio_init(gpio, SPI_PIN_MISO, GPIO_FUNC_SPI0 | GPIO_ALTERNATE | GPIO_PULLUP | GPIO_SMT_EN | GPIO_DRV_3);
@@ -633,24 +578,13 @@ static void mcu_hw_spi_init(void) {
   bflb_gpio_init(gpio, SPI_PIN_CSN, GPIO_OUTPUT | GPIO_PULLUP | GPIO_SMT_EN | GPIO_DRV_3);
   bflb_gpio_set(gpio, SPI_PIN_CSN);
 
-  struct bflb_spi_config_s spi_cfg = {
-    .freq = 20000000,   // 20MHz
-    .role = SPI_ROLE_MASTER,
-    .mode = SPI_MODE1,         // mode 1: idle state low, data sampled on falling edge
-    .data_width = SPI_DATA_WIDTH_8BIT,
-    .bit_order = SPI_BIT_MSB,
-    .byte_order = SPI_BYTE_LSB,
-    .tx_fifo_threshold = 0,
-    .rx_fifo_threshold = 0,
-  };
-  
   spi_dev = bflb_device_get_by_name("spi0");
   bflb_spi_init(spi_dev, &spi_cfg);
 
   bflb_spi_feature_control(spi_dev, SPI_CMD_SET_DATA_WIDTH, SPI_DATA_WIDTH_8BIT);
 
-  // semaphore to access the spi bus
-  spi_sem = xSemaphoreCreateMutex();
+  // bus arbitration between the different users
+  spi_arbiter_init();
 
   /* interrupt input */
   bflb_irq_disable(gpio->irq_num);
@@ -659,11 +593,14 @@ static void mcu_hw_spi_init(void) {
   bflb_gpio_irq_attach(SPI_PIN_IRQ, spi_isr);
 }
 
-// spi may be used by different threads. Thus begin and end are using
-// semaphores
+uint32_t mcu_hw_time_us(void) {
+  return bflb_mtimer_get_time_us();
+}
+
+// spi may be used by different threads. Access to the bus is
+// arbitrated by spi_begin() and spi_end()
 
 void mcu_hw_spi_begin(void) {
-  xSemaphoreTake(spi_sem, 0xffffffffUL); // wait forever
   bflb_gpio_reset(gpio, SPI_PIN_CSN);
 }
 
@@ -671,9 +608,24 @@ unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
   return bflb_spi_poll_send(spi_dev, b);
 }
 
+void mcu_hw_spi_tx_buf(const unsigned char *buf, int len) {
+  bflb_spi_poll_exchange(spi_dev, buf, NULL, len);
+}
+
+void mcu_hw_spi_rx_buf(unsigned char *buf, int len) {
+  bflb_spi_poll_exchange(spi_dev, NULL, buf, len);
+}
+
+int mcu_hw_spi_set_clock(int hz) {
+  // re-initialize the controller with the new clock
+  spi_cfg.freq = hz;
+  bflb_spi_init(spi_dev, &spi_cfg);
+  bflb_spi_feature_control(spi_dev, SPI_CMD_SET_DATA_WIDTH, SPI_DATA_WIDTH_8BIT);
+  return hz;
+}
+
 void mcu_hw_spi_end(void) {
   bflb_gpio_set(gpio, SPI_PIN_CSN);
-  xSemaphoreGive(spi_sem);
 }
 
 void mcu_hw_irq_ack(void) {
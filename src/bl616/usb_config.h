@@ -163,14 +163,14 @@
 
 #define CONFIG_USBHOST_MAX_RHPORTS          1
 #define CONFIG_USBHOST_MAX_EXTHUBS          2
-#define CONFIG_USBHOST_MAX_EHPORTS          4
+#define CONFIG_USBHOST_MAX_EHPORTS          7
 #define CONFIG_USBHOST_MAX_INTERFACES       4
 #define CONFIG_USBHOST_MAX_INTF_ALTSETTINGS 2
 #define CONFIG_USBHOST_MAX_ENDPOINTS        4
 #define CONFIG_USBHOST_MAX_CDC_ACM_CLASS    0
-#define CONFIG_USBHOST_MAX_HID_CLASS        6
+#define CONFIG_USBHOST_MAX_HID_CLASS        8
 #define CONFIG_USBHOST_MAX_MSC_CLASS        0
-#define CONFIG_USBHOST_MAX_XBOX_CLASS       2
+#define CONFIG_USBHOST_MAX_XBOX_CLASS       4
 #define CONFIG_USBHOST_MAX_AUDIO_CLASS      0
 #define CONFIG_USBHOST_MAX_VIDEO_CLASS      0
 //#define CONFIG_CHERRYUSB_HOST_RTL8152       1
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "config.h"
+#include "sdc.h"
 #include "debug.h"
 #include "xml.h"
 
@@ -25,6 +26,13 @@
 #define CONFIG_XML_ELEMENT_LIST          12
 #define CONFIG_XML_ELEMENT_LISTENTRY     13
 #define CONFIG_XML_ELEMENT_BUTTON        14
+#define CONFIG_XML_ELEMENT_COMMAND_DEFRAG 15
+#define CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE 16
+#define CONFIG_XML_ELEMENT_COMMAND_UPLOAD 17
+#define CONFIG_XML_ELEMENT_COMMAND_SNAPSHOT 18
+#define CONFIG_XML_ELEMENT_COMMAND_RESTORE 19
+#define CONFIG_XML_ELEMENT_COMMAND_PLAY  20
+#define CONFIG_XML_ELEMENT_COMMAND_STOP  21
 
 static int config_element;
 static int config_depth;
@@ -162,12 +170,33 @@ static void config_xml_command_attribute(int config_element, char *name, char *v
       command->set.id = value[0];
     else if(config_element == CONFIG_XML_ELEMENT_COMMAND_SET && strcasecmp(name, "value") == 0)
       command->set.value = atoi(value);
-    else if(config_element == CONFIG_XML_ELEMENT_COMMAND_SAVE && strcasecmp(name, "file") == 0 && !command->filename)
+    else if((config_element == CONFIG_XML_ELEMENT_COMMAND_SAVE ||
+	     config_element == CONFIG_XML_ELEMENT_COMMAND_PLAY) &&
+	    strcasecmp(name, "file") == 0 && !command->filename)
       command->filename = strdup(value);
     else if(config_element == CONFIG_XML_ELEMENT_COMMAND_DELAY && strcasecmp(name, "ms") == 0)
       command->delay.ms = atoi(value);
     else if(config_element == CONFIG_XML_ELEMENT_COMMAND_LINK && strcasecmp(name, "action") == 0 && !command->action)
       command->action = config_get_action(value);
+    else if((config_element == CONFIG_XML_ELEMENT_COMMAND_DEFRAG ||
+	     config_element == CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE) && strcasecmp(name, "drive") == 0)
+      command->image.drive = atoi(value);
+    else if(config_element == CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE && strcasecmp(name, "size") == 0)
+      command->image.size = atol(value);
+    else if(config_element == CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE && strcasecmp(name, "format") == 0) {
+      if(strcasecmp(value, "st") == 0)       command->image.format = SDC_IMAGE_ST;
+      else if(strcasecmp(value, "d64") == 0) command->image.format = SDC_IMAGE_D64;
+      else if(strcasecmp(value, "adf") == 0) command->image.format = SDC_IMAGE_ADF;
+      else if(strcasecmp(value, "hdf") == 0) command->image.format = SDC_IMAGE_HDF;
+      else debugf("Unknown image format %s", value);
+    }
+    else if((config_element == CONFIG_XML_ELEMENT_COMMAND_UPLOAD ||
+	     config_element == CONFIG_XML_ELEMENT_COMMAND_SNAPSHOT ||
+	     config_element == CONFIG_XML_ELEMENT_COMMAND_RESTORE) &&
+	    strcasecmp(name, "file") == 0 && !command->mem.filename)
+      command->mem.filename = strdup(value);
+    else if(config_element == CONFIG_XML_ELEMENT_COMMAND_UPLOAD && strcasecmp(name, "address") == 0)
+      command->mem.address = strtoul(value, NULL, 0);
 	
     else
       debugf("WARNING: Unused action/command/<...> attribute '%s'", name);    
@@ -216,6 +245,34 @@ static int config_xml_action_element(char *name) {
       config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_LINK);
       config_element = CONFIG_XML_ELEMENT_COMMAND_LINK;
       return 0;
+    } else if(strcasecmp(name, "defrag") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_DEFRAG);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_DEFRAG;
+      return 0;
+    } else if(strcasecmp(name, "newimage") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_NEWIMAGE);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE;
+      return 0;
+    } else if(strcasecmp(name, "upload") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_UPLOAD);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_UPLOAD;
+      return 0;
+    } else if(strcasecmp(name, "snapshot") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_SNAPSHOT);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_SNAPSHOT;
+      return 0;
+    } else if(strcasecmp(name, "restore") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_RESTORE);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_RESTORE;
+      return 0;
+    } else if(strcasecmp(name, "play") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_PLAY);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_PLAY;
+      return 0;
+    } else if(strcasecmp(name, "stop") == 0) {
+      config_xml_new_action_command(action, CONFIG_ACTION_COMMAND_STOP);
+      config_element = CONFIG_XML_ELEMENT_COMMAND_STOP;
+      return 0;
     } else
       debugf("WARNING: Unexpected command element %s in state %d", name, config_element);
 
@@ -242,6 +299,29 @@ static void config_dump_action(config_action_t *act) {
     case CONFIG_ACTION_COMMAND_HIDE:
       debugf("  Hide OSD");
       break;
+    case CONFIG_ACTION_COMMAND_DEFRAG:
+      debugf("  Defrag drive %u", act->commands[i].image.drive);
+      break;
+    case CONFIG_ACTION_COMMAND_NEWIMAGE:
+      debugf("  New image format %u for drive %u", act->commands[i].image.format,
+	     act->commands[i].image.drive);
+      break;
+    case CONFIG_ACTION_COMMAND_UPLOAD:
+      debugf("  Upload %s to $%lx", act->commands[i].mem.filename,
+	     act->commands[i].mem.address);
+      break;
+    case CONFIG_ACTION_COMMAND_SNAPSHOT:
+      debugf("  Snapshot %s", act->commands[i].mem.filename);
+      break;
+    case CONFIG_ACTION_COMMAND_RESTORE:
+      debugf("  Restore %s", act->commands[i].mem.filename);
+      break;
+    case CONFIG_ACTION_COMMAND_PLAY:
+      debugf("  Play %s", act->commands[i].filename);
+      break;
+    case CONFIG_ACTION_COMMAND_STOP:
+      debugf("  Stop audio");
+      break;
     }
   }
 }
@@ -638,6 +718,13 @@ void xml_element_end_cb(void) {
   case CONFIG_XML_ELEMENT_COMMAND_DELAY:
   case CONFIG_XML_ELEMENT_COMMAND_HIDE:
   case CONFIG_XML_ELEMENT_COMMAND_LINK:
+  case CONFIG_XML_ELEMENT_COMMAND_DEFRAG:
+  case CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE:
+  case CONFIG_XML_ELEMENT_COMMAND_UPLOAD:
+  case CONFIG_XML_ELEMENT_COMMAND_SNAPSHOT:
+  case CONFIG_XML_ELEMENT_COMMAND_RESTORE:
+  case CONFIG_XML_ELEMENT_COMMAND_PLAY:
+  case CONFIG_XML_ELEMENT_COMMAND_STOP:
     config_element = CONFIG_XML_ELEMENT_ACTION;
     break;
     
@@ -678,6 +765,13 @@ void xml_attribute_cb(char *name, char *value) {
   case CONFIG_XML_ELEMENT_COMMAND_DELAY:
   case CONFIG_XML_ELEMENT_COMMAND_HIDE:
   case CONFIG_XML_ELEMENT_COMMAND_LINK:
+  case CONFIG_XML_ELEMENT_COMMAND_DEFRAG:
+  case CONFIG_XML_ELEMENT_COMMAND_NEWIMAGE:
+  case CONFIG_XML_ELEMENT_COMMAND_UPLOAD:
+  case CONFIG_XML_ELEMENT_COMMAND_SNAPSHOT:
+  case CONFIG_XML_ELEMENT_COMMAND_RESTORE:
+  case CONFIG_XML_ELEMENT_COMMAND_PLAY:
+  case CONFIG_XML_ELEMENT_COMMAND_STOP:
     config_xml_command_attribute(config_element, name, value);
     break;
 
@@ -15,8 +15,8 @@
 #endif
 
 #define MAX_DRIVES                   (8)
-#define MAX_HID_DEVICES              (4)
-#define MAX_XBOX_DEVICES             (2)
+#define MAX_HID_DEVICES              (8)
+#define MAX_XBOX_DEVICES             (4)
 
 
 /* ================== configuration as requested by the FPGA ================ */
@@ -28,6 +28,13 @@
 #define CONFIG_ACTION_COMMAND_LOAD  4
 #define CONFIG_ACTION_COMMAND_HIDE  5
 #define CONFIG_ACTION_COMMAND_LINK  6
+#define CONFIG_ACTION_COMMAND_DEFRAG 7
+#define CONFIG_ACTION_COMMAND_NEWIMAGE 8
+#define CONFIG_ACTION_COMMAND_UPLOAD 9
+#define CONFIG_ACTION_COMMAND_SNAPSHOT 10
+#define CONFIG_ACTION_COMMAND_RESTORE 11
+#define CONFIG_ACTION_COMMAND_PLAY  12
+#define CONFIG_ACTION_COMMAND_STOP  13
 
 typedef struct {
   unsigned char code;
@@ -39,6 +46,15 @@ typedef struct {
     struct {
       unsigned short ms;
     } delay;    
+    struct {
+      unsigned char drive;
+      unsigned char format;    // newimage only
+      unsigned long size;      // newimage only, kbytes
+    } image;
+    struct {
+      char *filename;
+      unsigned long address;
+    } mem;
     char *filename;
     struct config_action_S *action;
   };
@@ -0,0 +1,436 @@
+//
+// coremem.c
+//
+// Upload of files from SD card into the core's memory via the MEM
+// target, e.g. ROMs, cartridges or TOS images, as well as snapshots
+// of the core's entire state. Two buffers are used: while one is being
+// transferred from or to the core by the coremem task, the calling
+// task reads or writes the other one from or to the file.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ff.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#include <queue.h>
+#endif
+
+#include "coremem.h"
+#include "spi.h"
+#include "sdc.h"
+#include "config.h"
+#include "mcu_hw.h"
+#include "debug.h"
+
+#define COREMEM_CHUNK   4096   // bytes read from or written to file at once
+#define COREMEM_BURST   SPI_MAX_TRANSFER   // bytes per SPI transaction
+
+#define COREMEM_MAX_REGIONS   8
+#define COREMEM_SNAP_MAGIC    0x50414e53   // "SNAP"
+#define COREMEM_SNAP_VERSION  1
+
+typedef struct {
+  unsigned char *data;
+  unsigned long address;
+  int len;
+  bool read;               // from core into buffer
+} coremem_block_t;
+
+// snapshot file header, followed by all regions, each
+// preceded by its own header
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t regions;
+  char name[20];           // core name from config
+} coremem_snap_hdr_t;
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+} coremem_region_t;
+
+static QueueHandle_t coremem_full = NULL;    // blocks to be sent
+static QueueHandle_t coremem_done = NULL;    // blocks sent
+
+static void coremem_spi_begin(unsigned char cmd) {
+  spi_begin(SPI_PRIO_SYS);
+  mcu_hw_spi_tx_u08(SPI_TARGET_MEM);
+  mcu_hw_spi_tx_u08(cmd);
+}
+
+static void coremem_tx_address(unsigned long address) {
+  mcu_hw_spi_tx_u08((address >> 24) & 0xff);
+  mcu_hw_spi_tx_u08((address >> 16) & 0xff);
+  mcu_hw_spi_tx_u08((address >> 8) & 0xff);
+  mcu_hw_spi_tx_u08(address & 0xff);
+}
+
+// cores not implementing the MEM target return 0
+static unsigned char coremem_get_status(void) {
+  coremem_spi_begin(SPI_MEM_STATUS);
+  unsigned char status = mcu_hw_spi_tx_u08(0);
+  spi_end();
+  return status;
+}
+
+static void coremem_write(unsigned long address, const unsigned char *data, int len) {
+  // the core increments the address itself. Every transaction
+  // starts with the address anyway, so other transfers may
+  // get in between
+  while(len) {
+    int n = (len > COREMEM_BURST)?COREMEM_BURST:len;
+    
+    coremem_spi_begin(SPI_MEM_WRITE);
+    coremem_tx_address(address);
+    mcu_hw_spi_tx_buf(data, n);
+    spi_end();
+
+    address += n;
+    data += n;
+    len -= n;
+  }
+}
+
+static void coremem_read(unsigned long address, unsigned char *data, int len) {
+  while(len) {
+    int n = (len > COREMEM_BURST)?COREMEM_BURST:len;
+    
+    coremem_spi_begin(SPI_MEM_READ);
+    coremem_tx_address(address);
+    mcu_hw_spi_tx_u08(0);       // give the core time to fetch the first byte
+    mcu_hw_spi_rx_buf(data, n);
+    spi_end();
+
+    address += n;
+    data += n;
+    len -= n;
+  }
+}
+
+static void coremem_task(__attribute__((unused)) void *parms) {
+  coremem_block_t block;
+
+  for(;;) {
+    xQueueReceive(coremem_full, &block, portMAX_DELAY);
+    if(block.read) coremem_read(block.address, block.data, block.len);
+    else           coremem_write(block.address, block.data, block.len);
+    xQueueSendToBack(coremem_done, &block, portMAX_DELAY);
+  }
+}
+
+// the transfer task is only started if needed at all
+static void coremem_start(void) {
+  if(coremem_full) return;
+  
+  coremem_full = xQueueCreate(2, sizeof(coremem_block_t));
+  coremem_done = xQueueCreate(2, sizeof(coremem_block_t));
+  xTaskCreate(coremem_task, (char *)"coremem_task", 2048, NULL, configMAX_PRIORITIES-3, NULL);
+}
+
+static FRESULT coremem_open(FIL *fil, const char *name, BYTE mode) {
+  char fname[strlen(CARD_MOUNTPOINT) + strlen(name) + 2];
+  strcpy(fname, CARD_MOUNTPOINT);
+  strcat(fname, "/");
+  strcat(fname, name);
+
+  sdc_lock();
+  FRESULT res = f_open(fil, fname, mode);
+  sdc_unlock();
+  if(res != FR_OK) debugf("MEM: Cannot open %s", fname);
+  return res;
+}
+
+static void coremem_unlink(const char *name) {
+  char fname[strlen(CARD_MOUNTPOINT) + strlen(name) + 2];
+  strcpy(fname, CARD_MOUNTPOINT);
+  strcat(fname, "/");
+  strcat(fname, name);
+
+  sdc_lock();
+  f_unlink(fname);
+  sdc_unlock();
+}
+
+static void coremem_close(FIL *fil) {
+  sdc_lock();
+  f_close(fil);
+  sdc_unlock();
+}
+
+static void coremem_report(unsigned long total, uint32_t start) {
+  // bytes per microsecond are megabytes per second
+  uint32_t us = mcu_hw_time_us() - start;
+  if(!us) us = 1;
+  unsigned long rate = (unsigned long)((unsigned long long)total * 100 / us);
+  debugf("MEM: %lu bytes in %lu ms, %lu.%02lu MB/s", total,
+	 (unsigned long)(us / 1000), rate / 100, rate % 100);
+}
+
+// copy up to size bytes from the file into the core. Returns
+// the number of bytes copied or -1 on error
+static long coremem_from_file(FIL *fil, unsigned long address, unsigned long size,
+			      unsigned char *buffer) {
+  unsigned long total = 0;
+  int inflight = 0, idx = 0;
+  coremem_block_t block;
+  FRESULT res = FR_OK;
+  
+  while(total < size) {
+    // wait for the buffer to be reused to be sent. Blocks are
+    // sent in order, so that's the oldest one in flight
+    if(inflight == 2) {
+      xQueueReceive(coremem_done, &block, portMAX_DELAY);
+      inflight--;
+    }
+
+    UINT br;
+    block.data = buffer + idx * COREMEM_CHUNK;
+    sdc_lock();
+    res = f_read(fil, block.data, (size - total < COREMEM_CHUNK)?size - total:COREMEM_CHUNK, &br);
+    sdc_unlock();
+    if(res != FR_OK || !br) break;
+
+    block.address = address + total;
+    block.len = br;
+    block.read = false;
+    xQueueSendToBack(coremem_full, &block, portMAX_DELAY);
+    inflight++;
+    total += br;
+    idx ^= 1;
+  }
+
+  // wait for the remaining blocks to be sent
+  while(inflight--)
+    xQueueReceive(coremem_done, &block, portMAX_DELAY);
+
+  if(res != FR_OK) {
+    debugf("MEM: Read error %d", res);
+    return -1;
+  }
+  return total;
+}
+
+// copy size bytes from the core into the file
+static long coremem_to_file(FIL *fil, unsigned long address, unsigned long size,
+			    unsigned char *buffer) {
+  unsigned long requested = 0, total = 0;
+  int inflight = 0, idx = 0;
+  coremem_block_t block;
+  FRESULT res = FR_OK;
+
+  while(total < size) {
+    // keep both buffers busy reading from the core
+    while(inflight < 2 && requested < size) {
+      block.data = buffer + idx * COREMEM_CHUNK;
+      block.address = address + requested;
+      block.len = (size - requested < COREMEM_CHUNK)?size - requested:COREMEM_CHUNK;
+      block.read = true;
+      xQueueSendToBack(coremem_full, &block, portMAX_DELAY);
+      inflight++;
+      requested += block.len;
+      idx ^= 1;
+    }
+
+    // write the oldest block while the other one is being read
+    xQueueReceive(coremem_done, &block, portMAX_DELAY);
+    inflight--;
+    
+    UINT bw;
+    sdc_lock();
+    res = f_write(fil, block.data, block.len, &bw);
+    sdc_unlock();
+    if(res == FR_OK && bw != (UINT)block.len) res = FR_DENIED;   // disk full
+    if(res != FR_OK) break;
+    total += bw;
+  }
+  
+  while(inflight--)
+    xQueueReceive(coremem_done, &block, portMAX_DELAY);
+
+  if(res != FR_OK) {
+    debugf("MEM: Write error %d", res);
+    return -1;
+  }
+  return total;
+}
+
+// freeze the core and get the memory regions making up its state
+// or let it continue
+static int coremem_state(bool freeze, coremem_region_t *regions) {
+  coremem_spi_begin(SPI_MEM_STATE);
+  mcu_hw_spi_tx_u08(freeze?1:0);
+  int n = freeze?mcu_hw_spi_tx_u08(0):0;
+  if(n > COREMEM_MAX_REGIONS) n = COREMEM_MAX_REGIONS;
+  for(int i=0;i<n;i++) {
+    regions[i].address = regions[i].size = 0;
+    for(int j=0;j<4;j++) regions[i].address = (regions[i].address << 8) | mcu_hw_spi_tx_u08(0);
+    for(int j=0;j<4;j++) regions[i].size = (regions[i].size << 8) | mcu_hw_spi_tx_u08(0);
+  }
+  spi_end();
+  return n;
+}
+
+// upload a file from SD card into the core's memory. Returns the
+// number of bytes uploaded or -1 on error
+int coremem_upload(const char *name, unsigned long address) {
+  if(!(coremem_get_status() & SPI_MEM_CAP_WRITE)) {
+    debugf("MEM: Core doesn't support uploads");
+    return -1;
+  }
+  coremem_start();
+  
+  FIL fil;
+  if(coremem_open(&fil, name, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return -1;
+
+  unsigned char *buffer = malloc(2*COREMEM_CHUNK);
+  if(!buffer) {
+    coremem_close(&fil);
+    return -1;
+  }
+  
+  debugf("MEM: Uploading %s to $%lx", name, address);
+  uint32_t start = mcu_hw_time_us();
+  long total = coremem_from_file(&fil, address, ~0ul, buffer);
+  
+  coremem_close(&fil);
+  free(buffer);
+
+  if(total >= 0) coremem_report(total, start);
+  return total;
+}
+
+// save the core's state into a file
+int coremem_snapshot(const char *name) {
+  if(!(coremem_get_status() & SPI_MEM_CAP_STATE)) {
+    debugf("MEM: Core doesn't support snapshots");
+    return -1;
+  }
+  coremem_start();
+
+  FIL fil;
+  if(coremem_open(&fil, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    return -1;
+
+  unsigned char *buffer = malloc(2*COREMEM_CHUNK);
+  coremem_region_t regions[COREMEM_MAX_REGIONS];
+  int n = buffer?coremem_state(true, regions):0;
+
+  coremem_snap_hdr_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = COREMEM_SNAP_MAGIC;
+  hdr.version = COREMEM_SNAP_VERSION;
+  hdr.regions = n;
+  if(cfg && cfg->name) strncpy(hdr.name, cfg->name, sizeof(hdr.name)-1);
+  
+  debugf("MEM: Saving snapshot with %d regions to %s", n, name);
+  uint32_t start = mcu_hw_time_us();
+  unsigned long total = 0;
+  UINT bw;
+
+  sdc_lock();
+  FRESULT res = n?f_write(&fil, &hdr, sizeof(hdr), &bw):FR_INVALID_PARAMETER;
+  sdc_unlock();
+  
+  for(int i=0;res == FR_OK && i<n;i++) {
+    sdc_lock();
+    res = f_write(&fil, &regions[i], sizeof(coremem_region_t), &bw);
+    sdc_unlock();
+    
+    if(res == FR_OK) {
+      long len = coremem_to_file(&fil, regions[i].address, regions[i].size, buffer);
+      if(len < 0) res = FR_DISK_ERR;
+      else        total += len;
+    }
+  }
+
+  // let the core continue
+  if(n) coremem_state(false, NULL);
+  
+  sdc_lock();
+  if(f_close(&fil) != FR_OK && res == FR_OK) res = FR_DISK_ERR;
+  sdc_unlock();
+  if(buffer) free(buffer);
+  
+  if(res != FR_OK) {
+    // don't leave an incomplete snapshot behind
+    coremem_unlink(name);
+    debugf("MEM: Snapshot failed: %d", res);
+    return -1;
+  }
+  
+  coremem_report(total, start);
+  return 0;
+}
+
+// restore a state previously saved by coremem_snapshot()
+int coremem_restore(const char *name) {
+  if(!(coremem_get_status() & SPI_MEM_CAP_STATE)) {
+    debugf("MEM: Core doesn't support snapshots");
+    return -1;
+  }
+  coremem_start();
+
+  FIL fil;
+  if(coremem_open(&fil, name, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return -1;
+
+  // only accept snapshots of this core and with matching regions
+  unsigned char *buffer = malloc(2*COREMEM_CHUNK);
+  coremem_region_t regions[COREMEM_MAX_REGIONS];
+  int n = buffer?coremem_state(true, regions):0;
+
+  coremem_snap_hdr_t hdr;
+  UINT br;
+  sdc_lock();
+  FRESULT res = f_read(&fil, &hdr, sizeof(hdr), &br);
+  sdc_unlock();
+  if(res == FR_OK && (br != sizeof(hdr) || hdr.magic != COREMEM_SNAP_MAGIC ||
+		      hdr.version != COREMEM_SNAP_VERSION || hdr.regions != (uint32_t)n ||
+		      strncmp(hdr.name, (cfg && cfg->name)?cfg->name:"", sizeof(hdr.name)-1))) {
+    debugf("MEM: %s is no snapshot of this core", name);
+    res = FR_INVALID_OBJECT;
+  }
+
+  if(res == FR_OK) debugf("MEM: Restoring snapshot from %s", name);
+  uint32_t start = mcu_hw_time_us();
+  unsigned long total = 0;
+  
+  for(int i=0;res == FR_OK && i<n;i++) {
+    coremem_region_t region;
+    sdc_lock();
+    res = f_read(&fil, &region, sizeof(region), &br);
+    sdc_unlock();
+    if(res == FR_OK && (br != sizeof(region) || region.address != regions[i].address ||
+			region.size != regions[i].size))
+      res = FR_INVALID_OBJECT;
+    
+    if(res == FR_OK) {
+      long len = coremem_from_file(&fil, region.address, region.size, buffer);
+      if(len != (long)region.size) res = FR_DISK_ERR;
+      else                         total += len;
+    }
+  }
+
+  if(n) coremem_state(false, NULL);
+  
+  coremem_close(&fil);
+  if(buffer) free(buffer);
+
+  if(res != FR_OK) {
+    debugf("MEM: Restore failed: %d", res);
+    return -1;
+  }
+  
+  coremem_report(total, start);
+  return 0;
+}
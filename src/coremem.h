@@ -0,0 +1,14 @@
+/*
+  coremem.h
+
+  Direct access to the core's memory, e.g. to load ROMs
+*/
+
+#ifndef COREMEM_H
+#define COREMEM_H
+
+int coremem_upload(const char *name, unsigned long address);
+int coremem_snapshot(const char *name);
+int coremem_restore(const char *name);
+
+#endif // COREMEM_H
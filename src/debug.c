@@ -0,0 +1,101 @@
+//
+// debug.c
+//
+// Deferred output of TRACE level debug messages. Hot paths only store
+// a pointer to the format string and the integer arguments in a ring
+// buffer. Writers never wait. A low priority task formats and prints
+// the records, so the time spent on the serial console doesn't add to
+// e.g. the latency of sector requests.
+//
+
+#include "debug.h"
+
+#ifdef DEBUG_DEFERRED
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#endif
+
+#define DEBUG_RING_SIZE   128   // must be a power of two
+
+typedef struct {
+  const char *fmt;
+  uint32_t arg[5];
+  uint8_t lap;            // index / DEBUG_RING_SIZE, written last
+} debug_entry_t;
+
+static debug_entry_t debug_ring[DEBUG_RING_SIZE];
+static volatile uint32_t head = 0;     // next slot to be claimed
+static uint32_t tail = 0;              // next slot to be printed
+
+static uint32_t debug_claim(void) {
+#if defined(__ARM_ARCH_6M__)
+  // no atomic read-modify-write on the Cortex-M0+, see trace.c
+  UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR();
+  uint32_t idx = head++;
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+  return idx;
+#else
+  return __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void debug_record(const char *fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e) {
+  uint32_t idx = debug_claim();
+  debug_entry_t *r = &debug_ring[idx % DEBUG_RING_SIZE];
+
+  r->fmt = fmt;
+  r->arg[0] = a; r->arg[1] = b; r->arg[2] = c; r->arg[3] = d; r->arg[4] = e;
+  __atomic_store_n(&r->lap, (uint8_t)(idx / DEBUG_RING_SIZE), __ATOMIC_RELEASE);
+}
+
+static void debug_task(__attribute__((unused)) void *parms) {
+  uint32_t lost = 0;
+
+  for(;;) {
+    vTaskDelay(pdMS_TO_TICKS(20));
+
+    // writers have overtaken us?
+    uint32_t h = head;
+    if(h - tail > DEBUG_RING_SIZE) {
+      lost += h - tail - DEBUG_RING_SIZE;
+      tail = h - DEBUG_RING_SIZE;
+    }
+
+    while(tail != h) {
+      debug_entry_t *r = &debug_ring[tail % DEBUG_RING_SIZE];
+      uint8_t lap = __atomic_load_n(&r->lap, __ATOMIC_ACQUIRE);
+
+      // slot claimed but not written, yet
+      if(lap == (uint8_t)(tail / DEBUG_RING_SIZE - 1)) break;
+
+      // copy the record first, it may be overwritten while printing
+      debug_entry_t e = *r;
+      if(lap != (uint8_t)(tail / DEBUG_RING_SIZE) ||
+	 __atomic_load_n(&r->lap, __ATOMIC_ACQUIRE) != lap)
+	lost++;
+      else
+	printf(e.fmt, e.arg[0], e.arg[1], e.arg[2], e.arg[3], e.arg[4]);
+      tail++;
+    }
+
+    if(lost) {
+      debugf("%lu debug messages lost", (unsigned long)lost);
+      lost = 0;
+    }
+  }
+}
+
+void debug_init(void) {
+  // mark all slots as not yet written in lap 0
+  for(int i=0;i<DEBUG_RING_SIZE;i++)
+    debug_ring[i].lap = 0xff;
+
+  xTaskCreate(debug_task, (char *)"debug_task", 2048, NULL, tskIDLE_PRIORITY+1, NULL);
+}
+
+#endif // DEBUG_DEFERRED
@@ -5,14 +5,76 @@
 
 #define debugf(x, ...)  printf(x "\r\n", ##__VA_ARGS__)
 
-#define ini_debugf(a, ...)  debugf("\033[0;31mINI: " a "\033[0m", ##__VA_ARGS__)  // red
-#define sys_debugf(a, ...)  debugf("\033[0;32mSYS: " a "\033[0m", ##__VA_ARGS__)  // green
-#define sdc_debugf(a, ...)  debugf("\033[0;33mSDC: " a "\033[0m", ##__VA_ARGS__)  // yellow
+// Log levels per subsystem. INFO messages are printed right away.
+// TRACE messages are meant for hot paths like sector requests. They
+// are only recorded in binary form and printed later by a low
+// priority task (see debug.c). Up to five integer arguments are
+// supported, strings are not. Override a level by defining e.g.
+// SDC_DEBUG_LEVEL before including this file or on the command line
+#define DEBUG_LEVEL_OFF    0
+#define DEBUG_LEVEL_INFO   1
+#define DEBUG_LEVEL_TRACE  2
+
+#ifndef INI_DEBUG_LEVEL
+#define INI_DEBUG_LEVEL    DEBUG_LEVEL_INFO
+#endif
+#ifndef SYS_DEBUG_LEVEL
+#define SYS_DEBUG_LEVEL    DEBUG_LEVEL_INFO
+#endif
+#ifndef SDC_DEBUG_LEVEL
+#define SDC_DEBUG_LEVEL    DEBUG_LEVEL_INFO
+#endif
+#ifndef USB_DEBUG_LEVEL
+#define USB_DEBUG_LEVEL    DEBUG_LEVEL_INFO
+#endif
+#ifndef HIDP_DEBUG_LEVEL
+#define HIDP_DEBUG_LEVEL   DEBUG_LEVEL_INFO
+#endif
+#ifndef OSD_DEBUG_LEVEL
+#define OSD_DEBUG_LEVEL    DEBUG_LEVEL_INFO
+#endif
+#ifndef MENU_DEBUG_LEVEL
+#define MENU_DEBUG_LEVEL   DEBUG_LEVEL_INFO
+#endif
+#ifndef AUDIO_DEBUG_LEVEL
+#define AUDIO_DEBUG_LEVEL  DEBUG_LEVEL_INFO
+#endif
+
+#if (INI_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || (SYS_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || \
+  (SDC_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || (USB_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || \
+  (HIDP_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || (OSD_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || \
+  (MENU_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE) || (AUDIO_DEBUG_LEVEL >= DEBUG_LEVEL_TRACE)
+#define DEBUG_DEFERRED
+#endif
+
+#ifdef DEBUG_DEFERRED
+#include <stdint.h>
+void debug_init(void);
+void debug_record(const char *fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e);
+#define debug_record5(fmt, a, b, c, d, e, ...) \
+  debug_record(fmt, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d), (uint32_t)(e))
+#define debug_deferf(x, ...) debug_record5(x "\r\n", ##__VA_ARGS__, 0, 0, 0, 0, 0)
+#else
+#define debug_init()
+#define debug_deferf(x, ...) do { } while(0)
+#endif
+
+#define debug_infof(level, x, ...)  do { if(level >= DEBUG_LEVEL_INFO) debugf(x, ##__VA_ARGS__); } while(0)
+#define debug_tracef(level, x, ...) do { if(level >= DEBUG_LEVEL_TRACE) debug_deferf(x, ##__VA_ARGS__); } while(0)
+
+#define ini_debugf(a, ...)  debug_infof(INI_DEBUG_LEVEL, "\033[0;31mINI: " a "\033[0m", ##__VA_ARGS__)  // red
+#define sys_debugf(a, ...)  debug_infof(SYS_DEBUG_LEVEL, "\033[0;32mSYS: " a "\033[0m", ##__VA_ARGS__)  // green
+#define sdc_debugf(a, ...)  debug_infof(SDC_DEBUG_LEVEL, "\033[0;33mSDC: " a "\033[0m", ##__VA_ARGS__)  // yellow
 // #define usb_debugf(a, ...)  debugf("\033[0;34mUSB: " a "\033[0m", ##__VA_ARGS__)  // blue -> too dark to read
-#define usb_debugf(a, ...)  debugf("\033[0;36mUSB: " a "\033[0m", ##__VA_ARGS__)  // cyan
-#define hidp_debugf(a, ...) debugf("\033[0;35mHDP: " a "\033[0m", ##__VA_ARGS__)  // magenta
-#define osd_debugf(a, ...)  debugf("\033[0;36mOSD: " a "\033[0m", ##__VA_ARGS__)  // cyan
-#define menu_debugf(a, ...) debugf("\033[1;33mMNU: " a "\033[0m", ##__VA_ARGS__)  // bold yellow
+#define usb_debugf(a, ...)  debug_infof(USB_DEBUG_LEVEL, "\033[0;36mUSB: " a "\033[0m", ##__VA_ARGS__)  // cyan
+#define hidp_debugf(a, ...) debug_infof(HIDP_DEBUG_LEVEL, "\033[0;35mHDP: " a "\033[0m", ##__VA_ARGS__)  // magenta
+#define osd_debugf(a, ...)  debug_infof(OSD_DEBUG_LEVEL, "\033[0;36mOSD: " a "\033[0m", ##__VA_ARGS__)  // cyan
+#define menu_debugf(a, ...) debug_infof(MENU_DEBUG_LEVEL, "\033[1;33mMNU: " a "\033[0m", ##__VA_ARGS__)  // bold yellow
+#define audio_debugf(a, ...) debug_infof(AUDIO_DEBUG_LEVEL, "\033[1;32mAUD: " a "\033[0m", ##__VA_ARGS__) // bold green
+
+// deferred variants for hot paths
+#define sdc_tracef(a, ...)  debug_tracef(SDC_DEBUG_LEVEL, "\033[0;33mSDC: " a "\033[0m", ##__VA_ARGS__)
+#define usb_tracef(a, ...)  debug_tracef(USB_DEBUG_LEVEL, "\033[0;36mUSB: " a "\033[0m", ##__VA_ARGS__)
 
 #include <ctype.h>
 static inline void hexdump(const void *data, int size) {
@@ -8,6 +8,8 @@
 #include <freertos/timers.h>
 #include <freertos/queue.h>
 
+#include <stdlib.h>
+
 #define ENABLE_WIFI
 
 #include "../hidparser.h"
@@ -16,6 +18,8 @@
 #include "../hid.h"
 #include "../config.h"
 #include "../sysctrl.h"
+#include "../spi.h"
+#include "../trace.h"
 
 #include "driver/uart.h"
 
@@ -33,11 +37,9 @@
 #include "usb/usb_host.h"
 #include "usb/hid_host.h"
 
-static struct {
-  hid_host_device_handle_t handle;
-  hid_state_t state;
-  hid_report_t rep;
-} hid_device[MAX_HID_DEVICES];
+// each opened HID interface gets its own dynamically allocated
+// entry which is passed as the callback argument
+static int hid_devices = 0;
 
 QueueHandle_t hid_host_event_queue;
 
@@ -49,7 +51,8 @@ typedef struct {
 
 void hid_host_interface_callback(hid_host_device_handle_t hid_device_handle,
                                  const hid_host_interface_event_t event, void *arg) {
-    uint8_t data[16];
+    hid_iface_t *iface = (hid_iface_t *)arg;
+    uint8_t data[64];
     size_t data_length = 0;
 
     switch (event) {
@@ -57,26 +60,17 @@ void hid_host_interface_callback(hid_host_device_handle_t hid_device_handle,
         USB_ERROR_CHECK( hid_host_device_get_raw_input_report_data(hid_device_handle,
 					   data, sizeof(data), &data_length));
 
-	// find matching hid report
-	for(int idx=0;idx<MAX_HID_DEVICES;idx++)
-	  if(hid_device[idx].handle == hid_device_handle)     
-	    hid_parse(&hid_device[idx].rep, &hid_device[idx].state, data, data_length);
-	  
+	hid_parse(iface, data, data_length);
         break;
 	
     case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
         usb_debugf("HID Device DISCONNECTED");
         USB_ERROR_CHECK( hid_host_device_close(hid_device_handle) );
 
-	// find and remove entry
-	for(int idx=0;idx<MAX_HID_DEVICES;idx++) {
-	  if(hid_device[idx].handle == hid_device_handle) {
-	    usb_debugf("releasing %d", idx);
-	    hid_device[idx].handle = NULL;
-	    if(hid_device[idx].rep.type == REPORT_TYPE_JOYSTICK)
-	      hid_release_joystick(hid_device[idx].state.joystick.js_index);
-	  }
-	}
+	// remove entry
+	hid_iface_release(iface);
+	free(iface);
+	hid_devices--;
 	break;
     case HID_HOST_INTERFACE_EVENT_TRANSFER_ERROR:
         usb_debugf("HID Device: TRANSFER_ERROR");
@@ -94,9 +88,19 @@ void hid_host_device_event(hid_host_device_handle_t hid_device_handle,
     case HID_HOST_DRIVER_EVENT_CONNECTED:
         usb_debugf("HID Device: CONNECTED");
 
+	if(hid_devices == MAX_HID_DEVICES) {
+	  usb_debugf("Error, no more free HID entries");
+	  break;
+	}
+	
+	hid_iface_t *iface = malloc(sizeof(hid_iface_t));
+	if(!iface) break;
+	iface->reports.count = 0;
+	hid_devices++;
+	
         const hid_host_device_config_t dev_config = {
             .callback = hid_host_interface_callback,
-            .callback_arg = NULL
+            .callback_arg = iface
         };
 
         USB_ERROR_CHECK( hid_host_device_open(hid_device_handle, &dev_config) );
@@ -108,21 +112,14 @@ void hid_host_device_event(hid_host_device_handle_t hid_device_handle,
 	// request report descriptor
 	size_t report_desc_len;
 	uint8_t *report_desc = hid_host_get_report_descriptor(hid_device_handle, &report_desc_len);
-	if(report_desc) {	
-	  int idx;
-	  for(idx=0;idx<MAX_HID_DEVICES && (hid_device[idx].handle != NULL);idx++);
-	  if(idx != MAX_HID_DEVICES) {
-	    usb_debugf("Using HID entry %d", idx);
-	    
-	    if(parse_report_descriptor(report_desc, report_desc_len, &hid_device[idx].rep, NULL)) {
-	      hid_device[idx].handle = hid_device_handle;
-	      if(hid_device[idx].rep.type == REPORT_TYPE_JOYSTICK)
-		hid_device[idx].state.joystick.js_index = hid_allocate_joystick();
-	      
-	      USB_ERROR_CHECK( hid_host_device_start(hid_device_handle) );
-	    } else
-	      usb_debugf("ignoring device");
-	  }
+	if(report_desc && hid_iface_init(iface, report_desc, report_desc_len))
+	  USB_ERROR_CHECK( hid_host_device_start(hid_device_handle) );
+	else {
+	  // don't let an ignored device occupy an entry
+	  usb_debugf("ignoring device");
+	  USB_ERROR_CHECK( hid_host_device_close(hid_device_handle) );
+	  free(iface);
+	  hid_devices--;
 	}
         break;
     default:
@@ -290,10 +287,6 @@ static void usb_init(void) {
     usb_debugf("Initializing");    
     debugf("USB D+/D- on GPIO20 and GPIO19");
 
-  // mark all entries as unused
-    for(int idx=0;idx<MAX_HID_DEVICES;idx++)
-      hid_device[idx].handle = NULL;
-
 /*
     * Create usb_lib_task to:
     * - initialize USB Host library
@@ -354,6 +347,7 @@ static void usb_init(void) {
 
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
 
 #define PIN_NUM_MISO 13
 #define PIN_NUM_MOSI 11
@@ -363,13 +357,13 @@ static void usb_init(void) {
 
 extern TaskHandle_t com_task_handle;
 static spi_device_handle_t spi;
-static SemaphoreHandle_t sem;
 
 static void irq_handler(void *) {
   // debugf("IRQ");
   
   // Disable interrupt. It will be re-enabled by the com task
   gpio_intr_disable(PIN_NUM_IRQ);
+  trace_event(TRACE_IRQ, 0);
 
   if(com_task_handle) {    
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -378,10 +372,21 @@ static void irq_handler(void *) {
   }
 }
   
+static spi_device_interface_config_t devcfg = {
+  .clock_speed_hz = 20 * 1000 * 1000,      // 20 MHz, may be raised by calibration
+  .mode = 1,                               // SPI mode 1
+  .spics_io_num = -1,
+  .command_bits = 0,                       // no command, address or dummy bits since we
+  .address_bits = 0,                       // are tranferring single bytes
+  .dummy_bits = 0,     
+  .queue_size = 7,                         // We want to be able to queue 7 transactions at a time
+};
+
 void mcu_hw_spi_init(void) {
   debugf("Initializing SPI");
 
-  sem = xSemaphoreCreateMutex();
+  // bus arbitration between the different users
+  spi_arbiter_init();
 
   debugf("  MISO = GPIO%d", PIN_NUM_MISO);
   debugf("  SCK  = GPIO%d", PIN_NUM_CLK);
@@ -393,21 +398,11 @@ void mcu_hw_spi_init(void) {
      .sclk_io_num = PIN_NUM_CLK,
      .quadwp_io_num = -1,
      .quadhd_io_num = -1,
-     .max_transfer_sz = 32
+     .max_transfer_sz = 1024                  // allow for full OSD frames
   };
   
   spi_bus_initialize(SPI2_HOST, &buscfg, SPI_DMA_CH_AUTO);
 
-  spi_device_interface_config_t devcfg = {
-     .clock_speed_hz = 20 * 1000 * 1000,      // 20 MHz
-     .mode = 1,                               // SPI mode 1
-     .spics_io_num = -1,
-     .command_bits = 0,                       // no command, address or dummy bits since we
-     .address_bits = 0,                       // are tranferring single bytes
-     .dummy_bits = 0,     
-     .queue_size = 7,                         // We want to be able to queue 7 transactions at a time
-  };
-  
   spi_bus_add_device(SPI2_HOST, &devcfg, &spi);
 
   // Chip select is active-low, so we'll initialise it to a driven-high state
@@ -430,14 +425,17 @@ void mcu_hw_irq_ack(void) {
   gpio_intr_enable(PIN_NUM_IRQ);
 }
 
+uint32_t mcu_hw_time_us(void) {
+  return esp_timer_get_time();
+}
+
+// access to the bus is arbitrated by spi_begin() and spi_end()
 void mcu_hw_spi_begin() {
-  xSemaphoreTake(sem, 0xffffffffUL);      // wait forever
   gpio_set_level(PIN_NUM_CS, 0);  
 }
 
 void mcu_hw_spi_end() {
   gpio_set_level(PIN_NUM_CS, 1);
-  xSemaphoreGive(sem);
 }
 
 unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
@@ -459,6 +457,41 @@ unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
   return retval;
 }
 
+void mcu_hw_spi_tx_buf(const unsigned char *buf, int len) {
+  spi_transaction_t trans = {
+    .length = 8*len,
+    .tx_buffer = buf,
+    .rx_buffer = NULL
+  };
+
+  if(spi_device_polling_transmit(spi, &trans) != ESP_OK)
+    debugf("SPI failed");
+}
+
+void mcu_hw_spi_rx_buf(unsigned char *buf, int len) {
+  spi_transaction_t trans = {
+    .length = 8*len,
+    .tx_buffer = NULL,
+    .rx_buffer = buf
+  };
+
+  if(spi_device_polling_transmit(spi, &trans) != ESP_OK)
+    debugf("SPI failed");
+}
+
+int mcu_hw_spi_set_clock(int hz) {
+  // the device has to be re-added to change its clock
+  spi_bus_remove_device(spi);
+  devcfg.clock_speed_hz = hz;
+  spi_bus_add_device(SPI2_HOST, &devcfg, &spi);
+
+  int khz;
+  if(spi_device_get_actual_freq(spi, &khz) == ESP_OK)
+    return 1000*khz;
+  
+  return hz;
+}
+
 /* ========================================================================= */
 /* ========                          WiFI                           ======== */
 /* ========================================================================= */
@@ -9,38 +9,157 @@
 
 #include "inifile.h"
 #include "mcu_hw.h"
+#include "trace.h"
 
 #include <string.h>  // for memcpy
 
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/timers.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <timers.h>
+#include <task.h>
+#endif
+
+// print mouse statistics every 1000 reports
+// #define HID_MOUSE_STATS
+
 // keep a map of joysticks to be able to report
 // them individually
 static uint8_t joystick_map = 0;
 
+// returns HID_JOYSTICK_NONE if all indices are in use. Such a
+// joystick is then ignored
 uint8_t hid_allocate_joystick(void) {
   uint8_t idx;
-  for(idx=0;joystick_map & (1<<idx);idx++);
+  for(idx=0;idx<HID_MAX_JOYSTICKS && (joystick_map & (1<<idx));idx++);
+  if(idx == HID_MAX_JOYSTICKS) {
+    usb_debugf("No free joystick index (map = %02x)", joystick_map);
+    return HID_JOYSTICK_NONE;
+  }
+  
   joystick_map |= (1<<idx);
   usb_debugf("Allocating joystick %d (map = %02x)", idx, joystick_map);
   return idx;
 }
 
 void hid_release_joystick(uint8_t idx) {
+  if(idx == HID_JOYSTICK_NONE) return;
+  
   joystick_map &= ~(1<<idx);
   usb_debugf("Releasing joystick %d (map = %02x)", idx, joystick_map);
 }
   
-static void kbd_tx(uint8_t byte) {
-  mcu_hw_spi_begin();
-  mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-  mcu_hw_spi_tx_u08(SPI_HID_KEYBOARD);
-  mcu_hw_spi_tx_u08(byte);
-  mcu_hw_spi_end();
+// Dump all HID descriptors, incoming reports and the resulting SPI
+// messages in a plain line based format. The output of a session
+// with real devices can be captured from the debug UART and be
+// replayed by src/tools/hidreplay to verify that parser changes
+// don't alter the SPI byte stream sent to the core:
+//   HIDT <tick> F <feature byte reported by the core>
+//   HIDT <tick> D <iface> <descriptor bytes>
+//   HIDT <tick> R <iface> <report bytes>
+//   HIDT <tick> P <pad>                        xinput pad attached
+//   HIDT <tick> X <pad> <buttons, lx, ly as 16 bit little endian>
+//   HIDT <tick> U <iface or pad>               device removed
+//   HIDT <tick> S <spi bytes>
+// #define HID_TRACE
+
+#ifdef HID_TRACE
+#define HID_TRACE_MAX  32
+
+static struct {
+  uint8_t len;
+  uint8_t data[HID_TRACE_MAX];
+} hid_trace;
+
+static void hid_trace_dump(char tag, const void *iface, const uint8_t *data, int len) {
+  printf("HIDT %lu %c", (unsigned long)xTaskGetTickCount(), tag);
+  if(iface) printf(" %p", iface);
+  for(int i=0;i<len;i++) printf(" %02x", data[i]);
+  printf("\r\n");
+}
+#endif
+
+// all SPI traffic of the HID subsystem goes through these, so it
+// can be recorded when tracing is enabled
+static void hid_spi_begin(void) {
+  spi_begin(SPI_PRIO_HID);
+#ifdef HID_TRACE
+  hid_trace.len = 0;
+#endif
+}
+
+static unsigned char hid_spi_tx(unsigned char byte) {
+#ifdef HID_TRACE
+  if(hid_trace.len < HID_TRACE_MAX)
+    hid_trace.data[hid_trace.len++] = byte;
+#endif
+  return mcu_hw_spi_tx_u08(byte);
+}
+
+static void hid_spi_end(void) {
+  trace_event(TRACE_HID_SPI, 0);
+#ifdef HID_TRACE
+  // dump while still holding the bus so messages don't interleave
+  hid_trace_dump('S', NULL, hid_trace.data, hid_trace.len);
+#endif
+  spi_end();
+}
+
+// features reported by the core via SPI_HID_STATUS
+static uint8_t hid_features = 0;
+
+// a single report may change up to 8 modifiers and release
+// and press up to 6 keys each
+#define KBD_MAX_EVENTS  (8+6+6)
+
+typedef struct {
+  uint8_t count;
+  uint8_t code[KBD_MAX_EVENTS];
+} kbd_events_t;
+
+static void kbd_tx(kbd_events_t *ev, uint8_t byte) {
+  if(ev->count < KBD_MAX_EVENTS)
+    ev->code[ev->count++] = byte;
+}
+
+// send all events collected from one report. Cores supporting it
+// receive them in one message which keeps them in order and reduces
+// the number of SPI transactions. Others get one message per event
+static void kbd_flush(kbd_events_t *ev) {
+  if(!ev->count) return;
+
+  if(ev->count > 1 && (hid_features & SPI_HID_FEATURE_KBD_MULTI)) {
+    hid_spi_begin();
+    hid_spi_tx(SPI_TARGET_HID);
+    hid_spi_tx(SPI_HID_KEYBOARD_MULTI);
+    hid_spi_tx(ev->count);
+    for(int i=0;i<ev->count;i++)
+      hid_spi_tx(ev->code[i]);
+    hid_spi_end();
+  } else {
+    for(int i=0;i<ev->count;i++) {
+      hid_spi_begin();
+      hid_spi_tx(SPI_TARGET_HID);
+      hid_spi_tx(SPI_HID_KEYBOARD);
+      hid_spi_tx(ev->code[i]);
+      hid_spi_end();
+    }
+  }
+  
+  ev->count = 0;
 }
 
 void kbd_parse(__attribute__((unused)) const hid_report_t *report, struct hid_kbd_state_S *state,
 	       const unsigned char *buffer, int nbytes) {
   // we expect boot mode packets which are exactly 8 bytes long
   if(nbytes != 8) return;
+
+  kbd_events_t ev = { .count = 0 };
   
   // check if modifier have changed
   if((buffer[0] != state->last_report[0]) && !osd_is_visible()) {
@@ -48,10 +167,10 @@ void kbd_parse(__attribute__((unused)) const hid_report_t *report, struct hid_kb
       if(core_map_modifier_key(i)) {      
 	// modifier released?
 	if((state->last_report[0] & (1<<i)) && !(buffer[0] & (1<<i)))
-	  kbd_tx(0x80 | core_map_modifier_key(i));
+	  kbd_tx(&ev, 0x80 | core_map_modifier_key(i));
 	// modifier pressed?
 	if(!(state->last_report[0] & (1<<i)) && (buffer[0] & (1<<i)))
-	  kbd_tx(core_map_modifier_key(i));
+	  kbd_tx(&ev, core_map_modifier_key(i));
       }
     }
   } 
@@ -65,7 +184,7 @@ void kbd_parse(__attribute__((unused)) const hid_report_t *report, struct hid_kb
 	  // check if the reported key is the OSD activation hotkey
 	  // and suppress reporting it to the core
 	  if(state->last_report[2+i] != inifile_option_get(INIFILE_OPTION_HOTKEY))
-	    kbd_tx(0x80 | core_map_key(state->last_report[2+i]));
+	    kbd_tx(&ev, 0x80 | core_map_key(state->last_report[2+i]));
 	} else
 	  menu_notify(MENU_EVENT_KEY_RELEASE);
       }
@@ -88,7 +207,7 @@ void kbd_parse(__attribute__((unused)) const hid_report_t *report, struct hid_kb
  	  msg = MENU_EVENT_BACK;
 	else {
 	  if(!osd_is_visible())
-	    kbd_tx(core_map_key(buffer[2+i]));
+	    kbd_tx(&ev, core_map_key(buffer[2+i]));
 	  else {
 	    // check if cursor up/down or space has been pressed
 	    if(buffer[2+i] == 0x51) msg = MENU_EVENT_DOWN;      
@@ -105,110 +224,178 @@ void kbd_parse(__attribute__((unused)) const hid_report_t *report, struct hid_kb
       }   
     }
   }
+
+  kbd_flush(&ev);
   memcpy(state->last_report, buffer, 8);
 }
 
-// collect bits from byte stream and assemble them into a signed word
-static uint16_t collect_bits(const uint8_t *p, uint16_t offset, uint8_t size, bool is_signed) {
-  // mask unused bits of first byte
-  uint8_t mask = 0xff << (offset&7);
-  uint8_t byte = offset/8;
-  uint8_t bits = size;
-  uint8_t shift = offset&7;
-  
-  //  iusb_debugf("0 m:%x by:%d bi=%d sh=%d ->", mask, byte, bits, shift);
-  uint16_t rval = (p[byte++] & mask) >> shift;
-  mask = 0xff;
-  shift = 8-shift;
-  bits -= shift;
-  
-  // first byte already contained more bits than we need
-  if(shift > size) {
-    // mask unused bits
-    rval &= (1<<size)-1;
-  } else {
-    // further bytes if required
-    while(bits) {
-      mask = (bits<8)?(0xff>>(8-bits)):0xff;
-      rval += (p[byte++] & mask) << shift;
-      shift += 8;
-      bits -= (bits>8)?8:bits;
-    }
-  }
-  
-  if(is_signed) {
-    // do sign expansion
-    uint16_t sign_bit = 1<<(size-1);
-    if(rval & sign_bit) {
-      while(sign_bit) {
-	rval |= sign_bit;
-	sign_bit <<= 1;
+// Mouse motion is accumulated and sent into the core at most at the
+// rate set by the mouse_rate option. Motion held back by this is sent
+// by the mouse task once a timer expires if no further report arrives
+// in time. The timer itself must not block on the SPI bus, as that
+// would delay all other timers of the system.
+#define MOUSE_MAX_PENDING  4
+
+static SemaphoreHandle_t mouse_sem = NULL;
+static TimerHandle_t mouse_timer = NULL;
+static TaskHandle_t mouse_task_handle = NULL;
+static struct hid_mouse_state_S *mouse_pending[MOUSE_MAX_PENDING];
+
+static int mouse_clamp(int v) {
+  if(v >  127) return  127;
+  if(v < -127) return -127;
+  return v;
+}
+
+// send accumulated motion into the core. Movements exceeding the 8
+// bit range are split into several messages. Only the last one carries
+// a changed button state
+static void mouse_tx(struct hid_mouse_state_S *state, uint8_t btns) {
+  do {
+    int dx = mouse_clamp(state->acc_x);
+    int dy = mouse_clamp(state->acc_y);
+    state->acc_x -= dx;
+    state->acc_y -= dy;
+    if(state->acc_x || state->acc_y) state->split++;
+    
+    hid_spi_begin();
+    hid_spi_tx(SPI_TARGET_HID);
+    hid_spi_tx(SPI_HID_MOUSE);
+    hid_spi_tx((state->acc_x || state->acc_y)?state->btns:btns);
+    hid_spi_tx(dx);
+    hid_spi_tx(dy);
+    hid_spi_end();
+  } while(state->acc_x || state->acc_y);
+
+  state->btns = btns;
+  state->last_tx = xTaskGetTickCount();
+}
+
+static void mouse_lock(void) {
+  if(mouse_sem) xSemaphoreTake(mouse_sem, portMAX_DELAY);
+}
+
+static void mouse_unlock(void) {
+  if(mouse_sem) xSemaphoreGive(mouse_sem);
+}
+
+static void mouse_task(__attribute__((unused)) void *parms) {
+  for(;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    mouse_lock();
+    for(int i=0;i<MOUSE_MAX_PENDING;i++) {
+      if(mouse_pending[i]) {
+	if(mouse_pending[i]->acc_x || mouse_pending[i]->acc_y)
+	  mouse_tx(mouse_pending[i], mouse_pending[i]->btns);
+	mouse_pending[i] = NULL;
       }
     }
+    mouse_unlock();
+  }
+}
+
+static void mouse_timer_handler(__attribute__((unused)) TimerHandle_t pxTimer) {
+  xTaskNotifyGive(mouse_task_handle);
+}
+
+// hold back motion and make sure the mouse task sends it later. Returns
+// false if this isn't possible
+static bool mouse_defer(struct hid_mouse_state_S *state, TickType_t period) {
+  int free = -1;
+  for(int i=0;i<MOUSE_MAX_PENDING;i++) {
+    if(mouse_pending[i] == state) return true;   // already waiting for the timer
+    if(!mouse_pending[i] && free < 0) free = i;
   }
+  if(free < 0) return false;
+
+  // the mouse task flushes all pending mice at once
+  mouse_pending[free] = state;
+  if(!xTimerIsTimerActive(mouse_timer))
+    xTimerChangePeriod(mouse_timer, period - (xTaskGetTickCount() - state->last_tx), 0);
   
-  return rval;
+  return true;
+}
+
+// the mouse is gone, make sure the mouse task doesn't touch it anymore
+static void mouse_release(struct hid_mouse_state_S *state) {
+  mouse_lock();
+  for(int i=0;i<MOUSE_MAX_PENDING;i++)
+    if(mouse_pending[i] == state)
+      mouse_pending[i] = NULL;
+  mouse_unlock();
 }
 
-void mouse_parse(const hid_report_t *report, __attribute__((unused)) struct hid_mouse_state_S *state,
+void mouse_parse(const hid_report_t *report, struct hid_mouse_state_S *state,
 		 const unsigned char *buffer, int nbytes) {
+  state->reports++;
+  
+#ifdef HID_MOUSE_STATS
+  if(!(state->reports % 1000))
+    usb_debugf("Mouse: %lu reports, %lu merged, %lu split, %lu dropped",
+	       state->reports, state->merged, state->split, state->dropped);
+#endif
+  
   // we expect at least three bytes:
-  if(nbytes < 3) return;
+  if(nbytes < 3) {
+    state->dropped++;
+    return;
+  }
   
-  // collect info about the two axes
+  // collect info about the two axes. The parser has marked them
+  // as signed
   int a[2];
-  for(int i=0;i<2;i++) {  
-    bool is_signed = report->joystick_mouse.axis[i].logical.min > 
-      report->joystick_mouse.axis[i].logical.max;
-
-    a[i] = collect_bits(buffer, report->joystick_mouse.axis[i].offset, 
-			report->joystick_mouse.axis[i].size, is_signed);
-  }
+  for(int i=0;i<2;i++)
+    a[i] = (int16_t)hid_get_field(&report->joystick_mouse.axis[i].field, buffer);
 
   // ... and two buttons
   uint8_t btns = 0;
   for(int i=0;i<2;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-       report->joystick_mouse.button[i].bitmask)
-      btns |= (1<<i);
-
-  mcu_hw_spi_begin();
-  mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-  mcu_hw_spi_tx_u08(SPI_HID_MOUSE);
-  mcu_hw_spi_tx_u08(btns);
-  mcu_hw_spi_tx_u08(a[0]);
-  mcu_hw_spi_tx_u08(a[1]);
-  mcu_hw_spi_end();
+    btns |= (!!(buffer[report->joystick_mouse.button[i].byte_offset] & 
+		report->joystick_mouse.button[i].bitmask)) << i;
+
+  mouse_lock();
+  state->acc_x += a[0];
+  state->acc_y += a[1];
+
+  // button changes are always sent immediately. Motion only if the
+  // last message is old enough
+  int rate = inifile_option_get(INIFILE_OPTION_MOUSE_RATE);
+  TickType_t period = (rate > 0)?pdMS_TO_TICKS(1000/rate):0;
+  if(!period) period = 1;
+  
+  if(!mouse_timer || rate <= 0 || btns != state->btns ||
+     (TickType_t)(xTaskGetTickCount() - state->last_tx) >= period ||
+     !mouse_defer(state, period))
+    mouse_tx(state, btns);
+  else
+    state->merged++;
+  mouse_unlock();
 }
 
 void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *state,
 		    const unsigned char *buffer, __attribute__((unused)) int nbytes) {
+  if(state->js_index == HID_JOYSTICK_NONE) return;
+  
   //  usb_debugf("joystick: %d %02x %02x %02x %02x", nbytes,
   //  	 buffer[0]&0xff, buffer[1]&0xff, buffer[2]&0xff, buffer[3]&0xff);
 
   // collect info about the two axes
   int a[2];
-  for(int i=0;i<2;i++) {  
-    bool is_signed = report->joystick_mouse.axis[i].logical.min > 
-      report->joystick_mouse.axis[i].logical.max;
-    
-    a[i] = collect_bits(buffer, report->joystick_mouse.axis[i].offset, 
-			report->joystick_mouse.axis[i].size, is_signed);
-  }
+  for(int i=0;i<2;i++)
+    a[i] = hid_get_field(&report->joystick_mouse.axis[i].field, buffer);
 
-  // ... and four buttons
+  // ... and four buttons. Unused buttons have an empty bitmask
   unsigned char joy = 0;
   for(int i=0;i<4;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-       report->joystick_mouse.button[i].bitmask)
-      joy |= (0x10<<i);
+    joy |= (!!(buffer[report->joystick_mouse.button[i].byte_offset] & 
+	       report->joystick_mouse.button[i].bitmask)) << (4+i);
 
   // ... and the eight extra buttons
   unsigned char btn_extra = 0;
   for(int i=4;i<12;i++)
-    if(buffer[report->joystick_mouse.button[i].byte_offset] & 
-      report->joystick_mouse.button[i].bitmask) 
-      btn_extra |= (1<<(i-4));
+    btn_extra |= (!!(buffer[report->joystick_mouse.button[i].byte_offset] & 
+		     report->joystick_mouse.button[i].bitmask)) << (i-4);
 
   // map directions to digital
   if(a[0] > 0xc0) joy |= 0x01;
@@ -227,17 +414,17 @@ void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *sta
     state->last_state_x = ax;
     state->last_state_y = ay;
     state->last_state_btn_extra = btn_extra;
-    usb_debugf("JOY%d: D %02x X %02x Y %02x EB %02x", state->js_index, joy, ax, ay, btn_extra);
-
-    mcu_hw_spi_begin();
-    mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-    mcu_hw_spi_tx_u08(SPI_HID_JOYSTICK);
-    mcu_hw_spi_tx_u08(state->js_index);
-    mcu_hw_spi_tx_u08(joy);
-    mcu_hw_spi_tx_u08(ax); // e.g. gamepad X
-    mcu_hw_spi_tx_u08(ay); // e.g. gamepad Y
-    mcu_hw_spi_tx_u08(btn_extra); // e.g. gamepad extra buttons
-    mcu_hw_spi_end();
+    usb_tracef("JOY%d: D %02x X %02x Y %02x EB %02x", state->js_index, joy, ax, ay, btn_extra);
+
+    hid_spi_begin();
+    hid_spi_tx(SPI_TARGET_HID);
+    hid_spi_tx(SPI_HID_JOYSTICK);
+    hid_spi_tx(state->js_index);
+    hid_spi_tx(joy);
+    hid_spi_tx(ax); // e.g. gamepad X
+    hid_spi_tx(ay); // e.g. gamepad Y
+    hid_spi_tx(btn_extra); // e.g. gamepad extra buttons
+    hid_spi_end();
   }
 }
 
@@ -251,65 +438,237 @@ void rii_joy_parse(const unsigned char *buffer) {
 
   usb_debugf("RII Joy: %02x %02x", 0, b);
   
-  mcu_hw_spi_begin();
-  mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-  mcu_hw_spi_tx_u08(SPI_HID_JOYSTICK);
-  mcu_hw_spi_tx_u08(0);  // Rii joystick always report as joystick 0
-  mcu_hw_spi_tx_u08(b);
-  mcu_hw_spi_tx_u08(0);  // analog X
-  mcu_hw_spi_tx_u08(0);  // analog Y
-  mcu_hw_spi_tx_u08(0);  // extra buttons
-  mcu_hw_spi_end();
+  hid_spi_begin();
+  hid_spi_tx(SPI_TARGET_HID);
+  hid_spi_tx(SPI_HID_JOYSTICK);
+  hid_spi_tx(0);  // Rii joystick always report as joystick 0
+  hid_spi_tx(b);
+  hid_spi_tx(0);  // analog X
+  hid_spi_tx(0);  // analog Y
+  hid_spi_tx(0);  // extra buttons
+  hid_spi_end();
+}
+
+// xinput button bits
+#define XINPUT_DPAD_UP         0x0001
+#define XINPUT_DPAD_DOWN       0x0002
+#define XINPUT_DPAD_LEFT       0x0004
+#define XINPUT_DPAD_RIGHT      0x0008
+#define XINPUT_START           0x0010
+#define XINPUT_BACK            0x0020
+#define XINPUT_LEFT_SHOULDER   0x0100
+#define XINPUT_RIGHT_SHOULDER  0x0200
+
+// scale a stick value from [-32768, 32767] to [1, 255]
+static uint8_t xinput_scale_analog(int16_t val) {
+  uint8_t scaled = (val + 32768) / 256;
+  return scaled?scaled:1;
+}
+
+void xinput_init(struct hid_xinput_state_S *state) {
+  memset(state, 0, sizeof(struct hid_xinput_state_S));
+  state->js_index = hid_allocate_joystick();
+  
+#ifdef HID_TRACE
+  hid_trace_dump('P', state, NULL, 0);
+#endif
+}
+
+void xinput_release(struct hid_xinput_state_S *state) {
+#ifdef HID_TRACE
+  hid_trace_dump('U', state, NULL, 0);
+#endif
+
+  hid_release_joystick(state->js_index);
+  state->js_index = HID_JOYSTICK_NONE;
 }
 
-void hid_parse(const hid_report_t *report, hid_state_t *state, uint8_t const* data, uint16_t len) {
-  //  usb_debugf("hid parse %d, expect %d", len, report->report_size);
-  if(!len) return;
+void xinput_parse(struct hid_xinput_state_S *state, uint16_t buttons, int16_t lx, int16_t ly) {
+#ifdef HID_TRACE
+  uint8_t raw[6] = { buttons & 0xff, buttons >> 8, lx & 0xff, (lx >> 8) & 0xff, ly & 0xff, (ly >> 8) & 0xff };
+  hid_trace_dump('X', state, raw, sizeof(raw));
+#endif
   
-  // hexdump((void*)data, len);
-
-  // the following is a hack for the Rii keyboard/touch combos to use the
-  // left top multimedia pad as a joystick. These special keys are sent
-  // via the mouse/touchpad part
-  if(report->report_id_present &&
-     report->type == REPORT_TYPE_MOUSE &&
-     len == 3 &&
-     data[0] != report->report_id) {
-    rii_joy_parse(data+1);
+  // ignore pads without joystick index
+  if(state->js_index == HID_JOYSTICK_NONE) return;
+  
+  // build new state
+  unsigned char joy =
+    ((buttons & XINPUT_DPAD_UP   )?0x08:0x00) |
+    ((buttons & XINPUT_DPAD_DOWN )?0x04:0x00) |
+    ((buttons & XINPUT_DPAD_LEFT )?0x02:0x00) |
+    ((buttons & XINPUT_DPAD_RIGHT)?0x01:0x00) |
+    ((buttons & 0xf000) >> 8); // Y, X, B, A
+
+  // build extra button new state
+  unsigned char btn_extra =
+    ((buttons & XINPUT_LEFT_SHOULDER  )?0x01:0x00) |
+    ((buttons & XINPUT_RIGHT_SHOULDER )?0x02:0x00) |
+    ((buttons & XINPUT_BACK           )?0x10:0x00) | // Rumblepad 2 / Dual Action compatibility
+    ((buttons & XINPUT_START          )?0x20:0x00);
+
+  // build analog stick x,y state
+  uint8_t ax = xinput_scale_analog(lx);
+  uint8_t ay = ~xinput_scale_analog(ly);
+
+  // map analog stick directions to digital
+  if(ax > 0xc0) joy |= 0x01;
+  if(ax < 0x40) joy |= 0x02;
+  if(ay > 0xc0) joy |= 0x04;
+  if(ay < 0x40) joy |= 0x08;
+
+  // submit if state has changed. Stick noise below the 8 bit
+  // resolution sent to the core is ignored
+  if(joy == state->last_state && btn_extra == state->last_state_btn_extra &&
+     ax == state->last_state_x && ay == state->last_state_y)
     return;
-  }
 
-  // check and skip report id if present
-  if(report->report_id_present && (len-1 == report->report_size)) {
-    if(data[0] != report->report_id) {
-      usb_debugf("FAIL %d != %d", data[0], report->report_id);
+  state->last_state = joy;
+  state->last_state_btn_extra = btn_extra;
+  state->last_state_x = ax;
+  state->last_state_y = ay;
+  usb_tracef("XBOX Joy%d: B %02x EB %02x X %02x Y %02x", state->js_index, joy, btn_extra, ax, ay);
+
+  hid_spi_begin();
+  hid_spi_tx(SPI_TARGET_HID);
+  hid_spi_tx(SPI_HID_JOYSTICK);
+  hid_spi_tx(state->js_index);
+  hid_spi_tx(joy);
+  hid_spi_tx(ax); // gamepad analog X
+  hid_spi_tx(ay); // gamepad analog Y
+  hid_spi_tx(btn_extra); // gamepad extra buttons
+  hid_spi_end();
+}
+
+// the Rii keyboard/touch combos report their left top multimedia pad
+// with an id the descriptor doesn't announce as usable. These are used
+// as a joystick
+static bool hid_is_rii(const hid_iface_t *iface, uint16_t len) {
+  if(len != 3) return false;
+  
+  for(int i=0;i<iface->reports.count;i++)
+    if(iface->reports.report[i].report_id_present &&
+       iface->reports.report[i].type == REPORT_TYPE_MOUSE)
+      return true;
+
+  return false;
+}
+
+void hid_parse(hid_iface_t *iface, uint8_t const* data, uint16_t len) {
+  //  usb_debugf("hid parse %d", len);
+  if(!len || !iface->reports.count) return;
+
+  trace_event(TRACE_HID_REPORT, len);
+
+#ifdef HID_TRACE
+  hid_trace_dump('R', iface, data, len);
+#endif
+
+  // reports either all carry an id or none does
+  int idx = 0;
+  const hid_report_t *report = &iface->reports.report[0];
+  if(report->report_id_present) {
+    int id_idx = hid_report_index(&iface->reports, data[0]);
+    
+    if(id_idx >= 0 && len-1 == iface->reports.report[id_idx].report_size) {
+      // skip report id
+      idx = id_idx;
+      report = &iface->reports.report[idx];
+      data++; len--;
+    } else if(id_idx < 0 && hid_is_rii(iface, len)) {
+      rii_joy_parse(data+1);
       return;
     }
-        
-    // skip report id
-    data++; len--;
   }
   
   if(len == report->report_size) {
     if(report->type == REPORT_TYPE_KEYBOARD)
-      kbd_parse(report, &state->kbd, data, len);
+      kbd_parse(report, &iface->state[idx].kbd, data, len);
     
     if(report->type == REPORT_TYPE_MOUSE)
-      mouse_parse(report, &state->mouse, data, len);
+      mouse_parse(report, &iface->state[idx].mouse, data, len);
     
     if(report->type == REPORT_TYPE_JOYSTICK)
-      joystick_parse(report, &state->joystick, data, len);
+      joystick_parse(report, &iface->state[idx].joystick, data, len);
   }
 }
 
+bool hid_iface_init(hid_iface_t *iface, const uint8_t *desc, uint16_t len) {
+  memset(iface->state, 0, sizeof(iface->state));
+
+#ifdef HID_TRACE
+  hid_trace_dump('D', iface, desc, len);
+#endif
+  
+  if(!parse_report_descriptor(desc, len, &iface->reports, NULL))
+    return false;
+
+  usb_debugf("%d usable report(s)", iface->reports.count);
+  
+  // each joystick report gets its own joystick index
+  for(int i=0;i<iface->reports.count;i++)
+    if(iface->reports.report[i].type == REPORT_TYPE_JOYSTICK)
+      iface->state[i].joystick.js_index = hid_allocate_joystick();
+
+  return true;
+}
+
+void hid_iface_release(hid_iface_t *iface) {
+#ifdef HID_TRACE
+  hid_trace_dump('U', iface, NULL, 0);
+#endif
+
+  for(int i=0;i<iface->reports.count;i++) {
+    if(iface->reports.report[i].type == REPORT_TYPE_JOYSTICK)
+      hid_release_joystick(iface->state[i].joystick.js_index);
+    
+    if(iface->reports.report[i].type == REPORT_TYPE_MOUSE)
+      mouse_release(&iface->state[i].mouse);
+  }
+  
+  iface->reports.count = 0;
+}
+
+bool hid_iface_has(const hid_iface_t *iface, int type) {
+  for(int i=0;i<iface->reports.count;i++)
+    if(iface->reports.report[i].type == type)
+      return true;
+  
+  return false;
+}
+
+void hid_init(void) {
+  // request the cores HID status. The third byte reports optional
+  // features. Cores not implementing these return 0
+  hid_spi_begin();
+  hid_spi_tx(SPI_TARGET_HID);
+  hid_spi_tx(SPI_HID_STATUS);
+  hid_spi_tx(0x00);
+  hid_spi_tx(0x00);
+  hid_spi_tx(0x00);
+  hid_features = hid_spi_tx(0x00);
+  hid_spi_end();
+
+  usb_debugf("HID features: %02x", hid_features);
+
+#ifdef HID_TRACE
+  hid_trace_dump('F', NULL, &hid_features, 1);
+#endif
+
+  // mouse rate limiting is available from now on
+  mouse_sem = xSemaphoreCreateMutex();
+  xTaskCreate(mouse_task, (char *)"mouse_task", 2048, NULL, configMAX_PRIORITIES-3, &mouse_task_handle);
+  mouse_timer = xTimerCreate("Mouse", 1, pdFALSE, NULL, mouse_timer_handler);
+}
+
 // hid event triggered by FPGA
 void hid_handle_event(void) {
-  mcu_hw_spi_begin();
-  mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-  mcu_hw_spi_tx_u08(SPI_HID_GET_DB9);
-  mcu_hw_spi_tx_u08(0x00);
-  uint8_t db9 = mcu_hw_spi_tx_u08(0x00);
-  mcu_hw_spi_end();
+  hid_spi_begin();
+  hid_spi_tx(SPI_TARGET_HID);
+  hid_spi_tx(SPI_HID_GET_DB9);
+  hid_spi_tx(0x00);
+  uint8_t db9 = hid_spi_tx(0x00);
+  hid_spi_end();
 
   debugf("DB9: %02x", db9);
 }
@@ -11,6 +11,13 @@ struct hid_kbd_state_S {
 };
 
 struct hid_mouse_state_S {
+  int acc_x, acc_y;            // motion not yet sent into the core
+  uint8_t btns;                // button state last sent into the core
+  uint32_t last_tx;            // tick count of last message
+  uint32_t reports;            // statistics: reports received,
+  uint32_t merged;             // ... reports merged with later ones,
+  uint32_t split;              // ... extra messages due to 8 bit limit
+  uint32_t dropped;            // ... and unusable reports
 };
 
 struct hid_joystick_state_S {
@@ -21,20 +28,48 @@ struct hid_joystick_state_S {
   unsigned char last_state_btn_extra;
 };
 
+// xinput (XBOX) pads are handled by the USB backends, but their
+// reports are converted here
+struct hid_xinput_state_S {
+  unsigned char js_index;
+  unsigned char last_state;
+  unsigned char last_state_btn_extra;
+  unsigned char last_state_x;   // scaled values as sent to the core
+  unsigned char last_state_y;
+};
+
 typedef union {
   struct hid_kbd_state_S kbd;
   struct hid_mouse_state_S mouse;
   struct hid_joystick_state_S joystick;  
 } hid_state_t;
 
-void hid_parse(const hid_report_t *report, hid_state_t *state, uint8_t const* data, uint16_t len);
+// all usable reports of a HID interface and their states
+typedef struct {
+  hid_report_table_t reports;
+  hid_state_t state[HID_MAX_REPORTS];
+} hid_iface_t;
+
+bool hid_iface_init(hid_iface_t *iface, const uint8_t *desc, uint16_t len);
+void hid_iface_release(hid_iface_t *iface);
+bool hid_iface_has(const hid_iface_t *iface, int type);
+
+void hid_parse(hid_iface_t *iface, uint8_t const* data, uint16_t len);
 
 void kbd_parse(const hid_report_t *report, struct hid_kbd_state_S *state, const unsigned char *buffer, int nbytes);
 void mouse_parse(const hid_report_t *report, struct hid_mouse_state_S *state, const unsigned char *buffer, int nbytes);
 void joystick_parse(const hid_report_t *report, struct hid_joystick_state_S *state, const unsigned char *buffer, int nbytes);
 
+void xinput_init(struct hid_xinput_state_S *state);
+void xinput_release(struct hid_xinput_state_S *state);
+void xinput_parse(struct hid_xinput_state_S *state, uint16_t buttons, int16_t lx, int16_t ly);
+
+void hid_init(void);
 void hid_handle_event(void);
 
+#define HID_MAX_JOYSTICKS  8      // size of the joystick map
+#define HID_JOYSTICK_NONE  0xff   // no joystick index available
+
 uint8_t hid_allocate_joystick(void);
 void hid_release_joystick(uint8_t idx);
 
@@ -59,6 +59,41 @@ typedef struct {
 #define USAGE_WHEEL   56
 #define USAGE_HAT     57
 
+// precompute how to extract a field of the given size at the given
+// bit offset. Fields larger than 16 bits are truncated to 16 bits
+static void compile_field(hid_field_t *f, uint16_t offset, uint8_t size, bool is_signed) {
+	if(!size) {
+		memset(f, 0, sizeof(hid_field_t));
+		return;
+	}
+
+	if(size > 16) size = 16;
+	f->byte = offset/8;
+	f->shift = offset&7;
+	f->bytes = (f->shift + size + 7)/8;
+	f->mask = (size < 16)?((1<<size)-1):0xffff;
+	f->sign = (is_signed && size < 16)?(1<<(size-1)):0;
+}
+
+// generate the extraction info for all axes and the hat of
+// joysticks and mice
+static void compile_report(hid_report_t *conf) {
+	if((conf->type != REPORT_TYPE_JOYSTICK) && (conf->type != REPORT_TYPE_MOUSE))
+		return;
+
+	for(int c=0;c<MAX_AXES;c++) {
+		// relative mouse movements are always signed
+		bool is_signed = (conf->type == REPORT_TYPE_MOUSE) ||
+			(conf->joystick_mouse.axis[c].logical.min > conf->joystick_mouse.axis[c].logical.max);
+
+		compile_field(&conf->joystick_mouse.axis[c].field, conf->joystick_mouse.axis[c].offset,
+			      conf->joystick_mouse.axis[c].size, is_signed);
+	}
+
+	compile_field(&conf->joystick_mouse.hat.field, conf->joystick_mouse.hat.offset,
+		      conf->joystick_mouse.hat.size, false);
+}
+
 // check if the current report 
 bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t *conf) {
 	hidp_debugf("  - total bit count: %d (%d bytes, %d bits)", 
@@ -71,6 +106,7 @@ bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t
 	    ((conf->type == REPORT_TYPE_MOUSE)    && ((report_complete & MOUSE_COMPLETE) == MOUSE_COMPLETE)) ||
 	    ((conf->type == REPORT_TYPE_KEYBOARD))) {
 	hidp_debugf("  - report %d is usable", conf->report_id);
+	compile_report(conf);
 	return true;
 	}
 
@@ -78,7 +114,33 @@ bool report_is_usable(uint16_t bit_count, uint8_t report_complete, hid_report_t
 	return false;
 }
 
-bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes) {
+// prepare report for parsing. The report id is a global item and
+// stays valid for subsequent reports
+static void report_reset(hid_report_t *conf, const hid_report_t *prev) {
+	bool id_present = prev?prev->report_id_present:false;
+	uint8_t id = prev?prev->report_id:0;
+	
+	memset(conf, 0, sizeof(hid_report_t));
+	conf->type = REPORT_TYPE_NONE;
+	conf->report_id_present = id_present;
+	conf->report_id = id;
+}
+
+// add the report just parsed to the table. Returns false if the table is full
+static bool report_table_add(hid_report_table_t *table) {
+	hid_report_t *conf = &table->report[table->count];
+	
+	if(conf->report_id_present && conf->report_id < HID_REPORT_ID_MAP)
+		table->id_map[conf->report_id] = table->count+1;
+
+	if(++table->count == HID_MAX_REPORTS)
+		return false;
+
+	report_reset(conf+1, conf);
+	return true;
+}
+
+bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_table_t *table, uint16_t *rbytes) {
 	int8_t app_collection = 0;
 	int8_t phys_log_collection = 0;
 	uint8_t skip_collection = 0;
@@ -93,7 +155,11 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 	uint16_t bit_count = 0, usage_count = 0;
 	uint16_t logical_minimum=0, logical_maximum=0;
 	uint16_t physical_minimum=0, physical_maximum=0;
-	memset(conf, 0, sizeof(hid_report_t));
+	uint16_t usage_page = 0;
+
+	memset(table, 0, sizeof(hid_report_table_t));
+	hid_report_t *conf = table->report;
+	report_reset(conf, NULL);
 
 	// mask used to check of all required components have been found, so
 	// that e.g. both axes and the button of a joystick are ready to be used
@@ -106,8 +172,6 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 	for (i=0; i<MAX_AXES; i++) axis[i] = -1;
 
-	conf->type = REPORT_TYPE_NONE;
-
 	while(rep_size) {
 		// extract short item
 		uint8_t tag = ((item_t*)rep)->bTag;
@@ -283,24 +347,29 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 						hidp_extreme_debugf("  -> app end");
 						app_collection--;
 
-						// check if report is usable and stop parsing if it is
+						// check if report is usable and keep it if it is
 						if(report_is_usable(bit_count, report_complete, conf)) {
-						        return true;
-						} else {
-							// retry with next report
-							bit_count = 0;
-							report_complete = 0;
-						}
-
+							if(!report_table_add(table)) {
+								hidp_debugf("report table full");
+								return true;
+							}
+							conf = &table->report[table->count];
+						} else
+							report_reset(conf, conf);
+
+						// continue with next report
+						bit_count = 0;
+						report_complete = 0;
+						buttons = 0;
 					} else {
 						hidp_debugf(" -> unexpected");
-						return false;
+						return table->count > 0;
 					}
 					break;
 
 				default:
 					hidp_debugf("unexpected main item %d", tag);
-					return false;
+					return table->count > 0;
 					break;
 				}
 				break;
@@ -310,6 +379,7 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 				switch(tag) {
 				case 0:
 					hidp_extreme_debugf("USAGE_PAGE(%lu/0x%lx)", value, value);
+					usage_page = value;
 
 					if(value == USAGE_PAGE_KEYBOARD) {
 						hidp_extreme_debugf(" -> Keyboard");
@@ -378,7 +448,7 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 
 				default:
 					hidp_debugf("unexpected global item %d", tag);
-					return false;
+					return table->count > 0;
 					break;
 				}
 				break;
@@ -390,15 +460,18 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 					// we only support mice, keyboards and joysticks
 					hidp_extreme_debugf("USAGE(%lu/0x%lx)", value, value);
 
-					if( !collection_depth && (value == USAGE_KEYBOARD)) {
+					// device types are only accepted from the generic desktop page
+					bool gd = (usage_page == USAGE_PAGE_GENERIC_DESKTOP);
+					
+					if( !collection_depth && gd && (value == USAGE_KEYBOARD)) {
 						// usage(keyboard) is always allowed
 						hidp_debugf(" -> Keyboard");
 						conf->type = REPORT_TYPE_KEYBOARD;
-					} else if(!collection_depth && (value == USAGE_MOUSE)) {
+					} else if(!collection_depth && gd && (value == USAGE_MOUSE)) {
 						// usage(mouse) is always allowed
 						hidp_debugf(" -> Mouse");
 						conf->type = REPORT_TYPE_MOUSE;
-					} else if(!collection_depth && 
+					} else if(!collection_depth && gd &&
 						((value == USAGE_GAMEPAD) || (value == USAGE_JOYSTICK))) {
 							hidp_extreme_debugf(" -> Gamepad/Joystick");
 							hidp_debugf("Gamepad/Joystick usage found");
@@ -478,6 +551,6 @@ bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t
 		}
 	}
 
-	// if we get here then no usable setup was found
-	return false;
+	// end of descriptor, check if anything usable was found
+	return table->count > 0;
 }
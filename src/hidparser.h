@@ -10,6 +10,15 @@
 
 #define MAX_AXES 4
 
+// precomputed information to extract a single field from a report
+typedef struct {
+  uint8_t byte;      // first byte containing the field
+  uint8_t shift;     // position of the fields lsb within that byte
+  uint8_t bytes;     // number of bytes to fetch, 0 if field is unused
+  uint16_t mask;     // mask to apply after shifting
+  uint16_t sign;     // sign bit for signed fields, 0 otherwise
+} hid_field_t;
+
 // currently only joysticks are supported
 typedef struct {
   uint8_t type: 2;               // REPORT_TYPE_...
@@ -26,6 +35,7 @@ typedef struct {
 	  uint16_t min;
 	  uint16_t max;
 	} logical;
+	hid_field_t field;
       } axis[MAX_AXES];               // x and y axis + wheel or right hat
       
       struct {
@@ -44,11 +54,47 @@ typedef struct {
 	  uint16_t min;
 	  uint16_t max;
 	} physical;
+	hid_field_t field;
       } hat;                   // 1 hat (joystick only)
     } joystick_mouse;
   };
 } hid_report_t;
 
-bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_t *conf, uint16_t *rbytes);
+// extract a field from a report as described by a hid_field_t
+// generated by the parser. Signed fields are sign extended to 16 bits
+static inline uint16_t hid_get_field(const hid_field_t *f, const uint8_t *p) {
+  uint32_t v = 0;
+  p += f->byte;
+  switch(f->bytes) {
+  case 3: v  = (uint32_t)p[2] << 16;  // fall through
+  case 2: v |= (uint32_t)p[1] << 8;   // fall through
+  case 1: v |= p[0];
+  }
+  v = (v >> f->shift) & f->mask;
+  return (v ^ f->sign) - f->sign;
+}
+
+#define HID_MAX_REPORTS     4   // usable reports per interface
+#define HID_REPORT_ID_MAP  16   // report ids below this are looked up directly
+
+// all usable reports of an interface
+typedef struct {
+  uint8_t count;
+  uint8_t id_map[HID_REPORT_ID_MAP];  // index+1 of report with that id
+  hid_report_t report[HID_MAX_REPORTS];
+} hid_report_table_t;
+
+// find report by its id, returns index into table or -1
+static inline int hid_report_index(const hid_report_table_t *table, uint8_t id) {
+  if(id < HID_REPORT_ID_MAP) return table->id_map[id]-1;
+  
+  for(int i=0;i<table->count;i++)
+    if(table->report[i].report_id_present && table->report[i].report_id == id)
+      return i;
+  
+  return -1;
+}
+
+bool parse_report_descriptor(const uint8_t *rep, uint16_t rep_size, hid_report_table_t *table, uint16_t *rbytes);
 
 #endif // HIDPARSER_H
@@ -29,10 +29,15 @@ static int iswhite(char c) {
 static const struct option_S { char *name; char *info; int index; } option_ids[] = {
   {"hotkey", "; HID key code of OSD/menu hotkey\n",  INIFILE_OPTION_HOTKEY },
   {"led",    "; led state (0=blink, 1=on, 2=off)\n", INIFILE_OPTION_LED },
+  {"mouse_rate", "; max mouse updates per second, e.g. core frame rate (0=unlimited)\n", INIFILE_OPTION_MOUSE_RATE },
+  {"spi_clock", "; max SPI clock in MHz, limits the calibrated one (0=use calibrated)\n", INIFILE_OPTION_SPI_CLOCK },
+  {"floppy_sound", "; bitmask of drives playing step sounds (0=off)\n", INIFILE_OPTION_FLOPPY_SOUND },
   {NULL,     NULL,                                   -1 }
 };
 
-static int options[2] = { 0x45, 0 };  // default options: hotkey=F12, led=blink
+// default options: hotkey=F12, led=blink, mouse_rate=unlimited, spi_clock=calibrated,
+// floppy_sound=off
+static int options[] = { 0x45, 0, 0, 0, 0 };
 static void inifile_parse_option(char *id, char *value) {
   for(const struct option_S *oid = option_ids;oid->name;oid++) {
     if(!strcasecmp(oid->name, id)) {
@@ -43,10 +48,15 @@ static void inifile_parse_option(char *id, char *value) {
 }
 
 int inifile_option_get(int id) {
-  if((id < 0) || (id > 1)) return -1;
+  if((id < 0) || (id >= (int)(sizeof(options)/sizeof(*options)))) return -1;
   return options[id];
 }
 
+void inifile_option_set(int id, int value) {
+  if((id < 0) || (id >= (int)(sizeof(options)/sizeof(*options)))) return;
+  options[id] = value;
+}
+
 int inifile_read(char *name) {
   if(!core_id && !name) {
     ini_debugf("Unable to load core specific setting as no core has been identified");
@@ -166,6 +176,9 @@ int inifile_read(char *name) {
   }
   if(name) free(filename);
   sdc_unlock();
+
+  // the ini file may limit the SPI clock
+  sys_set_spi_clock(options[INIFILE_OPTION_SPI_CLOCK]);
   return 0;
 }
 
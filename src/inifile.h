@@ -7,9 +7,13 @@
 
 #define INIFILE_OPTION_HOTKEY   0   // HID key code
 #define INIFILE_OPTION_LED      1   // 0 = blink, 1 = on, 0 = off
+#define INIFILE_OPTION_MOUSE_RATE 2 // max mouse messages/sec, 0 = unlimited
+#define INIFILE_OPTION_SPI_CLOCK  3 // max SPI clock in MHz, 0 = calibrated
+#define INIFILE_OPTION_FLOPPY_SOUND 4 // bitmask of drives with step sounds
 
 int inifile_read(char *);
 void inifile_write(char *);
 int inifile_option_get(int id);
+void inifile_option_set(int id, int value);
 
 #endif // INIFILE_H
@@ -9,12 +9,15 @@
 #include "../sysctrl.h"
 #include "../sdc.h"
 #include "../osd.h"
+#include "../hid.h"
 #include "../menu.h"
 #include "../core.h"
 #include "../inifile.h"
 #include "../debug.h"
 #include "../xml.h"
 #include "../at_wifi.h"
+#include "../trace.h"
+#include "../audio.h"
 
 /*-----------------------------------------------------------*/
 /*---            main FPGA communication task            ----*/
@@ -67,11 +70,17 @@ static void com_task(__attribute__((unused)) void *p ) {
     // FPGA cold boot event which we ignore since we just booted outselves
     sys_handle_interrupts(sys_irq_ctrl(0xff), true);
     
+    // check which optional HID features the core supports
+    hid_init();
+    
     // by default, DB9 interrupts are disabled. Reading
     // the DB9 state enables them. This is what hid_handle_event
     // does.
     hid_handle_event();
 
+    // check if the core is able to play audio
+    audio_init();
+
     if(!cfg) {
       // finally release FPGA from reset
       sys_set_val('R', 0);
@@ -119,6 +128,8 @@ int main( void )
 #endif
 {
   mcu_hw_init();
+  trace_init();
+  debug_init();
   
   // run FPGA com thread
   xTaskCreate( com_task, "FPGA Com", 4096, NULL, CONFIG_MAX_PRIORITY-1, &com_task_handle );
@@ -2,6 +2,7 @@
 #define MCU_HW_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define LOGO "\033[1;33m"\
   "  __  __ _ ___ _____             _  _               \r\n"\
@@ -16,10 +17,17 @@ void mcu_hw_main_loop(void);
 void mcu_hw_irq_ack(void);
 void mcu_hw_reset(void);
 
+// free running microsecond counter, e.g. for tracing
+uint32_t mcu_hw_time_us(void);
+
 // HW SPI interface
 void mcu_hw_spi_begin(void);
 unsigned char mcu_hw_spi_tx_u08(unsigned char b);
+void mcu_hw_spi_tx_buf(const unsigned char *buf, int len);
+void mcu_hw_spi_rx_buf(unsigned char *buf, int len);
 void mcu_hw_spi_end(void);
+// change SPI clock, returns the clock actually being used
+int mcu_hw_spi_set_clock(int hz);
 
 // received a byte via the io port (e.g. rs232 from core)
 void mcu_hw_port_byte(unsigned char);
@@ -14,12 +14,10 @@
 
 #ifdef ESP_PLATFORM
 #include <freertos/FreeRTOS.h>
-#include <freertos/timers.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
 #else
 #include <FreeRTOS.h>
-#include <timers.h>
 #include <task.h>
 #include <queue.h>
 #endif
@@ -31,6 +29,7 @@
 #include "core.h"
 #include "sysctrl.h"
 #include "debug.h"
+#include "trace.h"
 
 // this is the u8g2_font_helvR08_te with any trailing
 // spaces removed
@@ -39,13 +38,33 @@
 static menu_legacy_t menu;
 
 // some constants for arrangement
-// The OSD (currently) is 64 pixel high. To allow for a proper
+// The OSD is by default 64 pixel high. To allow for a proper
 // box around a text line, it needs to be 12 pixels high. A total
 // of five lines is 5*12 = 60 + title seperation line
 #define MENU_LINE_Y      13   // y pos of seperator line
 #define MENU_ENTRY_H     12   // height of regular menu entries
 #define MENU_ENTRY_BASE   9   // font baseline offset
 
+// number of entries visible below the title. This depends on the
+// OSD size reported by the core
+static int menu_rows(void) {
+  return (u8g2_GetDisplayHeight(&u8g2) - MENU_LINE_Y) / MENU_ENTRY_H;
+}
+
+// adjust the scroll offset so the selected entry is visible with
+// one more entry above and below if possible. The title is counted
+// as entry 0 and always visible
+static int menu_scroll(int scroll, int selected, int entries) {
+  int rows = menu_rows();
+  
+  if(scroll > selected-2)      scroll = selected-2;
+  if(scroll < selected+1-rows) scroll = selected+1-rows;
+  if(scroll > entries-1-rows)  scroll = entries-1-rows;
+  if(scroll < 0)               scroll = 0;
+  
+  return scroll;
+}
+
 
 #define MENU_FORM_FSEL           -1
 
@@ -408,28 +427,71 @@ static void menu_legacy_draw_entry(int y, const char *s) {
 
 #define FS_ICON_WIDTH 10
 
-static void menu_legacy_fs_scroll_entry(sdc_dir_entry_t *entry) {
-  int row = menu.entry - menu.offset - 1;
-  int y =  MENU_LINE_Y + MENU_ENTRY_H * (row+1);
+// advance widths of all glyphs of the current font
+static struct {
+  const uint8_t *font;
+  int8_t adv[256];
+} glyph_cache = { NULL, { 0 } };
+
+// determine how many characters of str fit into the given width
+static int menu_str_fit(const char *str, int width) {
+  // rebuild advance table if the font has changed
+  if(glyph_cache.font != u8g2.font) {
+    for(int c=1;c<256;c++)
+      glyph_cache.adv[c] = u8g2_GetGlyphWidth(&u8g2, c);
+    glyph_cache.font = u8g2.font;
+  }
+
+  int n, w = 0;
+  for(n=0;str[n] && w+glyph_cache.adv[(uint8_t)str[n]] <= width;n++)
+    w += glyph_cache.adv[(uint8_t)str[n]];
+
+  // the sum of advances may differ slightly from u8g2's string
+  // width, so verify the result
+  char tmp[n+1];
+  memcpy(tmp, str, n);
+  tmp[n] = 0;
+  while(n > 0 && u8g2_GetStrWidth(&u8g2, tmp) > width) tmp[--n] = 0;
+  
+  return n;
+}
+
+// animate a file name too long for the OSD. The row's baseline is at y
+static void menu_fs_scroll(int *cur, sdc_dir_entry_t *entry, int y) {
+  const char *name = entry->name;
   int width = u8g2_GetDisplayWidth(&u8g2);
-  int swid = u8g2_GetStrWidth(&u8g2, entry->name) + 1;
+  int swid = entry->width + 1;
+
+  int scroll = (*cur)++ - 25;   // 25 means 1 sec delay
+  if(*cur > swid-width+FS_ICON_WIDTH+50) *cur = 0;
+  if(scroll < 0) scroll = 0;
+  if(scroll > swid-width+FS_ICON_WIDTH) scroll = swid-width+FS_ICON_WIDTH;
 
+  // if the core supports it, then upload the name once and only update
+  // the scroll offset afterwards. Any redraw of the OSD stops the hardware
+  // scrolling and the name is uploaded again
+  if(osd_scroll_active() || osd_line_upload(name, MENU_ENTRY_BASE)) {
+    osd_scroll(FS_ICON_WIDTH, y-MENU_ENTRY_BASE, MENU_ENTRY_H, scroll);
+    return;
+  }
+  
   // fill the area where the scrolling entry would show
   u8g2_SetClipWindow(&u8g2, FS_ICON_WIDTH, y-MENU_ENTRY_BASE, width, y+MENU_ENTRY_H-MENU_ENTRY_BASE);  
   u8g2_DrawBox(&u8g2, FS_ICON_WIDTH, y-MENU_ENTRY_BASE, width-FS_ICON_WIDTH, MENU_ENTRY_H);
   u8g2_SetDrawColor(&u8g2, 0);
   
-  int scroll = menu.fs_scroll_cur++ - 25;   // 25 means 1 sec delay
-  if(menu.fs_scroll_cur > swid-width+FS_ICON_WIDTH+50) menu.fs_scroll_cur = 0;
-  if(scroll < 0) scroll = 0;
-  if(scroll > swid-width+FS_ICON_WIDTH) scroll = swid-width+FS_ICON_WIDTH;
-  
-  u8g2_DrawStr(&u8g2, FS_ICON_WIDTH-scroll, y, entry->name);      
+  u8g2_DrawStr(&u8g2, FS_ICON_WIDTH-scroll, y, name);      
 
   // restore previous draw mode
   u8g2_SetDrawColor(&u8g2, 1);
   u8g2_SetMaxClipWindow(&u8g2);
-  u8g2_SendBuffer(&u8g2);
+  osd_flush();
+}
+
+static void menu_legacy_fs_scroll_entry(sdc_dir_entry_t *entry) {
+  int row = menu.entry - menu.offset - 1;
+  
+  menu_fs_scroll(&menu.fs_scroll_cur, entry, MENU_LINE_Y + MENU_ENTRY_H * (row+1));
 }
 
 static int fs_scroll_cur = -1;
@@ -442,35 +504,41 @@ static void menu_fs_scroll_entry(void) {
   if(menu_state->type != CONFIG_MENU_ENTRY_FILESELECTOR) return;
   
   int row = menu_state->selected - 1;
-  int y =  MENU_LINE_Y + MENU_ENTRY_H * (row-menu_state->scroll+1);
-  int width = u8g2_GetDisplayWidth(&u8g2);
 
-  int swid = u8g2_GetStrWidth(&u8g2, menu_state->dir->files[row].name) + 1;
+  menu_fs_scroll(&fs_scroll_cur, &menu_state->dir->files[row],
+		 MENU_LINE_Y + MENU_ENTRY_H * (row-menu_state->scroll+1));
+}
 
-  // fill the area where the scrolling entry would show
-  u8g2_SetClipWindow(&u8g2, FS_ICON_WIDTH, y-MENU_ENTRY_BASE, width, y+MENU_ENTRY_H-MENU_ENTRY_BASE);  
-  u8g2_DrawBox(&u8g2, FS_ICON_WIDTH, y-MENU_ENTRY_BASE, width-FS_ICON_WIDTH, MENU_ENTRY_H);
-  u8g2_SetDrawColor(&u8g2, 0);
+// timed activities of the menu task, e.g. animations and key repeat.
+// Instead of timers the menu task itself sleeps until the next deadline
+typedef struct {
+  bool active;
+  TickType_t next;
+} menu_deadline_t;
 
-  int scroll = fs_scroll_cur++ - 25;   // 25 means 1 sec delay
-  if(fs_scroll_cur > swid-width+FS_ICON_WIDTH+50) fs_scroll_cur = 0;
-  if(scroll < 0) scroll = 0;
-  if(scroll > swid-width+FS_ICON_WIDTH) scroll = swid-width+FS_ICON_WIDTH;
-  
-  u8g2_DrawStr(&u8g2, FS_ICON_WIDTH-scroll, y, menu_state->dir->files[row].name);
-  
-  // restore previous draw mode
-  u8g2_SetDrawColor(&u8g2, 1);
-  u8g2_SetMaxClipWindow(&u8g2);
-  u8g2_SendBuffer(&u8g2);
+#define MENU_ANIM_PERIOD    pdMS_TO_TICKS(40)    // 25Hz
+#define MENU_REPEAT_DELAY   pdMS_TO_TICKS(500)
+#define MENU_REPEAT_PERIOD  pdMS_TO_TICKS(100)
+
+static menu_deadline_t menu_anim = { false, 0 };
+static menu_deadline_t menu_repeat = { false, 0 };
+
+static void menu_deadline_start(menu_deadline_t *d, TickType_t delay) {
+  d->active = true;
+  d->next = xTaskGetTickCount() + delay;
 }
 
-void menu_timer_enable(bool on);
+// enable animations. An already running animation keeps its pace
+static void menu_anim_enable(bool on) {
+  if(on && !menu_anim.active) menu_deadline_start(&menu_anim, MENU_ANIM_PERIOD);
+  if(!on) menu_anim.active = false;
+}
 
-static void menu_fs_draw_entry(int row, sdc_dir_entry_t *entry) {      
+static void menu_fs_draw_entry(int row, int drive, sdc_dir_entry_t *entry) {      
   static const unsigned char folder_icon[] = { 0x70,0x8e,0xff,0x81,0x81,0x81,0x81,0x7e };
   static const unsigned char up_icon[] =     { 0x04,0x0e,0x1f,0x0e,0xfe,0xfe,0xfe,0x00 };
   static const unsigned char empty_icon[] =  { 0xc3,0xe7,0x7e,0x3c,0x3c,0x7e,0xe7,0xc3 };
+  static const unsigned char frag_icon[] =   { 0x3b,0x3b,0x00,0xee,0xee,0x00,0x3b,0x3b };
   
   char str[strlen(entry->name)+1];
   int y =  MENU_LINE_Y + MENU_ENTRY_H * (row+1);
@@ -480,10 +548,16 @@ static void menu_fs_draw_entry(int row, sdc_dir_entry_t *entry) {
   else                      strcpy(str, entry->name);
   
   int width = u8g2_GetDisplayWidth(&u8g2);
+
+  // measure name only once per directory listing
+  if(entry->width < 0) {
+    entry->width = u8g2_GetStrWidth(&u8g2, str);
+    if(entry->width > width-FS_ICON_WIDTH)
+      entry->fit = menu_str_fit(str, width-FS_ICON_WIDTH-u8g2_GetStrWidth(&u8g2, "..."));
+  }
   
   // properly ellipsize string
-  int dotlen = u8g2_GetStrWidth(&u8g2, "...");
-  if(u8g2_GetStrWidth(&u8g2, str) > width-FS_ICON_WIDTH) {
+  if(entry->width > width-FS_ICON_WIDTH) {
     // the entry is too long to fit the menu.    
     if(!cfg) {
       if(menu.entry == row+menu.offset+1) {
@@ -497,10 +571,10 @@ static void menu_fs_draw_entry(int row, sdc_dir_entry_t *entry) {
 	fs_scroll_cur = 0;
     }
     
-    // enable timer, to allow animations
-    menu_timer_enable(true);
-    
-    while(u8g2_GetStrWidth(&u8g2, str) > width-FS_ICON_WIDTH-dotlen) str[strlen(str)-1] = 0;
+    // enable animations
+    menu_anim_enable(true);
+
+    str[entry->fit] = 0;
     if(strlen(str) < sizeof(str)-4) strcat(str, "...");
   }
   
@@ -512,6 +586,14 @@ static void menu_fs_draw_entry(int row, sdc_dir_entry_t *entry) {
 		 (entry->name[0] == '/')?empty_icon:
 		 strcmp(entry->name, "..")?folder_icon:
 		 up_icon);
+  else {
+    // check for fragmentation only once the entry becomes visible
+    if(entry->frag == -2)
+      entry->frag = sdc_image_fragmented(drive, entry->name) == 1;
+
+    if(entry->frag)
+      u8g2_DrawXBM(&u8g2, 1, y-8, 8, 8, frag_icon);
+  }
 
   // frame for legacy entry
   if(!cfg && menu.entry == row+menu.offset+1)
@@ -563,10 +645,7 @@ static void menu_fileselector(int event) {
 	  // file found, adjust entry and offset
 	  menu.entry = i+1;
 	  
-	  if(menu.entries > 5 && menu.entry > 3) {
-	    if(menu.entry < menu.entries-2) menu.offset = menu.entry - 3;
-	    else                              menu.offset = menu.entries-5;
-	  }
+	  menu.offset = menu_scroll(0, menu.entry, menu.entries);
 	}
       }
     }
@@ -576,10 +655,10 @@ static void menu_fileselector(int event) {
     
     // draw up to four files
     menu.fs_scroll_entry = NULL;  // assume no scrolling needed
-    menu_timer_enable(false);
+    menu_anim_enable(false);
     
-    for(int i=0;i<((dir->len<4)?dir->len:4);i++)
-      menu_fs_draw_entry(i, &(dir->files[i+menu.offset]));
+    for(int i=0;i<menu_rows() && i<dir->len-menu.offset;i++)
+      menu_fs_draw_entry(i, dir->drive, &(dir->files[i+menu.offset]));
   } else if(event == FSEL_SELECT) {
     if(!menu.entry)
       menu_goto_form(parent, 1);
@@ -615,10 +694,7 @@ static void menu_fileselector(int event) {
 		// file found, adjust entry and offset
 		menu.entry = i+1;
 		
-		if(menu.entries > 5 && menu.entry > 3) {
-		  if(menu.entry < menu.entries-2) menu.offset = menu.entry - 3;
-		  else                              menu.offset = menu.entries-5;
-		}
+		menu.offset = menu_scroll(0, menu.entry, menu.entries);
 	      }
 	    }
 	  }
@@ -634,6 +710,7 @@ static void menu_fileselector(int event) {
 }
 
 static void menu_draw_form(const char *s) {
+  trace_event(TRACE_MENU_DRAW, 0);
   u8g2_ClearBuffer(&u8g2);
 
   // regular entry?
@@ -647,10 +724,7 @@ static void menu_draw_form(const char *s) {
 
       // this is a newly opened form and we just determined the number
       // of menu entries. Therefore, adjust the scroll offset if needed
-      if(menu.entries > 5 && menu.entry > 3) {
-	if(menu.entry < menu.entries-2) menu.offset = menu.entry - 3;
-	else                            menu.offset = menu.entries-5;
-      }
+      menu.offset = menu_scroll(0, menu.entry, menu.entries);
     }
 
     // -------- draw title -----------
@@ -665,14 +739,15 @@ static void menu_draw_form(const char *s) {
     
     // walk over menu string
     int y = 1;
-    while(*s) {
+    while(*s && y <= menu_rows()) {
       menu_legacy_draw_entry(y++, s);    
       s = strchr(s, ';')+1;      // skip to next entry
     }
   } else if(menu.form == MENU_FORM_FSEL)
     menu_fileselector(FSEL_DRAW);
   
-  u8g2_SendBuffer(&u8g2);
+  osd_flush();
+  trace_event(TRACE_MENU_DRAWN, 0);
 }
 
 static void menu_legacy_select(void) {
@@ -799,23 +874,7 @@ static void menu_legacy_entry_go(int step) {
     }
 
     // scrolling needed?
-    if(step > 0) {
-      if(menu.entries <= 5)                   menu.offset = 0;
-      else {
-	if(menu.entry <= 3)                   menu.offset = 0;
-	else if(menu.entry < menu.entries-2) menu.offset = menu.entry - 3;
-	else                                   menu.offset = menu.entries-5;
-      }
-    }
-
-    if(step < 0) {
-      if(menu.entries <= 5)                   menu.offset = 0;
-      else {
-	if(menu.entry <= 2)                   menu.offset = 0;
-	else if(menu.entry < menu.entries-3) menu.offset = menu.entry - 2;
-	else                                   menu.offset = menu.entries-5;
-      }
-    }
+    menu.offset = menu_scroll(menu.offset, menu.entry, menu.entries);
     
     // give file selector a chance to adjust scroll
     if(menu.form == MENU_FORM_FSEL)
@@ -888,23 +947,7 @@ static void menu_entry_go(int step) {
     }
 
     // scrolling needed?
-    if(step > 0) {
-      if(entries <= 5)                            menu_state->scroll = 0;
-      else {
-	if(menu_state->selected <= 3)             menu_state->scroll = 0;
-	else if(menu_state->selected < entries-2) menu_state->scroll = menu_state->selected - 3;
-	else                                      menu_state->scroll = entries-5;
-      }
-    }
-
-    if(step < 0) {
-      if(entries <= 5)                            menu_state->scroll = 0;
-      else {
-	if(menu_state->selected <= 2)             menu_state->scroll = 0;
-	else if(menu_state->selected < entries-3) menu_state->scroll = menu_state->selected - 2;
-	else                                      menu_state->scroll = entries-5;
-      }
-    }    
+    menu_state->scroll = menu_scroll(menu_state->scroll, menu_state->selected, entries);
   } while(!menu_entry_is_usable());
 }
 
@@ -1050,7 +1093,7 @@ void menu_draw_dialog(const char *title,  const char *msg) {
   u8g2_ClearBuffer(&u8g2);
 
   // MENU_LINE_Y is the height of the title incl line
-  int y = (64 - MENU_LINE_Y - menu_wrap_text(0, msg))/2;
+  int y = (u8g2_GetDisplayHeight(&u8g2) - MENU_LINE_Y - menu_wrap_text(0, msg))/2;
   
   u8g2_SetFont(&u8g2, u8g2_font_helvB08_tr);
   
@@ -1065,13 +1108,34 @@ void menu_draw_dialog(const char *title,  const char *msg) {
 
   menu_wrap_text(y+23, msg);
   
-  u8g2_SendBuffer(&u8g2);
+  osd_flush();
+}
+
+// progress bar shown during long running operations like the
+// defragmentation of an image
+void menu_progress(int percent) {
+  u8g2_ClearBuffer(&u8g2);
+
+  int width = u8g2_GetDisplayWidth(&u8g2);
+  int y = (u8g2_GetDisplayHeight(&u8g2) - MENU_LINE_Y - MENU_ENTRY_H)/2;
+
+  u8g2_SetFont(&u8g2, u8g2_font_helvB08_tr);
+  int swid = u8g2_GetStrWidth(&u8g2, "Please wait");
+  u8g2_DrawStr(&u8g2, (width-swid)/2, y+MENU_ENTRY_BASE, "Please wait");
+  u8g2_DrawHLine(&u8g2, (width-swid)/2, y+MENU_ENTRY_H, swid);
+  u8g2_SetFont(&u8g2, font_helvR08_te);
+
+  u8g2_DrawFrame(&u8g2, 8, y+MENU_LINE_Y+4, width-16, 8);
+  u8g2_DrawBox(&u8g2, 10, y+MENU_LINE_Y+6, (width-20)*percent/100, 4);
+
+  osd_flush();
 }
 
 void menu_draw(void) {
   // draw a test dialog box
   //  menu_draw_dialog("Title", "This is a rather long text which needs to wrap!");  return;
   
+  trace_event(TRACE_MENU_DRAW, 0);
   u8g2_ClearBuffer(&u8g2);
  
   if(menu_state->type == CONFIG_MENU_ENTRY_MENU) {
@@ -1081,27 +1145,28 @@ void menu_draw(void) {
     // draw the title
     menu_draw_title(menu_state->menu->label, !menu_is_root(), menu_state->selected == 0);
 
-    // draw up to four entries
+    // draw as many entries as fit
     config_menu_entry_t *entry = menu_state->menu->entries;
-    for(int i=0;i<4 && entry[i].type != CONFIG_MENU_ENTRY_UNKNOWN;i++)
+    for(int i=0;i<menu_rows() && entry[i].type != CONFIG_MENU_ENTRY_UNKNOWN;i++)
       menu_draw_entry(entry+i+menu_state->scroll, i, menu_state->selected == menu_state->scroll+i+1);    
   } else {
     // =============== draw a fileselector =================    
     menu_debugf("drawing '%s'", menu_state->fsel->label);
     
     menu_draw_title(menu_state->fsel->label, true, menu_state->selected == 0);
-    menu_timer_enable(false);
+    menu_anim_enable(false);
     fs_scroll_cur = -1;
 
-    // draw up to four entries
-    for(int i=0;i<4 && i<menu_state->dir->len-menu_state->scroll;i++) {            
+    // draw as many entries as fit
+    for(int i=0;i<menu_rows() && i<menu_state->dir->len-menu_state->scroll;i++) {            
       debugf("file %s", menu_state->dir->files[i+menu_state->scroll].name);
 
-      menu_fs_draw_entry(i, &menu_state->dir->files[i+menu_state->scroll]);
+      menu_fs_draw_entry(i, menu_state->dir->drive, &menu_state->dir->files[i+menu_state->scroll]);
     }
   }
     
-  u8g2_SendBuffer(&u8g2);
+  osd_flush();
+  trace_event(TRACE_MENU_DRAWN, 0);
 }
 
 void menu_goto(config_menu_t *menu) {
@@ -1135,11 +1200,7 @@ static void menu_file_selector_open(config_menu_entry_t *entry) {
 	// file found, adjust entry and offset
 	menu_state->selected = i+1;
 	
-	if(menu_state->dir->len > 4 && menu_state->selected > 3) {
-	  debugf("more than 4 files an selected is > 3");
-	  if(menu_state->selected < menu_state->dir->len-1) menu_state->scroll = menu_state->selected - 3;
-	  else                                              menu_state->scroll = menu_state->dir->len-4;
-	}
+	menu_state->scroll = menu_scroll(0, menu_state->selected, menu_state->dir->len+1);
       }
     }
   }  
@@ -1177,8 +1238,8 @@ static void menu_fileselector_select(sdc_dir_entry_t *entry) {
   int drive = menu_state->fsel->index;
   debugf("drive %d, file selected '%s'", drive, entry->name);
     
-  // stop any scroll timer that might be running
-  menu_timer_enable(false);
+  // stop any scroll animation that might be running
+  menu_anim_enable(false);
     
   if(entry->is_dir) {
     if(entry->name[0] == '/') {
@@ -1211,10 +1272,7 @@ static void menu_fileselector_select(sdc_dir_entry_t *entry) {
 	    // file found, adjust entry and offset
 	    menu_state->selected = i+1;
 
-	    if(menu_state->dir->len > 4 && menu_state->selected > 3) {
-	      if(menu_state->selected < menu_state->dir->len - 1) menu_state->scroll = menu_state->selected - 3;
-	      else                                                menu_state->scroll = menu_state->selected - 5;
-	    }
+	    menu_state->scroll = menu_scroll(0, menu_state->selected, menu_state->dir->len+1);
 	  }
 	}
       }
@@ -1230,8 +1288,8 @@ static void menu_fileselector_select(sdc_dir_entry_t *entry) {
 
 // user has pressed esc to go back one level
 static void menu_back(void) {
-  // stop doing the scroll timer
-  menu_timer_enable(false);
+  // stop the scroll animation
+  menu_anim_enable(false);
 
   // are we in the root menu?
   if(menu_state->menu == cfg->menu)
@@ -1305,48 +1363,37 @@ static void menu_select(void) {
   }
 }
 
-// timer implementing key repeat
-static TimerHandle_t menu_key_repeat_timer = NULL;  
+// repeat the last cursor movement while the key is being held
 static int menu_key_last_event = -1;
 
-static void menu_key_repeat(__attribute__((unused)) TimerHandle_t arg) { 
-  if(menu_key_last_event >= 0) {
-  
-    if(menu_key_last_event == MENU_EVENT_UP)     menu_entry_go(-1);
-    if(menu_key_last_event == MENU_EVENT_DOWN)   menu_entry_go( 1);
+static void menu_key_repeat(void) { 
+  if(menu_key_last_event == MENU_EVENT_UP)     menu_entry_go(-1);
+  if(menu_key_last_event == MENU_EVENT_DOWN)   menu_entry_go( 1);
 
-    if(menu_key_last_event == MENU_EVENT_PGUP)   menu_entry_go(-4);
-    if(menu_key_last_event == MENU_EVENT_PGDOWN) menu_entry_go( 4);
+  if(menu_key_last_event == MENU_EVENT_PGUP)   menu_entry_go(-menu_rows());
+  if(menu_key_last_event == MENU_EVENT_PGDOWN) menu_entry_go( menu_rows());
 
-    if(!cfg) menu_draw_form(menu.forms[menu.form]);
-    else     menu_draw();
-  
-    xTimerChangePeriod( menu_key_repeat_timer, pdMS_TO_TICKS(100), 0);
-    xTimerStart( menu_key_repeat_timer, 0 );
-  }
+  menu_draw();
 }
   
-void menu_stop_repeat(void) {
-  xTimerStop(menu_key_repeat_timer, 0);
+static void menu_stop_repeat(void) {
+  menu_repeat.active = false;
   menu_key_last_event = -1;
 }
 
-void menu_do(int event) {
-  // -1 is a timer event used to scroll the current file name if it's to long
-  // for the OSD
-  if(event < 0) {
-    if(!cfg) {
-      // legacy menu fileselector animation
-      if((menu.form == MENU_FORM_FSEL) && (menu.fs_scroll_entry))
-	menu_legacy_fs_scroll_entry(menu.fs_scroll_entry);
-    } else {
-      if(menu_state->type == CONFIG_MENU_ENTRY_FILESELECTOR)
-	menu_fs_scroll_entry();
-    }
-      
-    return;
+// scroll the current file name if it's too long for the OSD
+static void menu_animate(void) {
+  if(!cfg) {
+    // legacy menu fileselector animation
+    if((menu.form == MENU_FORM_FSEL) && (menu.fs_scroll_entry))
+      menu_legacy_fs_scroll_entry(menu.fs_scroll_entry);
+  } else {
+    if(menu_state->type == CONFIG_MENU_ENTRY_FILESELECTOR)
+      menu_fs_scroll_entry();
   }
-  
+}
+
+void menu_do(int event) {
   menu_debugf("do %d", event);
   
   if(event)  {
@@ -1354,12 +1401,13 @@ void menu_do(int event) {
       osd_enable(OSD_VISIBLE);
       
     if(event == MENU_EVENT_HIDE) {
-      menu_timer_enable(false);
+      menu_anim_enable(false);
+      menu_stop_repeat();
       osd_enable(OSD_INVISIBLE);
       return;  // return now to prevent OSD from being drawn, again
     }
 
-    // a key release event just stops any repeat timer
+    // a key release event just stops any key repeat
     if(event == MENU_EVENT_KEY_RELEASE) {
       menu_stop_repeat();
       return;
@@ -1369,10 +1417,9 @@ void menu_do(int event) {
     if(event == MENU_EVENT_UP || event == MENU_EVENT_DOWN ||
        event == MENU_EVENT_PGUP || event == MENU_EVENT_PGDOWN) {
       
-      if(menu_key_repeat_timer) {
+      if(cfg) {
 	menu_key_last_event = event;
-	xTimerChangePeriod( menu_key_repeat_timer, pdMS_TO_TICKS(500), 0);
-	xTimerStart( menu_key_repeat_timer, 0 );
+	menu_deadline_start(&menu_repeat, MENU_REPEAT_DELAY);
       }
     }
     
@@ -1380,16 +1427,16 @@ void menu_do(int event) {
       if(event == MENU_EVENT_UP)     menu_legacy_entry_go(-1);
       if(event == MENU_EVENT_DOWN)   menu_legacy_entry_go( 1);
 
-      if(event == MENU_EVENT_PGUP)   menu_legacy_entry_go(-4);
-      if(event == MENU_EVENT_PGDOWN) menu_legacy_entry_go( 4);
+      if(event == MENU_EVENT_PGUP)   menu_legacy_entry_go(-menu_rows());
+      if(event == MENU_EVENT_PGDOWN) menu_legacy_entry_go( menu_rows());
 
       if(event == MENU_EVENT_SELECT) menu_legacy_select();
     } else {
       if(event == MENU_EVENT_UP)     menu_entry_go(-1);
       if(event == MENU_EVENT_DOWN)   menu_entry_go( 1);
 
-      if(event == MENU_EVENT_PGUP)   menu_entry_go(-4);
-      if(event == MENU_EVENT_PGDOWN) menu_entry_go( 4);
+      if(event == MENU_EVENT_PGUP)   menu_entry_go(-menu_rows());
+      if(event == MENU_EVENT_PGDOWN) menu_entry_go( menu_rows());
 
       if(event == MENU_EVENT_SELECT) menu_select();
       if(event == MENU_EVENT_BACK)   menu_back();
@@ -1399,32 +1446,47 @@ void menu_do(int event) {
   else     menu_draw();
 }
 
-TimerHandle_t menu_timer_handle;
 // queue to forward key press events from USB to MENU
 QueueHandle_t menu_queue = NULL;
 
-void menu_timer_enable(bool on) {
-  if(on) xTimerStart(menu_timer_handle, 0);
-  else   xTimerStop(menu_timer_handle, 0);
+// time to sleep until the deadline, at most timeout
+static TickType_t menu_deadline_wait(menu_deadline_t *d, TickType_t now, TickType_t timeout) {
+  if(!d->active) return timeout;
+  if((int32_t)(d->next - now) <= 0) return 0;
+  return (d->next - now < timeout)?(d->next - now):timeout;
 }
 
-// a 25Hz timer that can be activated by the menu whenever animations
-// are displayed and which should be updated constantly
-static void menu_timer(__attribute__((unused)) TimerHandle_t pxTimer) {
-  static long msg = -1;
-  xQueueSendToBack(menu_queue, &msg,  ( TickType_t ) 0);
+// check if a deadline has passed and schedule the next one a period
+// later, so the pace doesn't depend on when the task actually ran
+static bool menu_deadline_due(menu_deadline_t *d, TickType_t now, TickType_t period) {
+  if(!d->active || (int32_t)(now - d->next) < 0) return false;
+
+  d->next += period;
+  // don't try to catch up if we have fallen behind, e.g. due to a slow redraw
+  if((int32_t)(now - d->next) >= 0) d->next = now + period;
+  return true;
 }
 
 static void menu_task(__attribute__((unused)) void *parms) {
   menu_debugf("task running");
 
-  // wait for user events
+  // wait for user events or the next timed activity
   while(1) {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t timeout = portMAX_DELAY;
+    timeout = menu_deadline_wait(&menu_repeat, now, timeout);
+    timeout = menu_deadline_wait(&menu_anim, now, timeout);
+
     // receive events from usb    
     long cmd;
-    xQueueReceive(menu_queue, &cmd, 0xffffffffUL);
-    menu_debugf("command %ld", cmd);
-    menu_do(cmd);
+    if(xQueueReceive(menu_queue, &cmd, timeout) == pdTRUE) {
+      menu_debugf("command %ld", cmd);
+      menu_do(cmd);
+    }
+
+    now = xTaskGetTickCount();
+    if(menu_deadline_due(&menu_repeat, now, MENU_REPEAT_PERIOD)) menu_key_repeat();
+    if(menu_deadline_due(&menu_anim, now, MENU_ANIM_PERIOD))     menu_animate();
   }
 }
 
@@ -1487,20 +1549,11 @@ void menu_init(void) {
 
     // ready to run core
     sys_run_action_by_name("ready");
-
-    // create a one shot timer for key repeat
-    menu_key_repeat_timer = xTimerCreate( "Key repeat timer", pdMS_TO_TICKS(500), pdFALSE,
-					  NULL, menu_key_repeat);
   }
     
   // switch MCU controlled leds off
   sys_set_leds(0x00);
     
-  // create a 25 Hz timer that frequently wakes the OSD thread
-  // allowing for animations
-  menu_timer_handle = xTimerCreate("Menu scroll timer", pdMS_TO_TICKS(40), pdTRUE,
-				   NULL, menu_timer);
-  
   // message queue from USB to OSD
   menu_queue = xQueueCreate(10, sizeof( long ) );
   
@@ -50,5 +50,6 @@ menu_variable_t **menu_get_variables(void);
 void menu_set_value(unsigned char id, unsigned char value);
 void menu_do(int);
 void menu_notify(unsigned long msg);
+void menu_progress(int percent);
 
 #endif // MENU_H
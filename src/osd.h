@@ -4,6 +4,8 @@
 #include "spi.h"
 #include "u8g2.h"
 
+#include <stdbool.h>
+
 #define OSD_INVISIBLE  0
 #define OSD_VISIBLE    (!OSD_INVISIBLE)
 
@@ -12,5 +14,12 @@ extern u8g2_t u8g2;
 void osd_init(void);
 void osd_enable(char);
 int osd_is_visible(void);
+uint8_t osd_get_caps(void);
+void osd_flush(void);
+
+// hardware scrolling of a single text line
+bool osd_line_upload(const char *str, uint8_t base);
+void osd_scroll(uint8_t x, uint8_t y, uint8_t h, uint8_t offset);
+bool osd_scroll_active(void);
 
 #endif // OSD_H
@@ -10,22 +10,223 @@
 
 #include "debug.h"
 
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+#endif
+
 u8g2_t u8g2;
 
 static char state;
-static uint8_t buf[128*8];  // screen buffer
 
-static const u8x8_display_info_t u8x8_mn_128x64_info =
+// OSD geometry in tiles as reported by the core, 16x8 by default. All
+// buffers are allocated accordingly
+static uint8_t tiles_w = 16, tiles_h = 8;
+static uint8_t *buf;        // screen buffer
+static int buf_size;
+
+// Frames are sent to the core by a low priority task, so the SPI
+// bus isn't blocked for SD card and HID traffic while the menu is
+// being drawn. osd_flush() copies the screen buffer into the pending
+// buffer, replacing any frame that hasn't been sent, yet.
+static uint8_t *pending;    // latest frame, protected by osd_sem
+static uint8_t *frame;      // frame currently being sent
+static SemaphoreHandle_t osd_sem = NULL;
+static SemaphoreHandle_t osd_done = NULL;   // given after each frame
+static TaskHandle_t osd_task_handle = NULL;
+
+// frames flushed and frames sent, protected by osd_sem
+static unsigned long frames_flushed = 0, frames_sent = 0;
+
+// the osd task is to end hardware scrolling after the pending frame
+static bool scroll_reset = false;
+
+// copy of what's currently being displayed by the core
+static uint8_t *shadow;
+static bool shadow_valid = false;
+
+// report the number of OSD bytes sent per frame
+// #define OSD_TILE_STATS
+
+#ifdef OSD_TILE_STATS
+static struct {
+  unsigned int sent, total;
+} tile_stats;
+
+// bytes preceding the tile data of a write message
+#define OSD_WRITE_HDR  ((tiles_w == 16 && tiles_h == 8)?3:4)
+#endif
+
+// size is adjusted to the core's OSD in osd_init()
+static u8x8_display_info_t u8x8_osd_info =
   { 0, 1, 0, 0, 0, 0, 0, 0, 4000000UL, 1, 0, 0, 0, 16, 8, 0, 0, 128, 64 };
 
-uint8_t u8x8_d_mn_128x64(u8x8_t *u8g2, uint8_t msg, uint8_t arg_int, void *arg_ptr) {
-  uint8_t x, y, c;
-  uint8_t *ptr;
+// optional features of the core's OSD
+static uint8_t caps = 0;
+
+// The core may provide a wide line buffer of 2x32 tiles which it can
+// display scrolled inside a window of the OSD. The MCU only uses 31
+// tiles of it, as u8g2 cannot address 256 pixels with its 8 bit
+// coordinates
+#define OSD_LINE_TILES  31
+
+static u8g2_t line_u8g2;
+static uint8_t line_buf[OSD_LINE_TILES*8*2];
+
+static const u8x8_display_info_t u8x8_mn_line_info =
+  { 0, 1, 0, 0, 0, 0, 0, 0, 4000000UL, 1, 0, 0, 0, OSD_LINE_TILES, 2, 0, 0, OSD_LINE_TILES*8, 16 };
+
+// currently set scroll window, h == 0 means disabled
+static struct {
+  uint8_t x, y, h, offset;
+} scroll;
+
+// send a run of tiles to the core
+static void osd_write_tiles(uint8_t x, uint8_t y, uint8_t cnt, const uint8_t *ptr) {
+  // split long runs, so more important SPI traffic can get in between
+  while(cnt > SPI_MAX_TRANSFER/8) {
+    osd_write_tiles(x, y, SPI_MAX_TRANSFER/8, ptr);
+    x += SPI_MAX_TRANSFER/8;
+    cnt -= SPI_MAX_TRANSFER/8;
+    ptr += SPI_MAX_TRANSFER;
+  }
+  
+  spi_begin(SPI_PRIO_OSD);
+  
+  /* send data */
+  mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
+  if(tiles_w == 16 && tiles_h == 8) {
+    mcu_hw_spi_tx_u08(SPI_OSD_WRITE);  // command byte data
+    mcu_hw_spi_tx_u08((y<<4)+x);       // tile address
+  } else {
+    // the packed tile address only covers the default geometry
+    mcu_hw_spi_tx_u08(SPI_OSD_WRITE_XY);
+    mcu_hw_spi_tx_u08(x);
+    mcu_hw_spi_tx_u08(y);
+  }
+  mcu_hw_spi_tx_buf(ptr, cnt*8);
+  spi_end();
+
+#ifdef OSD_TILE_STATS
+  tile_stats.sent += OSD_WRITE_HDR + 8*cnt;
+#endif
+}
+
+// compare the tiles against the shadow copy of what the core already
+// displays and only send those that actually changed. Adjacent changed
+// tiles are sent together as one run
+static void osd_draw_tiles(uint8_t x, uint8_t y, uint8_t cnt, const uint8_t *ptr) {
+  uint8_t *sptr = shadow + 8*(tiles_w*y+x);
+  uint8_t start = 0, run = 0;
+
+#ifdef OSD_TILE_STATS
+  tile_stats.total += OSD_WRITE_HDR + 8*cnt;
+#endif
+  
+  for(uint8_t i=0;i<cnt;i++) {
+    if(!shadow_valid || memcmp(sptr+8*i, ptr+8*i, 8)) {
+      memcpy(sptr+8*i, ptr+8*i, 8);
+      if(!run) start = i;
+      run++;
+    } else if(run) {
+      osd_write_tiles(x+start, y, run, ptr+8*start);
+      run = 0;
+    }
+  }
+
+  if(run) osd_write_tiles(x+start, y, run, ptr+8*start);
+}
+
+static void osd_send_scroll(void) {
+  spi_begin(SPI_PRIO_OSD);
+  mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
+  mcu_hw_spi_tx_u08(SPI_OSD_SCROLL);
+  mcu_hw_spi_tx_u08(scroll.y);
+  mcu_hw_spi_tx_u08(scroll.h);
+  mcu_hw_spi_tx_u08(scroll.x);
+  mcu_hw_spi_tx_u08(scroll.offset);
+  spi_end();
+}
+
+static void osd_task(__attribute__((unused)) void *parms) {
+  for(;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // fetch the latest frame
+    xSemaphoreTake(osd_sem, portMAX_DELAY);
+    memcpy(frame, pending, buf_size);
+    unsigned long seq = frames_flushed;
+    bool reset = scroll_reset;
+    scroll_reset = false;
+    xSemaphoreGive(osd_sem);
+
+    for(int y=0;y<tiles_h;y++)
+      osd_draw_tiles(0, y, tiles_w, frame+8*tiles_w*y);
+
+    // shadow now matches the core
+    shadow_valid = true;
+
+    // the scroll window is only disabled once the frame replacing
+    // it is there
+    if(reset) osd_send_scroll();
+
+    xSemaphoreTake(osd_sem, portMAX_DELAY);
+    frames_sent = seq;
+    xSemaphoreGive(osd_sem);
+    xSemaphoreGive(osd_done);
+
+#ifdef OSD_TILE_STATS
+    osd_debugf("frame: %u of %u bytes sent, %u saved",
+	       tile_stats.sent, tile_stats.total, tile_stats.total - tile_stats.sent);
+    tile_stats.sent = tile_stats.total = 0;
+#endif
+  }
+}
+
+// hand the current screen buffer over to the osd task
+void osd_flush(void) {
+  xSemaphoreTake(osd_sem, portMAX_DELAY);
+  memcpy(pending, buf, buf_size);
+  frames_flushed++;
+  
+  // a new frame ends any hardware scrolling. The menu re-enables
+  // it if still needed
+  if(scroll.h) {
+    scroll.x = scroll.y = scroll.h = scroll.offset = 0;
+    scroll_reset = true;
+  }
+  xSemaphoreGive(osd_sem);
+  
+  xTaskNotifyGive(osd_task_handle);
+}
 
+// wait until the osd task has sent all flushed frames. Line buffer
+// and scroll window updates must not overtake them
+static void osd_wait(void) {
+  for(;;) {
+    xSemaphoreTake(osd_sem, portMAX_DELAY);
+    bool done = (frames_sent == frames_flushed);
+    xSemaphoreGive(osd_sem);
+    if(done) return;
+
+    xSemaphoreTake(osd_done, portMAX_DELAY);
+  }
+}
+
+static uint8_t u8x8_d_osd(u8x8_t *u8g2, uint8_t msg, uint8_t arg_int, void *arg_ptr) {
   switch(msg)
   {
     case U8X8_MSG_DISPLAY_SETUP_MEMORY:
-      u8x8_d_helper_display_setup_memory(u8g2, &u8x8_mn_128x64_info);
+      u8x8_d_helper_display_setup_memory(u8g2, &u8x8_osd_info);
       break;
     case U8X8_MSG_DISPLAY_INIT:
       u8x8_d_helper_display_init(u8g2);
@@ -37,36 +238,11 @@ uint8_t u8x8_d_mn_128x64(u8x8_t *u8g2, uint8_t msg, uint8_t arg_int, void *arg_p
     case U8X8_MSG_DISPLAY_SET_CONTRAST:
       break;
     case U8X8_MSG_DISPLAY_DRAW_TILE:
-      x = ((u8x8_tile_t *)arg_ptr)->x_pos;
-      x *= 8;
-      x += u8g2->x_offset;
-    
-      y = ((u8x8_tile_t *)arg_ptr)->y_pos;
-      y *= 8;
-    
-      do
-      {
-        c = ((u8x8_tile_t *)arg_ptr)->cnt;
-        ptr = ((u8x8_tile_t *)arg_ptr)->tile_ptr;
-
-	mcu_hw_spi_begin();
-	
-	/* send data */
-	mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
-	mcu_hw_spi_tx_u08(SPI_OSD_WRITE);           // command byte data
-	mcu_hw_spi_tx_u08(((y/8)<<4)+x/8); // tile address
-
-	for(int i=0;i<c*8;i++)
-	  mcu_hw_spi_tx_u08(ptr[i]);
-
-	mcu_hw_spi_end();
-
-        arg_int--;
-	x+=c*8;
-      } while( arg_int > 0 );
-
+      // tiles are sent by the osd task
+      break;
+    case U8X8_MSG_DISPLAY_REFRESH:
+      osd_flush();
       break;
-
     default:
       return 0;
   }
@@ -77,12 +253,12 @@ static uint8_t u8x8_d_mn_gpio(U8X8_UNUSED u8x8_t *u8x8, U8X8_UNUSED uint8_t msg,
   return 1;
 }
 
-void u8x8_Setup_mn_128x64(u8x8_t *u8x8) {
+static void u8x8_Setup_osd(u8x8_t *u8x8) {
   /* setup defaults */
   u8x8_SetupDefaults(u8x8);
   
   /* setup specific callbacks */
-  u8x8->display_cb = u8x8_d_mn_128x64;
+  u8x8->display_cb = u8x8_d_osd;
 	
   u8x8->gpio_and_delay_cb = u8x8_d_mn_gpio;
 
@@ -90,28 +266,186 @@ void u8x8_Setup_mn_128x64(u8x8_t *u8x8) {
   u8x8_SetupMemory(u8x8);  
 }
 
+static uint8_t u8x8_d_mn_line(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr) {
+  uint8_t x, y, c;
+  uint8_t *ptr;
+
+  switch(msg) {
+    case U8X8_MSG_DISPLAY_SETUP_MEMORY:
+      u8x8_d_helper_display_setup_memory(u8x8, &u8x8_mn_line_info);
+      break;
+    case U8X8_MSG_DISPLAY_INIT:
+      u8x8_d_helper_display_init(u8x8);
+      break;
+    case U8X8_MSG_DISPLAY_DRAW_TILE:
+      x = ((u8x8_tile_t *)arg_ptr)->x_pos;
+      y = ((u8x8_tile_t *)arg_ptr)->y_pos;
+      
+      do {
+        c = ((u8x8_tile_t *)arg_ptr)->cnt;
+        ptr = ((u8x8_tile_t *)arg_ptr)->tile_ptr;
+
+	for(int i=0;i<c;i+=SPI_MAX_TRANSFER/8) {
+	  int n = (c-i > SPI_MAX_TRANSFER/8)?SPI_MAX_TRANSFER/8:c-i;
+	  
+	  spi_begin(SPI_PRIO_OSD);
+	  mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
+	  mcu_hw_spi_tx_u08(SPI_OSD_LINE);
+	  mcu_hw_spi_tx_u08(32*y+x+i);   // tile address in line buffer
+	  mcu_hw_spi_tx_buf(ptr+8*i, 8*n);
+	  spi_end();
+	}
+	
+        arg_int--;
+	x+=c;
+      } while( arg_int > 0 );
+      break;
+    case U8X8_MSG_DISPLAY_SET_POWER_SAVE:
+    case U8X8_MSG_DISPLAY_SET_FLIP_MODE:
+    case U8X8_MSG_DISPLAY_SET_CONTRAST:
+    case U8X8_MSG_DISPLAY_REFRESH:
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+// render a string inverted into the core's line buffer. Returns false
+// if the core cannot scroll or the string doesn't fit
+bool osd_line_upload(const char *str, uint8_t base) {
+  if(!(caps & SPI_OSD_CAP_SCROLL)) return false;
+
+  // use the same font as the main display
+  u8g2_SetFont(&line_u8g2, u8g2.font);
+  if(u8g2_GetStrWidth(&line_u8g2, str) >= OSD_LINE_TILES*8)
+    return false;
+
+  osd_wait();
+
+  u8g2_ClearBuffer(&line_u8g2);
+  u8g2_DrawBox(&line_u8g2, 0, 0, OSD_LINE_TILES*8, 16);
+  u8g2_SetDrawColor(&line_u8g2, 0);
+  u8g2_DrawStr(&line_u8g2, 0, base, str);
+  u8g2_SetDrawColor(&line_u8g2, 1);
+  u8g2_SendBuffer(&line_u8g2);
+  
+  return true;
+}
+
+// Let the core display the line buffer in the area of h pixel rows
+// starting at row y and pixel column x. A height of 0 disables the
+// scroll window
+void osd_scroll(uint8_t x, uint8_t y, uint8_t h, uint8_t offset) {
+  if(!(caps & SPI_OSD_CAP_SCROLL)) return;
+
+  // nothing to do if nothing changes
+  if(scroll.x == x && scroll.y == y && scroll.h == h && scroll.offset == offset)
+    return;
+  
+  // don't scroll a window whose new content hasn't been sent, yet
+  if(osd_task_handle) osd_wait();
+  
+  scroll.x = x; scroll.y = y; scroll.h = h; scroll.offset = offset;
+  osd_send_scroll();
+}
+
+bool osd_scroll_active(void) {
+  return scroll.h != 0;
+}
+
+uint8_t osd_get_caps(void) {
+  return caps;
+}
+
 void osd_enable(char en) {
   osd_debugf("%sable", en?"en":"dis");
   
   state = en;
   
   // show/hide OSD
-  mcu_hw_spi_begin();  
+  spi_begin(SPI_PRIO_OSD);  
   mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
   mcu_hw_spi_tx_u08(SPI_OSD_ENABLE);  // enable/disable command
   mcu_hw_spi_tx_u08(en);    // enable
-  mcu_hw_spi_end();  
+  spi_end();  
 }
 
 void osd_init(void) {
+  // check for optional features and the OSD size in tiles. Cores
+  // not implementing this return 0
+  spi_begin(SPI_PRIO_OSD);
+  mcu_hw_spi_tx_u08(SPI_TARGET_OSD);
+  mcu_hw_spi_tx_u08(SPI_OSD_STATUS);
+  mcu_hw_spi_tx_u08(0x00);
+  caps = mcu_hw_spi_tx_u08(0x00);
+  uint8_t w = mcu_hw_spi_tx_u08(0x00);
+  uint8_t h = mcu_hw_spi_tx_u08(0x00);
+  spi_end();
+
+  // u8g2 uses 8 bit coordinates and cannot address more than 31 tiles
+  if(w && h && w <= 31 && h <= 31) {
+    tiles_w = w;
+    tiles_h = h;
+  }
+  
+  osd_debugf("OSD caps: %02x, size %dx%d", caps, 8*tiles_w, 8*tiles_h);
+
+  // screen, pending, frame and shadow buffer in one block. Fall back
+  // to the default geometry if a large OSD doesn't fit into memory
+  buf_size = 8*tiles_w*tiles_h;
+  buf = malloc(4*buf_size);
+  if(!buf && (tiles_w != 16 || tiles_h != 8)) {
+    osd_debugf("Not enough memory, using 128x64");
+    tiles_w = 16; tiles_h = 8;
+    buf_size = 8*tiles_w*tiles_h;
+    buf = malloc(4*buf_size);
+  }
+
+  if(!buf) {
+    // nothing works without the menu
+    osd_debugf("Out of memory");
+    for(;;) vTaskDelay(portMAX_DELAY);
+  }
+  
+  pending = buf + buf_size;
+  frame = buf + 2*buf_size;
+  shadow = buf + 3*buf_size;
+  
+  u8x8_osd_info.tile_width = tiles_w;
+  u8x8_osd_info.tile_height = tiles_h;
+  u8x8_osd_info.pixel_width = 8*tiles_w;
+  u8x8_osd_info.pixel_height = 8*tiles_h;
+  
   // prepare u8g2
-  // osd.spi->dev->user_data = osd.buf;
-  u8x8_Setup_mn_128x64(u8g2_GetU8x8(&u8g2));
-  u8g2_SetupBuffer(&u8g2, buf, 8, u8g2_ll_hvline_vertical_top_lsb, &u8g2_cb_r0);
+  u8x8_Setup_osd(u8g2_GetU8x8(&u8g2));
+  u8g2_SetupBuffer(&u8g2, buf, tiles_h, u8g2_ll_hvline_vertical_top_lsb, &u8g2_cb_r0);
   
   u8x8_ConnectBitmapToU8x8(u8g2_GetU8x8(&u8g2));
   u8g2_SetFontMode(&u8g2, 1);
 
+  if(caps & SPI_OSD_CAP_SCROLL) {
+    // prepare u8g2 for the scroll line buffer
+    u8x8_t *u8x8 = u8g2_GetU8x8(&line_u8g2);
+    u8x8_SetupDefaults(u8x8);
+    u8x8->display_cb = u8x8_d_mn_line;
+    u8x8->gpio_and_delay_cb = u8x8_d_mn_gpio;
+    u8x8_SetupMemory(u8x8);
+    u8g2_SetupBuffer(&line_u8g2, line_buf, 2, u8g2_ll_hvline_vertical_top_lsb, &u8g2_cb_r0);
+    u8g2_SetFontMode(&line_u8g2, 1);
+
+    // make sure no scroll window is active from before
+    scroll.h = 0xff;
+    osd_scroll(0, 0, 0, 0);
+  }
+  
+  // the core's OSD content is unknown, the first frame needs to be sent completely
+  shadow_valid = false;
+
+  osd_sem = xSemaphoreCreateMutex();
+  osd_done = xSemaphoreCreateBinary();
+  xTaskCreate(osd_task, (char *)"osd_task", 2048, NULL, tskIDLE_PRIORITY+1, &osd_task_handle);
+
   // make sure OSD is initially hidden
   state = OSD_INVISIBLE;
   osd_enable(state);
@@ -23,6 +23,7 @@
 #include "../inifile.h"
 
 #include "../mcu_hw.h"
+#include "../trace.h"
 
 #ifdef WAVESHARE_RP2040_ZERO
 #warning "Building for Waveshare RP2040-Zero mini board"
@@ -98,28 +99,24 @@
 #error "WS2812B and PIO USB cannot be used simultaneously!"
 #endif
 
-static struct {
-  uint8_t dev_addr;
-  uint8_t instance;
-  hid_state_t state;
-  hid_report_t rep;
-} hid_device[MAX_HID_DEVICES];
+// HID interfaces by device address and instance. Entries are
+// allocated on mount and freed on unmount
+#define HID_MAX_ADDR  (CFG_TUH_DEVICE_MAX + CFG_TUH_HUB + 1)
+static hid_iface_t *hid_iface[HID_MAX_ADDR][CFG_TUH_HID];
+
+static hid_iface_t *hid_iface_get(uint8_t dev_addr, uint8_t instance) {
+  if(dev_addr >= HID_MAX_ADDR || instance >= CFG_TUH_HID) return NULL;
+  return hid_iface[dev_addr][instance];
+}
 
 static struct {
   uint8_t dev_addr;
   uint8_t instance;
-  uint8_t js_index;
-  uint8_t state;
-  int16_t state_x;
-  int16_t state_y;
-  uint8_t state_btn_extra;
+  struct hid_xinput_state_S pad;
 } xbox_state[MAX_XBOX_DEVICES];
   
 static void pio_usb_task(__attribute__((unused)) void *parms) {
-  // mark all hid and xbox entries as unused
-  for(int i=0;i<MAX_HID_DEVICES;i++)
-    hid_device[i].dev_addr = 0xff;
-
+  // mark all xbox entries as unused
   for(int i=0;i<MAX_XBOX_DEVICES;i++)
     xbox_state[i].dev_addr = 0xff;
     
@@ -129,15 +126,6 @@ static void pio_usb_task(__attribute__((unused)) void *parms) {
   }
 }
 
-uint8_t byteScaleAnalog(int16_t xbox_val)
-{
-  // Scale the xbox value from [-32768, 32767] to [1, 255]
-  // Offset by 32768 to get in range [0, 65536], then divide by 256 to get in range [1, 255]
-  uint8_t scale_val = (xbox_val + 32768) / 256;
-  if (scale_val == 0) return 1;
-  return scale_val;
-}
-
 // check for presence of usb devices and drive leds accordingly
 static void usb_check_devices(void) {
 #ifdef LED_MOUSE_PIN
@@ -150,17 +138,20 @@ static void usb_check_devices(void) {
   int joysticks = 0;
 #endif
   
-  for(int idx=0;idx<MAX_HID_DEVICES;idx++) {
-    if(hid_device[idx].dev_addr != 0xff) {    
+  for(int addr=0;addr<HID_MAX_ADDR;addr++) {
+    for(int instance=0;instance<CFG_TUH_HID;instance++) {
+      hid_iface_t *iface = hid_iface[addr][instance];
+      if(iface) {    
 #ifdef LED_MOUSE_PIN
-      if(hid_device[idx].rep.type == REPORT_TYPE_MOUSE)    mice++;
+	if(hid_iface_has(iface, REPORT_TYPE_MOUSE))    mice++;
 #endif
 #ifdef LED_KEYBOARD_PIN
-      if(hid_device[idx].rep.type == REPORT_TYPE_KEYBOARD) keyboards++;
+	if(hid_iface_has(iface, REPORT_TYPE_KEYBOARD)) keyboards++;
 #endif
 #ifdef LED_JOYSTICK_PIN
-      if(hid_device[idx].rep.type == REPORT_TYPE_JOYSTICK) joysticks++;
+	if(hid_iface_has(iface, REPORT_TYPE_JOYSTICK)) joysticks++;
 #endif
+      }
     }
   }
     
@@ -193,28 +184,27 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
   usb_debugf("[%04x:%04x][%u] HID Interface%u, Protocol = %s",
 	     vid, pid, dev_addr, instance, protocol_str[itf_protocol]);
 
-  // search for a free hid entry
-  int idx;
-  for(idx=0;idx<MAX_HID_DEVICES && (hid_device[idx].dev_addr != 0xff);idx++);
-  if(idx != MAX_HID_DEVICES) {
-    usb_debugf("Using HID entry %d", idx);
+  if(dev_addr >= HID_MAX_ADDR || instance >= CFG_TUH_HID || hid_iface[dev_addr][instance]) {
+    usb_debugf("Error, no HID entry available");
+  } else {
+    hid_iface_t *iface = malloc(sizeof(hid_iface_t));
     
-    if(parse_report_descriptor(desc_report, desc_len, &hid_device[idx].rep, NULL)) {
-      hid_device[idx].dev_addr = dev_addr;
-      hid_device[idx].instance = instance;
-      if(hid_device[idx].rep.type == REPORT_TYPE_JOYSTICK)
-	hid_device[idx].state.joystick.js_index = hid_allocate_joystick();
-      else if(hid_device[idx].rep.type == REPORT_TYPE_MOUSE) {
+    if(iface && hid_iface_init(iface, desc_report, desc_len)) {
+      hid_iface[dev_addr][instance] = iface;
+      
+      if(hid_iface_has(iface, REPORT_TYPE_MOUSE)) {
 	// switch mice to report mode
 	if(!tuh_hid_set_protocol(dev_addr, instance, HID_PROTOCOL_REPORT)) {
 	  usb_debugf("Failed to set report mode");
-	  hid_device[idx].rep.report_id_present = false;
+	  for(int i=0;i<iface->reports.count;i++)
+	    iface->reports.report[i].report_id_present = false;
 	}
       }
-    } else
+    } else {
       usb_debugf("Ignoring device");
-  } else
-    usb_debugf("Error, no more free HID entries");
+      free(iface);
+    }
+  }
   
   // tuh_hid_report_received_cb() will be invoked when report is available
   if ( !tuh_hid_receive_report(dev_addr, instance) ) 
@@ -227,14 +217,12 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
   usb_debugf("[%u] HID Interface%u is unmounted", dev_addr, instance);
 
-  // find matching hid report
-  for(int idx=0;idx<MAX_HID_DEVICES;idx++) {
-    if(hid_device[idx].dev_addr == dev_addr && hid_device[idx].instance == instance) {
-      usb_debugf("releasing %d", idx);
-      hid_device[idx].dev_addr = 0xff;
-      if(hid_device[idx].rep.type == REPORT_TYPE_JOYSTICK)
-	hid_release_joystick(hid_device[idx].state.joystick.js_index);
-    }
+  hid_iface_t *iface = hid_iface_get(dev_addr, instance);
+  if(iface) {
+    usb_debugf("releasing %d/%d", dev_addr, instance);
+    hid_iface[dev_addr][instance] = NULL;
+    hid_iface_release(iface);
+    free(iface);
   }
   usb_check_devices();
 }
@@ -242,10 +230,8 @@ void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len) {
   // usb_debugf("[%u] HID Interface%u", dev_addr, instance);
 
-  // find matching hid report
-  for(int idx=0;idx<MAX_HID_DEVICES;idx++)
-    if(hid_device[idx].dev_addr == dev_addr && hid_device[idx].instance == instance)
-      hid_parse(&hid_device[idx].rep, &hid_device[idx].state, report, len);
+  hid_iface_t *iface = hid_iface_get(dev_addr, instance);
+  if(iface) hid_parse(iface, report, len);
   
   // continue to request to receive report
   if ( !tuh_hid_receive_report(dev_addr, instance) )
@@ -260,11 +246,11 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
 #include "queue.h"
 
 extern TaskHandle_t com_task_handle;
-static SemaphoreHandle_t sem;
 
 static void irq_handler(void) {  
   // Disable interrupt. It will be re-enabled by the com task
   gpio_set_irq_enabled(SPI_IRQ_PIN, GPIO_IRQ_LEVEL_LOW, false);
+  trace_event(TRACE_IRQ, 0);
 
   if(com_task_handle) {
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -276,7 +262,8 @@ static void irq_handler(void) {
 void mcu_hw_spi_init(void) {
   debugf("Initializing SPI");
 
-  sem = xSemaphoreCreateMutex();
+  // bus arbitration between the different users
+  spi_arbiter_init();
 
   // init SPI at 20Mhz, mode 1
   spi_init(SPI_BUS, 20000000);
@@ -316,14 +303,17 @@ void mcu_hw_irq_ack(void) {
   gpio_set_irq_enabled(SPI_IRQ_PIN, GPIO_IRQ_LEVEL_LOW, 1); 
 }
 
+uint32_t mcu_hw_time_us(void) {
+  return time_us_32();
+}
+
+// access to the bus is arbitrated by spi_begin() and spi_end()
 void mcu_hw_spi_begin() {
-  xSemaphoreTake(sem, 0xffffffffUL);      // wait forever
   gpio_put(SPI_CSN_PIN, 0);  // Active low
 }
 
 void mcu_hw_spi_end() {
   gpio_put(SPI_CSN_PIN, 1);
-  xSemaphoreGive(sem);
 }
 
 unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
@@ -332,6 +322,19 @@ unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
   return retval;
 }
 
+void mcu_hw_spi_tx_buf(const unsigned char *buf, int len) {
+  spi_write_blocking(SPI_BUS, buf, len);
+}
+
+void mcu_hw_spi_rx_buf(unsigned char *buf, int len) {
+  spi_read_blocking(SPI_BUS, 0, buf, len);
+}
+
+int mcu_hw_spi_set_clock(int hz) {
+  // the prescalers only allow for integer fractions of the peripheral clock
+  return spi_set_baudrate(SPI_BUS, hz);
+}
+
 /* ======================================================================= */
 /* ======                   XBOX controllers                     ========= */
 /* ======================================================================= */
@@ -350,60 +353,9 @@ void tuh_xinput_report_received_cb(uint8_t dev_addr, uint8_t instance, xinputh_i
     if (xid_itf->connected && xid_itf->new_pad_data) {
 
       // find matching hid report
-      for(int idx=0;idx<MAX_XBOX_DEVICES;idx++) {
-	if(xbox_state[idx].dev_addr == dev_addr && xbox_state[idx].instance == instance) {
-      
-	  // build new state
-	  unsigned char state =
-	    ((p->wButtons & XINPUT_GAMEPAD_DPAD_UP   )?0x08:0x00) |
-	    ((p->wButtons & XINPUT_GAMEPAD_DPAD_DOWN )?0x04:0x00) |
-	    ((p->wButtons & XINPUT_GAMEPAD_DPAD_LEFT )?0x02:0x00) |
-	    ((p->wButtons & XINPUT_GAMEPAD_DPAD_RIGHT)?0x01:0x00) |
-	    ((p->wButtons & 0xf000) >> 8);
-
-    // build extra button new state
-    unsigned char state_btn_extra =
-	    ((p->wButtons & XINPUT_GAMEPAD_LEFT_SHOULDER  )?0x01:0x00) |
-	    ((p->wButtons & XINPUT_GAMEPAD_RIGHT_SHOULDER )?0x02:0x00) |
-	    ((p->wButtons & XINPUT_GAMEPAD_BACK           )?0x10:0x00) | // Rumblepad 2 / Dual Action compatibility
-	    ((p->wButtons & XINPUT_GAMEPAD_START          )?0x20:0x00);
-
-	  // build analog stick x,y state
-      int16_t sThumbLX = p->sThumbLX;
-      int16_t sThumbLY = p->sThumbLY;
-      uint8_t ax = byteScaleAnalog(sThumbLX);
-      uint8_t ay = ~byteScaleAnalog(sThumbLY);
-
-    // map analog stick directions to digital
-    if(ax > (uint8_t) 0xc0) state |= 0x01;
-    if(ax < (uint8_t) 0x40) state |= 0x02;
-    if(ay > (uint8_t) 0xc0) state |= 0x04;
-    if(ay < (uint8_t) 0x40) state |= 0x08;
-
-    // submit if state has changed
-	  if((state != xbox_state[idx].state) ||
-      (state_btn_extra != xbox_state[idx].state_btn_extra) ||
-      (ax != xbox_state[idx].state_x) ||
-      (ay != xbox_state[idx].state_y)) {
-
-      xbox_state[idx].state = state;
-      xbox_state[idx].state_btn_extra = state_btn_extra;
-      xbox_state[idx].state_x = sThumbLX;
-      xbox_state[idx].state_y = sThumbLY;
-      usb_debugf("XBOX Joy%d: B %02x EB %02x X %02x Y %02x", xbox_state[idx].js_index, state, state_btn_extra, byteScaleAnalog(ax), byteScaleAnalog(ay));
-
-	    mcu_hw_spi_begin();
-	    mcu_hw_spi_tx_u08(SPI_TARGET_HID);
-	    mcu_hw_spi_tx_u08(SPI_HID_JOYSTICK);
-	    mcu_hw_spi_tx_u08(xbox_state[idx].js_index);
-	    mcu_hw_spi_tx_u08(state);
-	    mcu_hw_spi_tx_u08(ax); // gamepad analog X
-	    mcu_hw_spi_tx_u08(ay); // gamepad analog Y
-	    mcu_hw_spi_tx_u08(state_btn_extra); // gamepad extra buttons
-	    mcu_hw_spi_end();
-    }
-	}
-      }
+      for(int idx=0;idx<MAX_XBOX_DEVICES;idx++)
+	if(xbox_state[idx].dev_addr == dev_addr && xbox_state[idx].instance == instance)
+	  xinput_parse(&xbox_state[idx].pad, p->wButtons, p->sThumbLX, p->sThumbLY);
     }
   }
   tuh_xinput_receive_report(dev_addr, instance);
@@ -419,11 +371,7 @@ void tuh_xinput_mount_cb(uint8_t dev_addr, uint8_t instance, const xinputh_inter
     usb_debugf("Using XBOX entry %d", idx);
     xbox_state[idx].dev_addr = dev_addr;
     xbox_state[idx].instance = instance;
-    xbox_state[idx].state = 0;
-    xbox_state[idx].state_btn_extra = 0;
-    xbox_state[idx].state_x = 0;
-    xbox_state[idx].state_y = 0;
-    xbox_state[idx].js_index = hid_allocate_joystick();
+    xinput_init(&xbox_state[idx].pad);
   } else
     usb_debugf("Error, no more free XBOX entries");
 
@@ -447,9 +395,9 @@ void tuh_xinput_umount_cb(uint8_t dev_addr, uint8_t instance) {
   // find matching hid report
   for(int idx=0;idx<MAX_XBOX_DEVICES;idx++) {
     if(xbox_state[idx].dev_addr == dev_addr && xbox_state[idx].instance == instance) {
-      usb_debugf("releasing %d/%d", idx, xbox_state[idx].js_index);
+      usb_debugf("releasing %d/%d", idx, xbox_state[idx].pad.js_index);
       xbox_state[idx].dev_addr = 0xff;
-      hid_release_joystick(xbox_state[idx].js_index);
+      xinput_release(&xbox_state[idx].pad);
     }
   }
   usb_check_devices();
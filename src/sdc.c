@@ -22,92 +22,191 @@
 #endif
 #endif
 
-// enable to use old way to determine cluster position
-// #define USE_FSEEK
-
 #include "debug.h"
 #include "config.h"
 #include "mcu_hw.h"
+#include "trace.h"
+#include "audio.h"
 
 static SemaphoreHandle_t sdc_sem;
 
 static FATFS fs;
 
-static FIL fil[MAX_DRIVES];
-static DWORD *lktbl[MAX_DRIVES];
+// A mounted image is never read through FatFs. Its sectors are only
+// translated using the link map, so no FIL with its sector buffer is
+// kept per drive
+typedef struct {
+  FSIZE_t size;
+  DWORD *cltbl;       // link map, NULL if no image is mounted
+} sdc_image_t;
+
+static sdc_image_t image[MAX_DRIVES];
 
 static void sdc_spi_begin(void) {
-  mcu_hw_spi_begin();  
+  spi_begin(SPI_PRIO_SDC);  
   mcu_hw_spi_tx_u08(SPI_TARGET_SDC);
 }
 
-static LBA_t clst2sect(DWORD clst) {
-  clst -= 2;
-  if (clst >= fs.n_fatent - 2)   return 0;
-  return fs.database + (LBA_t)fs.csize * clst;
+// ----------------------- optional CRC protection --------------------------
+
+#define SDC_CRC_RETRIES  3
+#define SDC_READY_TIMEOUT_US  500000   // max time for the core to serve a MCU request
+
+static unsigned long sdc_crc_errors = 0;     // damaged transfers detected
+static unsigned long sdc_crc_failures = 0;   // transfers failed despite retries
+
+static bool sdc_crc(void) {
+  return spi_crc_targets & (1<<SPI_TARGET_SDC);
 }
 
-int sdc_read_sector(unsigned long sector, unsigned char *buffer) {
-  // check if sd card is still busy as it may
-  // be reading a sector for the core. Forcing a MCU read
-  // may change the data direction from core to mcu while
-  // the core is still reading
+// count CRC errors and timeouts and decide whether a failed transfer
+// is to be repeated
+static bool sdc_crc_retry(bool ok, int *retry, const char *what) {
+  if(ok) return false;
+
+  sdc_crc_errors++;
+  if(++(*retry) <= SDC_CRC_RETRIES) {
+    sdc_debugf("CRC error or timeout in %s, retry %d", what, *retry);
+    return true;
+  }
+
+  sdc_crc_failures++;
+  debugf("SDC: CRC error or timeout in %s, giving up (%lu errors, %lu failures)",
+	 what, sdc_crc_errors, sdc_crc_failures);
+  return false;
+}
+
+static void sdc_tx_crc(uint16_t crc) {
+  mcu_hw_spi_tx_u08(crc >> 8);
+  mcu_hw_spi_tx_u08(crc & 0xff);
+}
+
+static bool sdc_rx_crc(uint16_t crc) {
+  uint16_t rx = mcu_hw_spi_tx_u08(0) << 8;
+  rx |= mcu_hw_spi_tx_u08(0);
+  return rx == crc;
+}
+
+// send a sector number, followed by its CRC if enabled
+static void sdc_tx_sector(unsigned long sector) {
+  uint16_t crc = SPI_CRC_INIT;
+  for(int i=24;i>=0;i-=8) {
+    mcu_hw_spi_tx_u08((sector >> i) & 0xff);
+    crc = spi_crc16(crc, (sector >> i) & 0xff);
+  }
+  if(sdc_crc()) sdc_tx_crc(crc);
+}
+
+// wait for a MCU read or write to complete. Returns false if the
+// core has ignored the request due to a CRC error or doesn't finish
+// it in time
+static bool sdc_wait_ready(void) {
   unsigned char status;
+  uint32_t start = mcu_hw_time_us();
+
   do {
+    status = mcu_hw_spi_tx_u08(0);
+    if(status && (uint32_t)(mcu_hw_time_us() - start) > SDC_READY_TIMEOUT_US) {
+      sdc_debugf("Timeout waiting for core, status %02x", status);
+      return false;
+    }
+  } while(status && !(sdc_crc() && status == SPI_SDC_CRC_ERROR));
+
+  return !status;
+}
+
+// read the sd card status, the drives requesting data and the
+// requested sector. With CRC enabled the core appends a CRC16
+// over these six bytes
+static unsigned char sdc_get_status(unsigned char *request, unsigned long *sector) {
+  unsigned char buffer[6];
+  int retry = 0;
+  bool ok;
+  
+  do {
+    uint16_t crc = SPI_CRC_INIT;
     sdc_spi_begin();  
     mcu_hw_spi_tx_u08(SPI_SDC_STATUS);
-    status = mcu_hw_spi_tx_u08(0);
-    mcu_hw_spi_end();  
-  } while(status & 0x02);   // card busy?
+    for(int i=0;i<6;i++) {
+      buffer[i] = mcu_hw_spi_tx_u08(0);
+      crc = spi_crc16(crc, buffer[i]);
+    }
+    ok = !sdc_crc() || sdc_rx_crc(crc);
+    spi_end();
+  } while(sdc_crc_retry(ok, &retry, "status"));
+  
+  if(request) *request = ok?buffer[1]:0;
+  if(sector)  *sector = ((unsigned long)buffer[2] << 24) | ((unsigned long)buffer[3] << 16) |
+	      (buffer[4] << 8) | buffer[5];
+  return buffer[0];
+}
 
-  sdc_spi_begin();  
-  mcu_hw_spi_tx_u08(SPI_SDC_MCU_READ);
-  mcu_hw_spi_tx_u08((sector >> 24) & 0xff);
-  mcu_hw_spi_tx_u08((sector >> 16) & 0xff);
-  mcu_hw_spi_tx_u08((sector >> 8) & 0xff);
-  mcu_hw_spi_tx_u08(sector & 0xff);
+static LBA_t clst2sect(DWORD clst) {
+  clst -= 2;
+  if (clst >= fs.n_fatent - 2)   return 0;
+  return fs.database + (LBA_t)fs.csize * clst;
+}
 
-  // todo: add timeout
-  while(mcu_hw_spi_tx_u08(0));  // wait for ready
+int sdc_read_sector(unsigned long sector, unsigned char *buffer) {
+  int retry = 0;
+  bool ok;
 
-  // read 512 bytes sector data
-  for(int i=0;i<512;i++) buffer[i] = mcu_hw_spi_tx_u08(0);
+  do {
+    // check if sd card is still busy as it may
+    // be reading a sector for the core. Forcing a MCU read
+    // may change the data direction from core to mcu while
+    // the core is still reading
+    while(sdc_get_status(NULL, NULL) & 0x02);   // card busy?
 
-  mcu_hw_spi_end();
+    sdc_spi_begin();  
+    mcu_hw_spi_tx_u08(SPI_SDC_MCU_READ);
+    sdc_tx_sector(sector);
+    ok = sdc_wait_ready();
+
+    if(ok) {
+      // read 512 bytes sector data
+      uint16_t crc = SPI_CRC_INIT;
+      for(int i=0;i<512;i++) {
+	buffer[i] = mcu_hw_spi_tx_u08(0);
+	crc = spi_crc16(crc, buffer[i]);
+      }
+      if(sdc_crc()) ok = sdc_rx_crc(crc);
+    }
+    spi_end();
+  } while(sdc_crc_retry(ok, &retry, "sector read"));
 
   //  sdc_debugf("sector %ld", sector);
   //  hexdump(buffer, 512);
 
-  return 0;
+  return ok?0:-1;
 }
 
 int sdc_write_sector(unsigned long sector, const unsigned char *buffer) {
-  // check if sd card is still busy as it may
-  // be reading a sector for the core.
-  unsigned char status;
-  do {
-    sdc_spi_begin();  
-    mcu_hw_spi_tx_u08(SPI_SDC_STATUS);
-    status = mcu_hw_spi_tx_u08(0);
-    mcu_hw_spi_end();  
-  } while(status & 0x02);   // card busy?
-
-  sdc_spi_begin();  
-  mcu_hw_spi_tx_u08(SPI_SDC_MCU_WRITE);
-  mcu_hw_spi_tx_u08((sector >> 24) & 0xff);
-  mcu_hw_spi_tx_u08((sector >> 16) & 0xff);
-  mcu_hw_spi_tx_u08((sector >> 8) & 0xff);
-  mcu_hw_spi_tx_u08(sector & 0xff);
+  int retry = 0;
+  bool ok;
 
-  // write sector data
-  for(int i=0;i<512;i++) mcu_hw_spi_tx_u08(buffer[i]);  
-
-  // todo: add timeout
-  while(mcu_hw_spi_tx_u08(0));  // wait for ready
+  do {
+    // check if sd card is still busy as it may
+    // be reading a sector for the core.
+    while(sdc_get_status(NULL, NULL) & 0x02);   // card busy?
 
-  mcu_hw_spi_end();
+    sdc_spi_begin();  
+    mcu_hw_spi_tx_u08(SPI_SDC_MCU_WRITE);
+    sdc_tx_sector(sector);
+
+    // write sector data
+    uint16_t crc = SPI_CRC_INIT;
+    for(int i=0;i<512;i++) {
+      mcu_hw_spi_tx_u08(buffer[i]);
+      crc = spi_crc16(crc, buffer[i]);
+    }
+    if(sdc_crc()) sdc_tx_crc(crc);
+    
+    ok = sdc_wait_ready();
+    spi_end();
+  } while(sdc_crc_retry(ok, &retry, "sector write"));
 
-  return 0;
+  return ok?0:-1;
 }
 
 // -------------------- fatfs read/write interface to sd card connected to fpga -------------------
@@ -118,15 +217,27 @@ int sdc_write_sector(unsigned long sector, const unsigned char *buffer) {
 #define SDC_RESULT DRESULT
 #endif
 
+// deferred trace arguments are 32 bit, so 64 bit sector numbers are
+// logged as two hex words
+#if FF_LBA64
+#define sdc_trace_lba(a, sector, count) \
+  sdc_tracef(a "(%lx:%08lx,%u)", (uint32_t)((uint64_t)(sector) >> 32), (uint32_t)(sector), count)
+#else
+#define sdc_trace_lba(a, sector, count)  sdc_tracef(a "(%lu,%u)", sector, count)
+#endif
+
 static SDC_RESULT sdc_read(BYTE *buff, LBA_t sector, UINT count) {
-  sdc_debugf("sdc_read(%p,%lu,%u)", buff, sector, count);  
-  sdc_read_sector(sector, buff);
+  sdc_trace_lba("sdc_read", sector, count);
+  // fatfs reads multiple sectors at once when reading large blocks
+  for(;count;count--,sector++,buff+=512)
+    if(sdc_read_sector(sector, buff)) return RES_ERROR;
   return 0;
 }
 
 static SDC_RESULT sdc_write(const BYTE *buff, LBA_t sector, UINT count) {
-  sdc_debugf("sdc_write(%p,%lu,%u)", buff, sector, count);  
-  sdc_write_sector(sector, buff);
+  sdc_trace_lba("sdc_write", sector, count);
+  for(;count;count--,sector++,buff+=512)
+    if(sdc_write_sector(sector, buff)) return RES_ERROR;
   return 0;
 }
 
@@ -185,7 +296,7 @@ static int fs_init() {
   FRESULT res_msc;
 
   for(int i=0;i<MAX_DRIVES;i++)
-    lktbl[i] = NULL;
+    image[i].cltbl = NULL;
 
 #ifdef DEV_SD
   FATFS_DiskioDriverTypeDef MSC_DiskioDriver = { NULL };
@@ -216,10 +327,7 @@ static int fs_init() {
   unsigned char status;
   int timeout = 200;
   do {
-    sdc_spi_begin();  
-    mcu_hw_spi_tx_u08(SPI_SDC_STATUS);
-    status = mcu_hw_spi_tx_u08(0);
-    mcu_hw_spi_end();
+    status = sdc_get_status(NULL, NULL);
 
     if((status & 0xf0) != 0x80) {
       timeout--;
@@ -258,6 +366,7 @@ static int fs_init() {
 // keep track of working directory for each drive
 static char *cwd[MAX_DRIVES];
 static char *image_name[MAX_DRIVES];
+static char *image_dir[MAX_DRIVES];     // directory the image was opened from
 
 void sdc_set_default(int drive, const char *name) {
   sdc_debugf("set default %d: %s", drive, name);
@@ -285,15 +394,13 @@ char *sdc_get_cwd(int drive) {
   return cwd[drive];
 }
 
-#ifndef USE_FSEEK
 // this function has been taken from fatfs ff.c as it's static there
-static DWORD clmt_clust(FIL *fp, FSIZE_t ofs) {
+static DWORD clmt_clust(DWORD *cltbl, FSIZE_t ofs) {
   DWORD cl, ncl;
   DWORD *tbl;
-  FATFS *fs = fp->obj.fs;
   
-  tbl = fp->cltbl + 1;                    /* Top of CLMT */
-  cl = (DWORD)(ofs / FF_MAX_SS / fs->csize); /* Cluster order from top of the file */
+  tbl = cltbl + 1;                        /* Top of CLMT */
+  cl = (DWORD)(ofs / FF_MAX_SS / fs.csize); /* Cluster order from top of the file */
   for (;;) {
     ncl = *tbl++; /* Number of cluters in the fragment */
     if (ncl == 0)
@@ -305,61 +412,165 @@ static DWORD clmt_clust(FIL *fp, FSIZE_t ofs) {
   }
   return cl + *tbl; /* Return the cluster number */
 }
+
+// ------------------------- core request handling ---------------------------
+
+// print per drive service latencies every 1000 requests
+// #define SDC_STATS
+
+#define SDC_SERVICE_MAX  (2*MAX_DRIVES)   // max requests served per interrupt
+
+static int sdc_last_drive = MAX_DRIVES-1; // drive served last, for round robin
+static bool sdc_select_ok = true;         // core supports SPI_SDC_SELECT
+
+#ifdef SDC_STATS
+static struct {
+  unsigned long count;
+  unsigned long long sum;     // sum of latencies in us
+  uint32_t max;
+  uint32_t since;             // time request was first seen
+  bool pending;
+} sdc_stats[MAX_DRIVES];
+
+static unsigned long sdc_stats_total = 0;
+
+static void sdc_stats_pending(unsigned char request) {
+  for(int i=0;i<MAX_DRIVES;i++) {
+    if((request & (1<<i)) && !sdc_stats[i].pending) {
+      sdc_stats[i].pending = true;
+      sdc_stats[i].since = mcu_hw_time_us();
+    }
+  }
+}
+
+static void sdc_stats_served(int drive) {
+  uint32_t lat = mcu_hw_time_us() - sdc_stats[drive].since;
+
+  sdc_stats[drive].pending = false;
+  sdc_stats[drive].count++;
+  sdc_stats[drive].sum += lat;
+  if(lat > sdc_stats[drive].max) sdc_stats[drive].max = lat;
+
+  if(!(++sdc_stats_total % 1000)) {
+    for(int i=0;i<MAX_DRIVES;i++)
+      if(sdc_stats[i].count)
+	debugf("SDC DRV %d: %lu requests, avg latency %lu us, max %lu us", i,
+	       sdc_stats[i].count, (unsigned long)(sdc_stats[i].sum/sdc_stats[i].count),
+	       (unsigned long)sdc_stats[i].max);
+  }
+}
+#else
+#define sdc_stats_pending(a)
+#define sdc_stats_served(a)
 #endif
 
-int sdc_handle_event(void) {  
-  // read sd status
+// ask the core to report the request of the given drive in the next
+// status. Cores not supporting this return 0 instead of the drive
+static bool sdc_select(int drive) {
   sdc_spi_begin();  
-  mcu_hw_spi_tx_u08(SPI_SDC_STATUS);
-  mcu_hw_spi_tx_u08(0);
-  unsigned char request = mcu_hw_spi_tx_u08(0);
-  unsigned long rsector = 0;
-  for(int i=0;i<4;i++) rsector = (rsector << 8) | mcu_hw_spi_tx_u08(0); 
-  mcu_hw_spi_end();
-
-  int drive = 0;
-  while(!(request & (1<<drive))) drive++;
-
-  if(request) {
-    if(!fil[drive].flag) {
-      // no file selected
-      // this should actually never happen as the core won't request
-      // data if it hasn't been told that an image is inserted
-      return -1;
-    }
+  mcu_hw_spi_tx_u08(SPI_SDC_SELECT);
+  mcu_hw_spi_tx_u08(drive);
+  unsigned char ack = mcu_hw_spi_tx_u08(0);
+  spi_end();
+
+  if(ack != (0x80 | drive)) {
+    sdc_debugf("Core doesn't support drive selection");
+    sdc_select_ok = false;
+  }
+  return sdc_select_ok;
+}
+
+// let the core read or write the physical sector matching the requested
+// sector of an image
+static int sdc_serve(int drive, unsigned long rsector) {
+  trace_event(TRACE_SDC_REQUEST, drive);
+  audio_floppy_access(drive, rsector);
     
-    // ---- figure out which physical sector to use ----
+  // ---- figure out which physical sector to use ----
   
-    // translate sector into a cluster number inside image
-    sdc_lock();
-#ifdef USE_FSEEK
-    f_lseek(&fil[drive], (rsector+1)*512);
-    // and add sector offset within cluster    
-    unsigned long dsector = clst2sect(fil[drive].clust) + rsector%fs.csize;    
-#else
-    // derive cluster directly from table
-    unsigned long dsector = clst2sect(clmt_clust(&fil[drive], rsector*512)) + rsector%fs.csize;
-#endif
+  // translate sector into a cluster number inside image
+  sdc_lock();
+  if(!image[drive].cltbl) {
+    // no file selected
+    // this should actually never happen as the core won't request
+    // data if it hasn't been told that an image is inserted
+    sdc_unlock();
+    return -1;
+  }
+    
+  // derive cluster directly from table and add sector offset within cluster
+  unsigned long dsector = clst2sect(clmt_clust(image[drive].cltbl, (FSIZE_t)rsector*512)) +
+    rsector%fs.csize;
     
-    sdc_debugf("DRV %d: lba %lu = %lu", drive, rsector, dsector);
+  sdc_tracef("DRV %d: lba %lu = %lu", drive, rsector, dsector);
 
-    // send sector number to core, so it can read or write the right
-    // sector from/to its local sd card
+  // send sector number to core, so it can read or write the right
+  // sector from/to its local sd card
+  int retry = 0;
+  bool ok;
+  do {
     sdc_spi_begin();  
     mcu_hw_spi_tx_u08(SPI_SDC_CORE_RW);
-    mcu_hw_spi_tx_u08((dsector >> 24) & 0xff);
-    mcu_hw_spi_tx_u08((dsector >> 16) & 0xff);
-    mcu_hw_spi_tx_u08((dsector >> 8) & 0xff);
-    mcu_hw_spi_tx_u08(dsector & 0xff);
+    sdc_tx_sector(dsector);
+    trace_event(TRACE_SDC_CORE_RW, drive);
 
     // wait while core is busy to make sure we don't start
     // requesting data for ourselves while the core is still
     // doing its own io
-    while(mcu_hw_spi_tx_u08(0) & 1);
+    unsigned char status;
+    do status = mcu_hw_spi_tx_u08(0);
+    while(status & 1);
+    trace_event(TRACE_SDC_DONE, drive);
     
-    mcu_hw_spi_end();
+    spi_end();
 
-    sdc_unlock();
+    // the core ignores a sector number with damaged CRC
+    ok = !(sdc_crc() && (status & SPI_SDC_CRC_ERROR));
+  } while(sdc_crc_retry(ok, &retry, "core request"));
+
+  sdc_unlock();
+  sdc_stats_served(drive);
+  
+  return 0;
+}
+
+// serve all drives with pending requests. With several drives waiting,
+// the drive following the one served last is served next, so a busy
+// drive cannot starve the others
+int sdc_handle_event(void) {  
+  // read sd status
+  unsigned char request;
+  unsigned long rsector;
+  sdc_get_status(&request, &rsector);
+
+  for(int n=0;request && n<SDC_SERVICE_MAX;n++) {
+    sdc_stats_pending(request);
+
+    int drive = 0;
+    if(request & (request-1)) {
+      // several requests: pick next drive in round robin order if the
+      // core lets us choose. Otherwise it reports the lowest drive
+      if(sdc_select_ok) {
+	drive = sdc_last_drive;
+	do drive = (drive+1) % MAX_DRIVES;
+	while(!(request & (1<<drive)));
+
+	if(sdc_select(drive))
+	  sdc_get_status(&request, &rsector);
+      }
+
+      if(!sdc_select_ok || !(request & (1<<drive))) {
+	drive = 0;
+	while(!(request & (1<<drive))) drive++;
+      }
+    } else
+      while(!(request & (1<<drive))) drive++;
+    
+    if(sdc_serve(drive, rsector) != 0) return -1;
+    sdc_last_drive = drive;
+
+    // check for further requests that came in meanwhile
+    sdc_get_status(&request, &rsector);
   }
 
   return 0;
@@ -378,7 +589,7 @@ static void sdc_image_enable_direct(char drive, unsigned long start) {
   mcu_hw_spi_tx_u08((start >> 8) & 0xff);
   mcu_hw_spi_tx_u08(start & 0xff);
   
-  mcu_hw_spi_end();
+  spi_end();
 }
 
 static int sdc_image_inserted(char drive, FSIZE_t size) {
@@ -416,100 +627,404 @@ static int sdc_image_inserted(char drive, FSIZE_t size) {
   mcu_hw_spi_tx_u08((size >> 8) & 0xff);
   mcu_hw_spi_tx_u08(size & 0xff);
 
-  mcu_hw_spi_end();
+  spi_end();
 
   return 0;
 }
 
-int sdc_image_open(int drive, char *name) {
+// ------------------------- link map builder ---------------------------
+//
+// FatFs' CREATE_LINKMAP needs the table size in advance. If the initial
+// guess is too small, the whole FAT chain has to be walked a second
+// time. Instead the chain is walked once here, reading the FAT directly
+// and growing a scratch table shared by all drives. Each drive then
+// gets an exactly sized copy.
+
+static DWORD *clmt_pool = NULL;
+static DWORD clmt_pool_size = 0;   // in DWORDs
+
+// get the cluster following clst from a FAT16, FAT32 or exFAT FAT. The
+// FAT sector last read is kept in the 512 byte buffer fat. Returns 0
+// if the sector cannot be read
+static DWORD sdc_fat_next(DWORD clst, unsigned char *fat, LBA_t *fat_sector) {
+  unsigned int ofs;
+  LBA_t sector;
+  if(fs.fs_type == FS_FAT16) {
+    sector = fs.fatbase + clst / 256;
+    ofs = 2 * (clst % 256);
+  } else {
+    sector = fs.fatbase + clst / 128;
+    ofs = 4 * (clst % 128);
+  }
+
+  if(sector != *fat_sector) {
+    if(sdc_read_sector(sector, fat)) return 0;
+    *fat_sector = sector;
+  }
+
+  DWORD next = fat[ofs] | (fat[ofs+1] << 8);
+  if(fs.fs_type != FS_FAT16)
+    next |= ((DWORD)fat[ofs+2] << 16) | ((DWORD)(fat[ofs+3] & 0x0f) << 24);
+
+  return next;
+}
+
+static DWORD *sdc_clmt_build(FIL *fp) {
+  DWORD clst = fp->obj.sclust;
+  FSIZE_t ncl = (fp->obj.objsize + 512 * fs.csize - 1) / (512 * fs.csize);
+  if(!clst || !ncl) return NULL;
+
+  // FAT12 entries may span sector boundaries and FatFs may still hold
+  // unwritten FAT changes. Leave these cases to FatFs
+  if(fs.fs_type == FS_FAT12 || fs.wflag) return NULL;
+
+  bool contiguous = false;
+#if FF_FS_EXFAT
+  // contiguous exFAT files have no FAT chain at all
+  contiguous = (fp->obj.stat == 2);
+#endif
+
+  unsigned char *fat = malloc(512);
+  if(!fat) return NULL;
+  LBA_t fat_sector = 0;     // FAT sector currently in buffer
+  DWORD n = 1;              // entry 0 is the table size
+  bool ok = true;
+
+  while(ncl && ok) {
+    // make room for another fragment and the terminating zero
+    if(n + 3 > clmt_pool_size) {
+      DWORD size = clmt_pool_size?2*clmt_pool_size:64;
+      DWORD *pool = realloc(clmt_pool, size * sizeof(DWORD));
+      if(!pool) { ok = false; break; }
+      clmt_pool = pool;
+      clmt_pool_size = size;
+    }
+
+    // follow the chain as long as it's contiguous
+    DWORD start = clst, len = 0;
+    while(ncl) {
+      len++;
+      if(!--ncl) break;
+
+      DWORD next = contiguous?(clst + 1):sdc_fat_next(clst, fat, &fat_sector);
+
+      // end of chain or broken chain before the end of the file
+      if(next < 2 || next >= fs.n_fatent) { ok = false; break; }
+
+      clst = next;
+      if(clst != start + len) break;   // next fragment
+    }
+
+    clmt_pool[n++] = len;
+    clmt_pool[n++] = start;
+  }
+  free(fat);
+  if(!ok) return NULL;
+
+  clmt_pool[n++] = 0;
+  clmt_pool[0] = n;
+
+  DWORD *tbl = malloc(n * sizeof(DWORD));
+  if(tbl) memcpy(tbl, clmt_pool, n * sizeof(DWORD));
+  return tbl;
+}
+
+// let FatFs create the link map. This may walk the FAT chain twice
+static DWORD *sdc_clmt_fatfs(FIL *fp, int drive) {
+  // try with a 16 entry link table
+  DWORD *tbl = malloc(16 * sizeof(DWORD));    
+  fp->cltbl = tbl;
+  tbl[0] = 16;
+    
+  if(f_lseek(fp, CREATE_LINKMAP)) {
+    // this isn't really a problem. But sector access will
+    // be slower
+    sdc_debugf("DRV %d: Short link table creation failed, "
+	       "required size: %lu", drive, tbl[0]);
+
+    // re-alloc sufficient memory
+    tbl = realloc(tbl, sizeof(DWORD) * tbl[0]);
+    fp->cltbl = tbl;
+
+    // and retry link table creation
+    if(f_lseek(fp, CREATE_LINKMAP)) {
+      sdc_debugf("DRV %d: Link table creation finally failed, "
+		 "required size: %lu", drive, tbl[0]);
+      free(tbl);
+      fp->cltbl = NULL;
+      return NULL;
+    }
+  }
+  return tbl;
+}
+
+// ------------------------- link map cache ---------------------------
+//
+// Creating the link map of an image walks its entire FAT chain. For
+// large images this takes thousands of sector reads. The resulting map
+// is thus stored in a file next to the image and re-used as long as
+// the image's start cluster, size and modification time don't change
+// and the FAT still links the cached fragments.
+
+// comment to disable the link map cache
+#define SDC_CLMT_CACHE
+
+#define SDC_CLMT_EXT        ".clmt"
+#define SDC_CLMT_MAGIC      0x544d4c43   // "CLMT"
+#define SDC_CLMT_MIN_CLUST  1024         // don't cache maps of smaller images
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sclust;          // start cluster of image
+  uint64_t size;            // image size
+  uint16_t fdate, ftime;    // image modification time
+  uint32_t csize;           // file system geometry
+  uint32_t n_fatent;
+  uint32_t len;             // number of DWORDs in link map
+} sdc_clmt_hdr_t;
+
+#ifdef SDC_CLMT_CACHE
+// check if walking the FAT chain of this image takes long enough to
+// make a cached link map worthwhile
+static bool sdc_clmt_cacheable(FIL *fp) {
+#if FF_FS_EXFAT
+  // contiguous exFAT files don't use the FAT at all
+  if(fp->obj.stat == 2) return false;
+#endif
+  return fp->obj.objsize / 512 / fs.csize >= SDC_CLMT_MIN_CLUST;
+}
+
+static void sdc_clmt_hdr(sdc_clmt_hdr_t *hdr, FIL *fp, FILINFO *fno, DWORD len) {
+  memset(hdr, 0, sizeof(sdc_clmt_hdr_t));
+  hdr->magic = SDC_CLMT_MAGIC;
+  hdr->sclust = fp->obj.sclust;
+  hdr->size = fp->obj.objsize;
+  hdr->fdate = fno->fdate;
+  hdr->ftime = fno->ftime;
+  hdr->csize = fs.csize;
+  hdr->n_fatent = fs.n_fatent;
+  hdr->len = len;
+}
+
+// Defragmenters may move clusters without changing the image's start
+// cluster or modification time. Check the FAT entry of each fragment's
+// last cluster. It must link to the next fragment or end the chain.
+// This costs about one FAT sector read per fragment
+static bool sdc_clmt_verify(const DWORD *tbl) {
+  // same restrictions as for the link map builder
+  if(fs.fs_type == FS_FAT12 || fs.wflag) return false;
+
+  DWORD eoc = (fs.fs_type == FS_FAT16)?0xfff8:0x0ffffff8;
+
+  unsigned char *fat = malloc(512);
+  if(!fat) return false;
+  LBA_t fat_sector = 0;
+  bool ok = true;
+
+  for(DWORD i=1;ok && tbl[i];i+=2) {
+    DWORD next = sdc_fat_next(tbl[i+1] + tbl[i] - 1, fat, &fat_sector);
+    ok = tbl[i+2]?(next == tbl[i+3]):(next >= eoc);
+  }
+  free(fat);
+
+  return ok;
+}
+
+// open the cached link map of an image and read its header. The
+// header must exactly match the image
+static bool sdc_clmt_open(const char *cname, FIL *fp, FILINFO *fno,
+			  FIL *file, sdc_clmt_hdr_t *hdr) {
+  if(f_open(file, cname, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+    return false;
+
+  sdc_clmt_hdr_t ref;
+  UINT br;
+  if(f_read(file, hdr, sizeof(sdc_clmt_hdr_t), &br) == FR_OK && br == sizeof(sdc_clmt_hdr_t)) {
+    sdc_clmt_hdr(&ref, fp, fno, hdr->len);
+    if(!memcmp(hdr, &ref, sizeof(sdc_clmt_hdr_t)) && hdr->len >= 4 && hdr->len < 0x10000)
+      return true;
+  }
+
+  f_close(file);
+  return false;
+}
+
+static DWORD *sdc_clmt_load(const char *fname, FIL *fp, FILINFO *fno) {
+  char cname[strlen(fname) + strlen(SDC_CLMT_EXT) + 1];
+  strcpy(cname, fname);
+  strcat(cname, SDC_CLMT_EXT);
+
+  FIL file;
+  sdc_clmt_hdr_t hdr;
+  if(!sdc_clmt_open(cname, fp, fno, &file, &hdr))
+    return NULL;
+
+  UINT br;
+  DWORD *tbl = malloc(sizeof(DWORD) * hdr.len);
+  if(tbl && (f_read(&file, tbl, sizeof(DWORD) * hdr.len, &br) != FR_OK ||
+	     br != sizeof(DWORD) * hdr.len)) {
+    free(tbl);
+    tbl = NULL;
+  }
+  f_close(&file);
+  if(!tbl) return NULL;
+
+  // the map must start at the image's first cluster, be terminated
+  // and cover the entire image
+  FSIZE_t clusters = 0;
+  DWORD i;
+  for(i=1;i<hdr.len-1 && tbl[i];i+=2) clusters += tbl[i];
+  if(tbl[0] != hdr.len || tbl[2] != fp->obj.sclust || i != hdr.len-1 || tbl[i] ||
+     clusters * 512 * fs.csize < fp->obj.objsize) {
+    sdc_debugf("Ignoring damaged link map cache %s", cname);
+    free(tbl);
+    return NULL;
+  }
+
+  if(!sdc_clmt_verify(tbl)) {
+    sdc_debugf("Ignoring outdated link map cache %s", cname);
+    free(tbl);
+    return NULL;
+  }
+  
+  return tbl;
+}
+
+static void sdc_clmt_save(const char *fname, FIL *fp, FILINFO *fno, DWORD *tbl) {
+  char cname[strlen(fname) + strlen(SDC_CLMT_EXT) + 1];
+  strcpy(cname, fname);
+  strcat(cname, SDC_CLMT_EXT);
+
+  FIL file;
+  if(f_open(&file, cname, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+    sdc_debugf("Unable to create link map cache %s", cname);
+    return;
+  }
+
+  sdc_clmt_hdr_t hdr;
+  sdc_clmt_hdr(&hdr, fp, fno, tbl[0]);
+
+  UINT bw;
+  FRESULT res = f_write(&file, &hdr, sizeof(hdr), &bw);
+  if(res == FR_OK) res = f_write(&file, tbl, sizeof(DWORD) * tbl[0], &bw);
+  f_close(&file);
+
+  // don't leave a partial cache behind
+  if(res != FR_OK) f_unlink(cname);
+}
+#endif
+
+// open an image from a given directory which may differ from the
+// drive's current one
+static int sdc_image_open_dir(int drive, const char *dir, const char *name) {
   unsigned long start_sector = 0;
   
   // tell core that the "disk" has been removed
   sdc_image_inserted(drive, 0);
 
-  // forget about any previous name
+  // close any previous image, especially free the link table. The
+  // menu may look at these from another task, so hold the lock
+  sdc_lock();
   if(image_name[drive]) {
     free(image_name[drive]);
     image_name[drive] = NULL;
   }
+  if(image_dir[drive]) {
+    free(image_dir[drive]);
+    image_dir[drive] = NULL;
+  }
+  if(image[drive].cltbl) {
+    sdc_debugf("DRV %d: freeing link table", drive);
+    free(image[drive].cltbl);
+    image[drive].cltbl = NULL;
+  }
+  sdc_unlock();
   
   // nothing to be inserted? Do nothing!
   if(!name) return 0;
 
   // assemble full name incl. path
-  char fname[strlen(cwd[drive]) + strlen(name) + 2];
-  strcpy(fname, cwd[drive]);
+  char fname[strlen(dir) + strlen(name) + 2];
+  strcpy(fname, dir);
   strcat(fname, "/");
   strcat(fname, name);
   
-  sdc_lock();
+  // the file is only kept open while the link map is being created
+  FIL *fp = malloc(sizeof(FIL));
+  if(!fp) return -1;
   
-  // close any previous image, especially free the link table
-  if(fil[drive].cltbl) {
-    sdc_debugf("DRV %d: freeing link table", drive);
-    free(lktbl[drive]);
-    lktbl[drive] = NULL;
-    fil[drive].cltbl = NULL;
-  }
+  sdc_lock();
   
   sdc_debugf("DRV %d: Mounting %s", drive, fname);
 
-  if(f_open(&fil[drive], fname, FA_OPEN_EXISTING | FA_READ) != 0) {
+  if(f_open(fp, fname, FA_OPEN_EXISTING | FA_READ) != 0) {
     sdc_debugf("DRV %d: file open failed", drive);
     sdc_unlock();
+    free(fp);
     return -1;
-  } else {
-    sdc_debugf("DRV %d: file opened, cl=%lu(%lu)", drive,
-	   fil[drive].obj.sclust, clst2sect(fil[drive].obj.sclust));
-    sdc_debugf("DRV %d: File len = %ld, spc = %d, clusters = %lu", drive,
-	   (unsigned long)fil[drive].obj.objsize, fs.csize,
-	   (unsigned long)fil[drive].obj.objsize / 512 / fs.csize);      
-    
-    // try with a 16 entry link table
-    lktbl[drive] = malloc(16 * sizeof(DWORD));    
-    fil[drive].cltbl = lktbl[drive];
-    lktbl[drive][0] = 16;
-    
-    if(f_lseek(&fil[drive], CREATE_LINKMAP)) {
-      // this isn't really a problem. But sector access will
-      // be slower
-      sdc_debugf("DRV %d: Short link table creation failed, "
-		 "required size: %lu", drive, lktbl[drive][0]);
-
-      // re-alloc sufficient memory
-      lktbl[drive] = realloc(lktbl[drive], sizeof(DWORD) * lktbl[drive][0]);
-
-      // and retry link table creation
-      if(f_lseek(&fil[drive], CREATE_LINKMAP)) {
-	sdc_debugf("DRV %d: Link table creation finally failed, "
-		   "required size: %lu", drive, lktbl[drive][0]);
-	free(lktbl[drive]);
-	lktbl[drive] = NULL;
-	fil[drive].cltbl = NULL;
-
-	sdc_unlock();
-	return -1;
-      } else 
-	sdc_debugf("DRV %d: Link table ok with %ld entries", drive, lktbl[drive][0]);
-    } else {
-      sdc_debugf("DRV %d: Short link table ok with %ld entries", drive, lktbl[drive][0]);
-
-      // A link table length of 4 means, that  there's only one entry in it. This
-      // in turn means that the file is continious. The start sector can thus be
-      // sent to the core which can then access any sector without further help
-      // by the MCU.
-      if(lktbl[drive][0] == 4 && lktbl[drive][3] == 0)
-	start_sector = clst2sect(lktbl[drive][2]);
+  }
+  
+  sdc_debugf("DRV %d: file opened, cl=%lu(%lu)", drive,
+	     fp->obj.sclust, clst2sect(fp->obj.sclust));
+  sdc_debugf("DRV %d: File len = %ld, spc = %d, clusters = %lu", drive,
+	     (unsigned long)fp->obj.objsize, fs.csize,
+	     (unsigned long)fp->obj.objsize / 512 / fs.csize);      
+
+  DWORD *tbl = NULL;
+#ifdef SDC_CLMT_CACHE
+  // try to use a previously stored link map
+  FILINFO fno;
+  bool cache = sdc_clmt_cacheable(fp) && (f_stat(fname, &fno) == FR_OK);
+  if(cache) tbl = sdc_clmt_load(fname, fp, &fno);
+
+  if(tbl)
+    sdc_debugf("DRV %d: Link table with %ld entries loaded from cache", drive, tbl[0]);
+  else {
+#endif
+    uint32_t start = mcu_hw_time_us();
+
+    // walk the FAT chain once. Fall back to FatFs for cases
+    // not handled by the own link map builder
+    tbl = sdc_clmt_build(fp);
+    if(!tbl) tbl = sdc_clmt_fatfs(fp, drive);
+
+    if(tbl) {
+      sdc_debugf("DRV %d: Link table with %ld entries built in %lu ms", drive,
+		 tbl[0], (unsigned long)(mcu_hw_time_us() - start) / 1000);
+#ifdef SDC_CLMT_CACHE
+      // save link map so the chain walk can be skipped next time
+      if(cache) sdc_clmt_save(fname, fp, &fno, tbl);
+#endif
     }
+#ifdef SDC_CLMT_CACHE
   }
+#endif
 
-  sdc_unlock();
+  image[drive].size = fp->obj.objsize;
+  image[drive].cltbl = tbl;
+  f_close(fp);
+  free(fp);
 
-  // remember current image name
+  if(!tbl) {
+    sdc_unlock();
+    return -1;
+  }
+  
+  // A link table length of 4 means, that  there's only one entry in it. This
+  // in turn means that the file is continious. The start sector can thus be
+  // sent to the core which can then access any sector without further help
+  // by the MCU.
+  if(tbl[0] == 4 && tbl[3] == 0)
+    start_sector = clst2sect(tbl[2]);
+
+  // remember current image name and where it's from
   image_name[drive] = strdup(name);
+  image_dir[drive] = strdup(dir);
+
+  sdc_unlock();
 
   // image has successfully been opened, so report image size to core
-  sdc_image_inserted(drive, fil[drive].obj.objsize);
+  sdc_image_inserted(drive, image[drive].size);
 
   // allow direct mapping if possible
   if(start_sector) sdc_image_enable_direct(drive, start_sector);
@@ -517,8 +1032,508 @@ int sdc_image_open(int drive, char *name) {
   return 0;
 }
 
+int sdc_image_open(int drive, char *name) {
+  return sdc_image_open_dir(drive, cwd[drive], name);
+}
+
+// ---------------------------- defragmentation ------------------------------
+
+#define SDC_FRAG_CHECK_SECTORS  4    // max FAT sectors read to check an image
+#define SDC_DEFRAG_EXT          ".defrag"
+#define SDC_DEFRAG_BACKUP_EXT   ".orig"
+#define SDC_DEFRAG_CHUNK        (16*512)
+
+// check if the image in the current directory of a drive is fragmented
+// and thus cannot be accessed directly by the core. Only a few FAT
+// sectors are read, so large contiguous images may be reported as
+// unknown (-1) unless a cached link map exists
+int sdc_image_fragmented(int drive, const char *name) {
+  sdc_lock();
+
+  // a mounted image already has its link map
+  if(image_name[drive] && !strcmp(name, image_name[drive]) &&
+     image_dir[drive] && !strcmp(cwd[drive], image_dir[drive]) && image[drive].cltbl) {
+    int ret = image[drive].cltbl[0] > 4;
+    sdc_unlock();
+    return ret;
+  }
+
+  char fname[strlen(cwd[drive]) + strlen(name) + 2];
+  strcpy(fname, cwd[drive]);
+  strcat(fname, "/");
+  strcat(fname, name);
+
+  FIL file;
+  if(f_open(&file, fname, FA_OPEN_EXISTING | FA_READ) != FR_OK) {
+    sdc_unlock();
+    return -1;
+  }
+
+  int ret = -1;
+  DWORD clst = file.obj.sclust;
+  FSIZE_t ncl = (file.obj.objsize + 512 * fs.csize - 1) / (512 * fs.csize);
+  
+#if FF_FS_EXFAT
+  if(file.obj.stat == 2) ret = 0;
+#endif
+
+#ifdef SDC_CLMT_CACHE
+  // only the header of a cached link map is read. Loading and
+  // verifying the map itself is left to the mount
+  FILINFO fno;
+  if(ret < 0 && sdc_clmt_cacheable(&file) && f_stat(fname, &fno) == FR_OK) {
+    char cname[strlen(fname) + strlen(SDC_CLMT_EXT) + 1];
+    strcpy(cname, fname);
+    strcat(cname, SDC_CLMT_EXT);
+
+    FIL cfile;
+    sdc_clmt_hdr_t hdr;
+    if(sdc_clmt_open(cname, &file, &fno, &cfile, &hdr)) {
+      ret = hdr.len > 4;
+      f_close(&cfile);
+    }
+  }
+#endif
+
+  // walk the chain until it's not contiguous anymore
+  unsigned char *fat = malloc(512);
+  if(ret < 0 && fat && clst && fs.fs_type != FS_FAT12 && !fs.wflag) {
+    LBA_t fat_sector = 0;
+    int reads = 0;
+    
+    while(ret < 0) {
+      if(!--ncl) { ret = 0; break; }   // end of file reached
+      
+      LBA_t prev = fat_sector;
+      DWORD next = sdc_fat_next(clst, fat, &fat_sector);
+      if(next != clst + 1) {
+	// a broken chain or a read error leaves the state unknown
+	if(next >= 2 && next < fs.n_fatent) ret = 1;
+	break;
+      }
+      clst = next;
+
+      if(fat_sector != prev && ++reads > SDC_FRAG_CHECK_SECTORS)
+	break;
+    }
+  }
+  if(fat) free(fat);
+  
+  f_close(&file);
+  sdc_unlock();
+
+  return ret;
+}
+
+// copy a fragmented image into a contiguous area, so it can directly be
+// accessed by the core. The progress callback is called with 0..100
+int sdc_image_defrag(int drive, void (*progress)(int)) {
+#if !FF_USE_EXPAND
+  sdc_debugf("DRV %d: Defragmentation requires FF_USE_EXPAND", drive);
+  return -1;
+#else
+  if(drive < 0 || drive >= MAX_DRIVES || !image_name[drive] ||
+     !image_dir[drive] || !image[drive].cltbl)
+    return -1;
+
+  if(image[drive].cltbl[0] == 4) {
+    sdc_debugf("DRV %d: Image is not fragmented", drive);
+    return 0;
+  }
+
+  // the user may have browsed elsewhere since the image was mounted,
+  // so use the directory it was actually opened from
+  char *name = strdup(image_name[drive]);
+  char *dir = strdup(image_dir[drive]);
+  if(!name || !dir) {
+    free(name);
+    free(dir);
+    return -1;
+  }
+  
+  char fname[strlen(dir) + strlen(name) + 2];
+  strcpy(fname, dir);
+  strcat(fname, "/");
+  strcat(fname, name);
+  char tname[strlen(fname) + strlen(SDC_DEFRAG_EXT) + 1];
+  strcpy(tname, fname);
+  strcat(tname, SDC_DEFRAG_EXT);
+  char bname[strlen(fname) + strlen(SDC_DEFRAG_BACKUP_EXT) + 1];
+  strcpy(bname, fname);
+  strcat(bname, SDC_DEFRAG_BACKUP_EXT);
+
+  sdc_debugf("DRV %d: Defragmenting %s", drive, fname);
+  
+  // eject the image from the core
+  sdc_image_open(drive, NULL);
+  sdc_lock();
+
+  // allocate a contiguous area for the copy
+  FIL src, dst;
+  bool src_open = false, dst_open = false;
+  unsigned char *buffer = NULL;
+  
+  FRESULT res = f_open(&src, fname, FA_OPEN_EXISTING | FA_READ);
+  if(res == FR_OK) {
+    src_open = true;
+    res = f_open(&dst, tname, FA_WRITE | FA_CREATE_ALWAYS);
+  }
+  if(res == FR_OK) {
+    dst_open = true;
+    res = f_expand(&dst, f_size(&src), 1);
+    if(res != FR_OK) sdc_debugf("DRV %d: No contiguous space for image", drive);
+  }
+  if(res == FR_OK) {
+    buffer = malloc(SDC_DEFRAG_CHUNK);
+    if(!buffer) res = FR_NOT_ENOUGH_CORE;
+  }
+  sdc_unlock();
+  
+  // copy in large chunks. The lock is released between chunks, so the
+  // core can continue to use other drives
+  FSIZE_t done = 0, size = src_open?f_size(&src):0;
+  int percent = -1;
+  while(res == FR_OK && done < size) {
+    UINT br, bw;
+    sdc_lock();
+    res = f_read(&src, buffer, SDC_DEFRAG_CHUNK, &br);
+    if(res == FR_OK) res = f_write(&dst, buffer, br, &bw);
+    if(res == FR_OK && (!br || bw != br)) res = FR_DISK_ERR;
+    sdc_unlock();
+    done += br;
+    
+    if(progress && percent != (int)(100 * done / size))
+      progress(percent = 100 * done / size);
+  }
+  if(buffer) free(buffer);
+
+  sdc_lock();
+  if(src_open) f_close(&src);
+  if(dst_open && f_close(&dst) != FR_OK && res == FR_OK) res = FR_DISK_ERR;
+
+  // replace the original by the copy only if everything went fine. The
+  // original is kept as a backup until the copy is in place
+  bool keep_copy = false;
+  if(res == FR_OK) {
+    res = f_rename(fname, bname);
+    if(res == FR_OK) {
+      res = f_rename(tname, fname);
+      if(res == FR_OK) {
+	if(f_unlink(bname) != FR_OK)
+	  sdc_debugf("DRV %d: Unable to remove backup %s", drive, bname);
+      } else if(f_rename(bname, fname) != FR_OK) {
+	// neither name is usable anymore, leave both files for the user
+	sdc_debugf("DRV %d: Original image left as %s, copy as %s", drive, bname, tname);
+	keep_copy = true;
+      }
+    }
+  }
+  if(res != FR_OK && dst_open && !keep_copy) f_unlink(tname);
+
+#ifdef SDC_CLMT_CACHE
+  // a cached link map of the old file is now useless
+  char cname[strlen(fname) + strlen(SDC_CLMT_EXT) + 1];
+  strcpy(cname, fname);
+  strcat(cname, SDC_CLMT_EXT);
+  f_unlink(cname);
+#endif
+  sdc_unlock();
+
+  if(res != FR_OK) sdc_debugf("DRV %d: Defragmentation failed: %d", drive, res);
+  
+  // re-insert the (hopefully now contiguous) image
+  sdc_image_open_dir(drive, dir, name);
+  free(name);
+  free(dir);
+  
+  return (res == FR_OK)?0:-1;
+#endif
+}
+
+// --------------------------- blank image creation ---------------------------
+
+#define SDC_CREATE_CHUNK       (16*512)
+#define SDC_CREATE_HDF_CLEAR   (2*SDC_HDF_CYL_SIZE) // rdb and partition boot blocks
+#define SDC_CREATE_HDF_SIZE    (32768ul*1024) // default hdf size
+
+// hdf geometry as used by UAE for hardfiles: 32 sectors, 1 head and
+// thus 16k per cylinder. Cylinder 0 holds the rigid disk block, the
+// partition covers the rest
+#define SDC_HDF_SECTORS        32
+#define SDC_HDF_HEADS          1
+#define SDC_HDF_CYL_SIZE       (SDC_HDF_SECTORS*SDC_HDF_HEADS*512)
+#define SDC_HDF_MIN_CYL        64             // 1MB min size
+
+static const struct {
+  const char *ext;
+  unsigned long size;
+} sdc_image_formats[] = {
+  { "ST",  737280 },                      // 720k, 80 tracks, 9 sectors, ds
+  { "D64", 174848 },                      // 35 tracks, 683 sectors
+  { "ADF", 901120 },                      // 880k dd
+  { "HDF", SDC_CREATE_HDF_SIZE },
+};
+
+static void sdc_put_be32(unsigned char *p, uint32_t val) {
+  p[0] = val >> 24; p[1] = val >> 16; p[2] = val >> 8; p[3] = val;
+}
+
+// AmigaDOS block checksum: all longwords incl. checksum sum up to 0
+static void sdc_adf_checksum(unsigned char *block, int ofs) {
+  uint32_t sum = 0;
+  sdc_put_be32(block+ofs, 0);
+  for(int i=0;i<512;i+=4)
+    sum += (block[i]<<24) | (block[i+1]<<16) | (block[i+2]<<8) | block[i+3];
+  sdc_put_be32(block+ofs, -sum);
+}
+
+static FRESULT sdc_image_put(FIL *file, FSIZE_t ofs, const void *data, UINT len) {
+  UINT bw;
+  
+  sdc_lock();
+  FRESULT res = f_lseek(file, ofs);
+  if(res == FR_OK) res = f_write(file, data, len, &bw);
+  if(res == FR_OK && bw != len) res = FR_DISK_ERR;
+  sdc_unlock();
+  
+  return res;
+}
+
+// write the structures of an empty file system into the cleared image
+static FRESULT sdc_image_format(FIL *file, int format, unsigned long size, unsigned char *buf) {
+  FRESULT res = FR_OK;
+  
+  memset(buf, 0, 512);
+  switch(format) {
+  case SDC_IMAGE_ST: {
+    // Atari ST boot sector with a FAT12 BPB for a 720k disk
+    static const unsigned char bpb[] = {
+      0x60, 0x38, 'F','P','G','A','C','o', 0x12, 0x34, 0x56,
+      0x00, 0x02,     // 512 bytes per sector
+      2,              // sectors per cluster
+      1, 0,           // reserved sectors
+      2,              // fats
+      112, 0,         // root directory entries
+      0xa0, 0x05,     // 1440 sectors
+      0xf9,           // media
+      3, 0,           // sectors per fat
+      9, 0,           // sectors per track
+      2, 0,           // sides
+      0, 0 };         // hidden sectors
+    memcpy(buf, bpb, sizeof(bpb));
+    res = sdc_image_put(file, 0, buf, 512);
+    
+    // both fats start with the media byte
+    static const unsigned char fat[] = { 0xf9, 0xff, 0xff };
+    if(res == FR_OK) res = sdc_image_put(file, 1*512, fat, sizeof(fat));
+    if(res == FR_OK) res = sdc_image_put(file, 4*512, fat, sizeof(fat));
+  } break;
+      
+  case SDC_IMAGE_D64: {
+    // block availability map in track 18, sector 0
+    buf[0] = 18; buf[1] = 1;      // first directory sector
+    buf[2] = 'A';
+    for(int t=1;t<=35;t++) {
+      int spt = (t<=17)?21:(t<=24)?19:(t<=30)?18:17;
+      uint32_t map = (1ul<<spt)-1;
+      if(t == 18) map &= ~3;      // bam and directory
+      buf[4*t] = (t == 18)?spt-2:spt;
+      buf[4*t+1] = map; buf[4*t+2] = map >> 8; buf[4*t+3] = map >> 16;
+    }
+    memset(buf+0x90, 0xa0, 0x1b);
+    memcpy(buf+0x90, "EMPTY", 5);
+    memcpy(buf+0xa2, "00", 2);
+    memcpy(buf+0xa5, "2A", 2);
+    res = sdc_image_put(file, 0x16500, buf, 256);
+
+    // empty directory
+    memset(buf, 0, 256);
+    buf[1] = 0xff;
+    if(res == FR_OK) res = sdc_image_put(file, 0x16600, buf, 256);
+  } break;
+	
+  case SDC_IMAGE_ADF: {
+    // OFS boot block, not bootable
+    memcpy(buf, "DOS", 4);
+    sdc_put_be32(buf+8, 880);
+    res = sdc_image_put(file, 0, buf, 512);
+
+    // root block
+    memset(buf, 0, 512);
+    sdc_put_be32(buf+0, 2);           // T_HEADER
+    sdc_put_be32(buf+12, 72);         // hash table size
+    sdc_put_be32(buf+312, 0xffffffff);// bitmap valid
+    sdc_put_be32(buf+316, 881);       // bitmap block
+    buf[432] = 5;
+    memcpy(buf+433, "Empty", 5);
+    sdc_put_be32(buf+508, 1);         // ST_ROOT
+    sdc_adf_checksum(buf, 20);
+    if(res == FR_OK) res = sdc_image_put(file, 880*512, buf, 512);
+
+    // bitmap of blocks 2..1759 with a set bit for each free block
+    memset(buf, 0, 512);
+    for(int b=0;b<1758;b++)
+      if(b+2 != 880 && b+2 != 881)
+	buf[4 + 4*(b/32) + 3 - (b%32)/8] |= 1<<(b%8);
+    sdc_adf_checksum(buf, 0);
+    if(res == FR_OK) res = sdc_image_put(file, 881*512, buf, 512);
+  } break;
+
+  case SDC_IMAGE_HDF: {
+    // rigid disk block with a single unformatted partition DH0 which
+    // can then be formatted from within AmigaOS
+    uint32_t cyls = size / SDC_HDF_CYL_SIZE;
+    memcpy(buf, "RDSK", 4);
+    sdc_put_be32(buf+4, 64);          // summed longs
+    sdc_put_be32(buf+12, 7);          // host id
+    sdc_put_be32(buf+16, 512);        // block size
+    sdc_put_be32(buf+24, 0xffffffff); // no bad block list
+    sdc_put_be32(buf+28, 1);          // partition list
+    for(int i=32;i<64;i+=4)           // no file systems, drive init, reserved
+      sdc_put_be32(buf+i, 0xffffffff);
+    sdc_put_be32(buf+64, cyls);
+    sdc_put_be32(buf+68, SDC_HDF_SECTORS);
+    sdc_put_be32(buf+72, SDC_HDF_HEADS);
+    sdc_put_be32(buf+76, 1);          // interleave
+    sdc_put_be32(buf+80, cyls);       // park, write precomp, reduced write
+    sdc_put_be32(buf+96, cyls);
+    sdc_put_be32(buf+100, cyls);
+    sdc_put_be32(buf+104, 3);         // step rate
+    sdc_put_be32(buf+132, SDC_HDF_SECTORS*SDC_HDF_HEADS-1);  // rdb blocks
+    sdc_put_be32(buf+136, 1);         // first and last usable cylinder
+    sdc_put_be32(buf+140, cyls-1);
+    sdc_put_be32(buf+144, SDC_HDF_SECTORS*SDC_HDF_HEADS);
+    sdc_put_be32(buf+152, 1);         // highest used block
+    memcpy(buf+160, "FPGA    Companion HDF   1.0 ", 28);
+    // the checksum covers the 64 summed longs, the rest is zero
+    sdc_adf_checksum(buf, 8);
+    res = sdc_image_put(file, 0, buf, 512);
+
+    memset(buf, 0, 512);
+    memcpy(buf, "PART", 4);
+    sdc_put_be32(buf+4, 64);
+    sdc_put_be32(buf+12, 7);
+    sdc_put_be32(buf+16, 0xffffffff); // last partition
+    sdc_put_be32(buf+20, 1);          // bootable
+    sdc_put_be32(buf+24, 0xffffffff);
+    sdc_put_be32(buf+28, 0xffffffff);
+    memcpy(buf+36, "\3DH0", 4);       // drive name as BCPL string
+    for(int i=68;i<128;i+=4)
+      sdc_put_be32(buf+i, 0xffffffff);
+    sdc_put_be32(buf+128, 16);        // dos environment vector size
+    sdc_put_be32(buf+132, 128);       // longs per block
+    sdc_put_be32(buf+140, SDC_HDF_HEADS);
+    sdc_put_be32(buf+144, 1);         // sectors per block
+    sdc_put_be32(buf+148, SDC_HDF_SECTORS);
+    sdc_put_be32(buf+152, 2);         // reserved boot blocks
+    sdc_put_be32(buf+164, 1);         // low and high cylinder
+    sdc_put_be32(buf+168, cyls-1);
+    sdc_put_be32(buf+172, 30);        // buffers
+    sdc_put_be32(buf+180, 0x1fe00);   // max transfer
+    sdc_put_be32(buf+184, 0x7ffffffe);// dma mask
+    sdc_put_be32(buf+192, 0x444f5301);// DOS\1 (FFS)
+    sdc_adf_checksum(buf, 8);
+    if(res == FR_OK) res = sdc_image_put(file, 512, buf, 512);
+  } break;
+
+  default:
+    break;
+  }
+  
+  return res;
+}
+
+// create a contiguous blank image in the current directory of a drive
+// and insert it. Size is only used for hard disk images, floppy images
+// have a fixed size
+int sdc_image_create(int drive, int format, unsigned long size, void (*progress)(int)) {
+#if !FF_USE_EXPAND
+  sdc_debugf("DRV %d: Image creation requires FF_USE_EXPAND", drive);
+  return -1;
+#else
+  if(drive < 0 || drive >= MAX_DRIVES || format < 0 || format > SDC_IMAGE_HDF)
+    return -1;
+
+  if(format != SDC_IMAGE_HDF || !size)
+    size = sdc_image_formats[format].size;
+
+  // hard disk images consist of full cylinders
+  if(format == SDC_IMAGE_HDF) {
+    size -= size % SDC_HDF_CYL_SIZE;
+    if(size < SDC_HDF_MIN_CYL * SDC_HDF_CYL_SIZE) {
+      sdc_debugf("DRV %d: Image size too small", drive);
+      return -1;
+    }
+  }
+
+  // find an unused name
+  char name[16];
+  char fname[strlen(cwd[drive]) + sizeof(name) + 1];
+  FILINFO fno;
+  FRESULT res = FR_EXIST;
+  for(int i=0;i<1000 && res != FR_NO_FILE;i++) {
+    sprintf(name, "NEW%03d.%s", i, sdc_image_formats[format].ext);
+    sprintf(fname, "%s/%s", cwd[drive], name);
+    sdc_lock();
+    res = f_stat(fname, &fno);
+    sdc_unlock();
+  }
+  if(res != FR_NO_FILE) return -1;
+
+  sdc_debugf("DRV %d: Creating %s with %lu bytes", drive, fname, size);
+
+  FIL file;
+  bool open = false;
+  unsigned char *buffer = NULL;
+  
+  sdc_lock();
+  res = f_open(&file, fname, FA_WRITE | FA_CREATE_NEW);
+  if(res == FR_OK) {
+    open = true;
+    res = f_expand(&file, size, 1);
+    if(res != FR_OK) sdc_debugf("DRV %d: No contiguous space for image", drive);
+  }
+  if(res == FR_OK) {
+    buffer = calloc(1, SDC_CREATE_CHUNK);
+    if(!buffer) res = FR_NOT_ENOUGH_CORE;
+  }
+  sdc_unlock();
+  
+  // f_expand doesn't clear the allocated space. Floppy images are
+  // cleared entirely, hard disk images only where partition tables
+  // are searched and where the partition's boot blocks are
+  unsigned long clear = (format == SDC_IMAGE_HDF)?SDC_CREATE_HDF_CLEAR:size;
+  unsigned long done = 0;
+  int percent = -1;
+  while(res == FR_OK && done < clear) {
+    UINT len = (clear - done > SDC_CREATE_CHUNK)?SDC_CREATE_CHUNK:clear - done;
+    res = sdc_image_put(&file, done, buffer, len);
+    done += len;
+
+    if(progress && percent != (int)(100ull * done / clear))
+      progress(percent = 100ull * done / clear);
+  }
+
+  if(res == FR_OK) res = sdc_image_format(&file, format, size, buffer);
+  if(buffer) free(buffer);
+  
+  sdc_lock();
+  if(open && f_close(&file) != FR_OK && res == FR_OK) res = FR_DISK_ERR;
+  if(open && res != FR_OK) f_unlink(fname);
+  sdc_unlock();
+  
+  if(res != FR_OK) {
+    sdc_debugf("DRV %d: Image creation failed: %d", drive, res);
+    return -1;
+  }
+
+  // insert new image which can be mapped directly as it's contiguous
+  return sdc_image_open(drive, name);
+#endif
+}
+
 sdc_dir_t *sdc_readdir(int drive, char *name, const char *ext) {
-  static sdc_dir_t sdc_dir = { 0, NULL };
+  static sdc_dir_t sdc_dir = { 0, NULL, 0 };
 
   int dir_compare(const void *p1, const void *p2) {
     sdc_dir_entry_t *d1 = (sdc_dir_entry_t *)p1;
@@ -539,6 +1554,8 @@ sdc_dir_t *sdc_readdir(int drive, char *name, const char *ext) {
     dir->files[dir->len].name = strdup(fno->fname);
     dir->files[dir->len].len = fno->fsize;
     dir->files[dir->len].is_dir = (fno->fattrib & AM_DIR)?1:0;
+    dir->files[dir->len].width = -1;
+    dir->files[dir->len].frag = -2;
     dir->len++;
   }
   
@@ -610,6 +1627,8 @@ sdc_dir_t *sdc_readdir(int drive, char *name, const char *ext) {
     sdc_dir.files = NULL;
   }
 
+  sdc_dir.drive = drive;
+
   // add "<UP>" entry for anything but root
   if(strcmp(cwd[drive], CARD_MOUNTPOINT) != 0) {
     strcpy(fno.fname, "..");
@@ -662,6 +1681,7 @@ int sdc_init(void) {
     for(int d=0;d<MAX_DRIVES;d++) {
       cwd[d] = strdup(CARD_MOUNTPOINT);
       image_name[d] = NULL;
+      image_dir[d] = NULL;
     }
     sdc_debugf("SD card is ready");
   }
@@ -694,9 +1714,12 @@ void sdc_mount_defaults(void) {
 // use a locking mechanism to make sure the file system isn't modified
 // by two threads at the same time
 void sdc_lock(void) {
+  trace_event(TRACE_SDC_LOCK, 0);
   xSemaphoreTake(sdc_sem, 0xffffffffUL); // wait forever
+  trace_event(TRACE_SDC_LOCKED, 0);
 }
 
 void sdc_unlock(void) {
+  trace_event(TRACE_SDC_UNLOCK, 0);
   xSemaphoreGive(sdc_sem);
 }
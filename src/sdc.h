@@ -16,15 +16,27 @@ typedef struct {
   char *name;
   unsigned long len;
   int is_dir;
+  int width, fit;    // cached by the menu, -1 if not yet measured
+  int frag;          // image fragmented, checked by the menu, -2 if not yet checked
 } sdc_dir_entry_t;
 
 typedef struct {
   int len;
   sdc_dir_entry_t *files;
+  int drive;
 } sdc_dir_t;
 
+// formats of blank images created by sdc_image_create()
+#define SDC_IMAGE_ST    0
+#define SDC_IMAGE_D64   1
+#define SDC_IMAGE_ADF   2
+#define SDC_IMAGE_HDF   3
+
 int sdc_init(void);
 int sdc_image_open(int drive, char *name);
+int sdc_image_fragmented(int drive, const char *name);
+int sdc_image_defrag(int drive, void (*progress)(int));
+int sdc_image_create(int drive, int format, unsigned long size, void (*progress)(int));
 sdc_dir_t *sdc_readdir(int drive, char *name, const char *exts);
 int sdc_handle_event(void);
 void sdc_lock(void);
@@ -0,0 +1,159 @@
+//
+// spi.c
+//
+// Arbitration of the SPI bus between the MCU's subsystems. Transactions
+// are grouped into priority classes. A transaction has to wait while
+// any transaction of a more important class is waiting for or using
+// the bus. E.g. an SD card request the core is blocked on doesn't have
+// to wait for a queue of OSD updates.
+//
+// The bus itself is still protected by a mutex, so a low priority task
+// owning the bus inherits the priority of a more important task waiting
+// for it.
+//
+
+#include "spi.h"
+#include "mcu_hw.h"
+#include "debug.h"
+#include "trace.h"
+
+#include <stdbool.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <semphr.h>
+#include <task.h>
+#endif
+
+// upper bound for the tasks waiting on one class
+#define SPI_MAX_WAITERS  16
+
+// print wait times every 1000 transactions
+// #define SPI_STATS
+
+static SemaphoreHandle_t spi_bus = NULL;       // owned during a transaction
+static SemaphoreHandle_t spi_lock = NULL;      // protects pending[] and waiting[]
+static SemaphoreHandle_t spi_gate[SPI_PRIO_NUM];
+
+// number of transactions per class waiting for or using the bus
+static int pending[SPI_PRIO_NUM];
+
+// number of tasks per class blocked on the class' gate, a counting
+// semaphore, so none of them misses a wakeup
+static int waiting[SPI_PRIO_NUM];
+
+// class of the current bus owner
+static int owner_prio;
+
+uint8_t spi_crc_targets = 0;
+
+#ifdef SPI_STATS
+static const char *prio_name[SPI_PRIO_NUM] = { "SDC", "AUDIO", "HID", "SYS", "OSD" };
+
+static struct {
+  unsigned long count;
+  unsigned long wait;        // sum of wait times in ticks
+  unsigned long wait_max;
+} stats[SPI_PRIO_NUM];
+
+static unsigned long stats_total = 0;
+#endif
+
+void spi_arbiter_init(void) {
+  spi_bus = xSemaphoreCreateMutex();
+  spi_lock = xSemaphoreCreateMutex();
+  for(int i=0;i<SPI_PRIO_NUM;i++) {
+    spi_gate[i] = xSemaphoreCreateCounting(SPI_MAX_WAITERS, 0);
+    pending[i] = 0;
+    waiting[i] = 0;
+  }
+}
+
+void spi_begin(int prio) {
+#ifdef SPI_STATS
+  TickType_t start = xTaskGetTickCount();
+#endif
+  trace_event(TRACE_SPI_WAIT, prio);
+
+  for(;;) {
+    // check if any more important transaction is pending
+    bool blocked = false;
+    xSemaphoreTake(spi_lock, portMAX_DELAY);
+    for(int i=0;i<prio;i++)
+      if(pending[i]) blocked = true;
+
+    if(!blocked) pending[prio]++;
+    else         waiting[prio]++;
+    xSemaphoreGive(spi_lock);
+
+    if(!blocked) break;
+
+    // wait for the end of the next transaction and check again
+    xSemaphoreTake(spi_gate[prio], portMAX_DELAY);
+  }
+
+  xSemaphoreTake(spi_bus, portMAX_DELAY);
+  owner_prio = prio;
+  trace_event(TRACE_SPI_BEGIN, prio);
+
+#ifdef SPI_STATS
+  TickType_t wait = xTaskGetTickCount() - start;
+  stats[prio].count++;
+  stats[prio].wait += wait;
+  if(wait > stats[prio].wait_max) stats[prio].wait_max = wait;
+#endif
+
+  mcu_hw_spi_begin();
+}
+
+void spi_end(void) {
+  int prio = owner_prio;
+
+  trace_event(TRACE_SPI_END, prio);
+  mcu_hw_spi_end();
+  xSemaphoreGive(spi_bus);
+
+  // let every blocked task check again if it may now proceed, also
+  // those of the own class
+  xSemaphoreTake(spi_lock, portMAX_DELAY);
+  pending[prio]--;
+  for(int i=0;i<SPI_PRIO_NUM;i++) {
+    while(waiting[i]) {
+      xSemaphoreGive(spi_gate[i]);
+      waiting[i]--;
+    }
+  }
+  xSemaphoreGive(spi_lock);
+
+#ifdef SPI_STATS
+  if(!(++stats_total % 1000)) {
+    for(int i=0;i<SPI_PRIO_NUM;i++)
+      if(stats[i].count)
+	debugf("SPI %s: %lu transactions, avg wait %lu.%02lu ticks, max %lu",
+	       prio_name[i], stats[i].count, (100*stats[i].wait/stats[i].count)/100,
+	       (100*stats[i].wait/stats[i].count)%100, stats[i].wait_max);
+  }
+#endif
+}
+
+// change the bus clock between two transactions
+int spi_set_clock(int hz) {
+  xSemaphoreTake(spi_bus, portMAX_DELAY);
+  hz = mcu_hw_spi_set_clock(hz);
+  xSemaphoreGive(spi_bus);
+  return hz;
+}
+
+// CRC16-CCITT (polynomial 0x1021, msb first) as used for protected
+// transfers. Computed bitwise as it's only fed with bytes that
+// are transferred one by one anyway
+uint16_t spi_crc16(uint16_t crc, uint8_t byte) {
+  crc ^= byte << 8;
+  for(int i=0;i<8;i++)
+    crc = (crc & 0x8000)?((crc << 1) ^ 0x1021):(crc << 1);
+  return crc;
+}
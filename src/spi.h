@@ -1,6 +1,8 @@
 #ifndef SPI_H
 #define SPI_H
 
+#include <stdint.h>
+
 #ifndef ESP_PLATFORM
 #include <FreeRTOS.h>
 #include <semphr.h>
@@ -18,6 +20,8 @@
 #define SPI_SYS_IRQ_SRC   6
 #define SPI_SYS_PORT      7
 #define SPI_SYS_READ_CFG  8
+#define SPI_SYS_ECHO      9   // link test, data is echoed one byte late
+#define SPI_SYS_CRC      10   // negotiate CRC protected transfers
 
 // port subcommands
 #define SPI_SYS_PORT_STATUS 0
@@ -30,10 +34,21 @@
 #define SPI_HID_MOUSE     2
 #define SPI_HID_JOYSTICK  3
 #define SPI_HID_GET_DB9   4
+#define SPI_HID_KEYBOARD_MULTI 5   // multiple keyboard events in one message
+
+// feature bits returned in the third SPI_HID_STATUS byte
+#define SPI_HID_FEATURE_KBD_MULTI  0x01
 
 #define SPI_TARGET_OSD    2   // on-screen-display
+#define SPI_OSD_STATUS    0   // get optional OSD capabilities
 #define SPI_OSD_ENABLE    1
 #define SPI_OSD_WRITE     2
+#define SPI_OSD_LINE      3   // write into the wide scroll line buffer
+#define SPI_OSD_SCROLL    4   // set hardware scroll window
+#define SPI_OSD_WRITE_XY  5   // write with separate tile column and row
+
+// capability bits returned by SPI_OSD_STATUS
+#define SPI_OSD_CAP_SCROLL  0x01
 
 #define SPI_TARGET_SDC    3   // sd card
 #define SPI_SDC_STATUS    1   // get sd card status
@@ -43,11 +58,51 @@
 #define SPI_SDC_MCU_WRITE 5   // write sector from MCU
 #define SPI_SDC_DIRECT    6   // inform core that disk image may direclty be accessed
 #define SPI_SDC_INS_LARGE 7   // inform core that some large disk image > 4GB has been insered
+#define SPI_SDC_SELECT    8   // select drive whose request is reported by status
+
+// returned while waiting for a request with damaged CRC to complete
+#define SPI_SDC_CRC_ERROR 0x40
 
 #define SPI_TARGET_AUDIO  4   // audio (e.g. to play fake floppy sounds)
 #define SPI_AUDIO_ENABLE  1
 #define SPI_AUDIO_BUFFER  2   // return audio buffer usage
 #define SPI_AUDIO_WRITE   3
+
+#define SPI_TARGET_MEM    5   // core memory, e.g. to upload ROMs
+#define SPI_MEM_STATUS    1   // get supported features
+#define SPI_MEM_WRITE     2   // write data into core memory
+#define SPI_MEM_READ      3   // read data from core memory
+#define SPI_MEM_STATE     4   // freeze/resume core, get state regions
+
+// capability bits returned by SPI_MEM_STATUS
+#define SPI_MEM_CAP_WRITE 0x01
+#define SPI_MEM_CAP_STATE 0x02   // read and state supported
+
+// priority classes for the bus arbitration in spi.c, most important first
+#define SPI_PRIO_SDC      0   // sd card requests the core may be waiting for
+#define SPI_PRIO_AUDIO    1   // audio data the core's buffer is waiting for
+#define SPI_PRIO_HID      2   // keyboard, mouse and joystick events
+#define SPI_PRIO_SYS      3   // system control and io port traffic
+#define SPI_PRIO_OSD      4   // on-screen-display updates
+#define SPI_PRIO_NUM      5
+
+// longer non-SDC transfers are split into several transactions, so
+// more important ones can get in between
+#define SPI_MAX_TRANSFER  64
+
+// targets the MCU would like to use CRC protected transfers for
+#define SPI_CRC_TARGETS   ((1<<SPI_TARGET_SYS) | (1<<SPI_TARGET_SDC))
+#define SPI_CRC_INIT      0xffff
+
+// targets the core has agreed to use CRCs for
+extern uint8_t spi_crc_targets;
+
+uint16_t spi_crc16(uint16_t crc, uint8_t byte);
+
+void spi_arbiter_init(void);
+void spi_begin(int prio);
+void spi_end(void);
+int spi_set_clock(int hz);
   
 // this is still on usb_host.c but should eventially go
 // into a separate hid.c
@@ -11,6 +11,9 @@
 #include "sysctrl.h"
 #include "sdc.h"
 #include "osd.h"
+#include "menu.h"
+#include "audio.h"
+#include "coremem.h"
 #include "inifile.h"
 #include "core.h"
 
@@ -42,7 +45,7 @@ const char *sys_get_config_name(void) {
 }
 
 static void sys_begin(unsigned char cmd) {
-  mcu_hw_spi_begin();  
+  spi_begin(SPI_PRIO_SYS);  
   mcu_hw_spi_tx_u08(SPI_TARGET_SYS);
   mcu_hw_spi_tx_u08(cmd);
 }  
@@ -54,7 +57,7 @@ int sys_status_is_valid(void) {
   unsigned char b1 = mcu_hw_spi_tx_u08(0);
   core_id = mcu_hw_spi_tx_u08(0);
   unsigned char coldboot = mcu_hw_spi_tx_u08(0);
-  mcu_hw_spi_end();  
+  spi_end();  
 
   if((b0 == 0x5c) && (b1 == 0x42)) {
     sys_debugf("Core ID: %02x", core_id);
@@ -74,7 +77,7 @@ int sys_status_is_valid(void) {
 void sys_set_leds(char leds) {
   sys_begin(SPI_SYS_LEDS);
   mcu_hw_spi_tx_u08(leds);
-  mcu_hw_spi_end();  
+  spi_end();  
 }
 
 void sys_set_rgb(unsigned long rgb) {
@@ -82,7 +85,7 @@ void sys_set_rgb(unsigned long rgb) {
   mcu_hw_spi_tx_u08((rgb >> 16) & 0xff); // R
   mcu_hw_spi_tx_u08((rgb >> 8) & 0xff);  // G
   mcu_hw_spi_tx_u08(rgb & 0xff);         // B
-  mcu_hw_spi_end();    
+  spi_end();    
 }
 
 unsigned char sys_get_buttons(void) {
@@ -91,7 +94,7 @@ unsigned char sys_get_buttons(void) {
   sys_begin(SPI_SYS_BUTTONS);
   mcu_hw_spi_tx_u08(0x00);
   btns = mcu_hw_spi_tx_u08(0);
-  mcu_hw_spi_end();
+  spi_end();
 
   return btns;
 }
@@ -102,14 +105,14 @@ void sys_set_val(char id, uint8_t value) {
   sys_begin(SPI_SYS_SETVAL);   // send value command
   mcu_hw_spi_tx_u08(id);              // value id
   mcu_hw_spi_tx_u08(value);           // value itself
-  mcu_hw_spi_end();  
+  spi_end();  
 }
 
 unsigned char sys_irq_ctrl(unsigned char ack) {
   sys_begin(SPI_SYS_IRQ_CTRL);
   mcu_hw_spi_tx_u08(ack);
   unsigned char ret = mcu_hw_spi_tx_u08(0);
-  mcu_hw_spi_end();  
+  spi_end();  
   return ret;
 }
 
@@ -127,7 +130,7 @@ static uint8_t sys_port_tx_free(unsigned char port) {
   uint8_t type = mcu_hw_spi_tx_u08(0);
   mcu_hw_spi_tx_u08(0);  // skip rx_available
   uint8_t tx_available = mcu_hw_spi_tx_u08(0);  
-  mcu_hw_spi_end();
+  spi_end();
 
   // return false if there's no such port
   if(!ports || type != 0)
@@ -150,13 +153,14 @@ void sys_port_write(unsigned char port, const unsigned char *ptr, int len) {
 
     // don't send more bytes than still left to be sent
     if(bytes2send > len) bytes2send = len;
+    if(bytes2send > SPI_MAX_TRANSFER) bytes2send = SPI_MAX_TRANSFER;
     
     // send as many bytes as space in buffer
     sys_port_begin(SPI_SYS_PORT_PUT); // port command: send byte(s)
     mcu_hw_spi_tx_u08(port);
     for(int i=0;i<bytes2send;i++)
       mcu_hw_spi_tx_u08(*ptr++);
-    mcu_hw_spi_end();
+    spi_end();
 
     len -= bytes2send;
   }
@@ -183,7 +187,7 @@ bool sys_port_get_status(unsigned char port) {
     for(int i=0;i<4;i++) *ptr++ = mcu_hw_spi_tx_u08(0);    
   }
 
-  mcu_hw_spi_end();
+  spi_end();
 
   debugf("Number of ports: %d", ports);
 
@@ -213,7 +217,7 @@ static uint8_t sys_port_rx_available(unsigned char port) {
   uint8_t type = mcu_hw_spi_tx_u08(0);
   uint8_t rx_available = mcu_hw_spi_tx_u08(0);
   
-  mcu_hw_spi_end();
+  spi_end();
 
   // return false if there's no such port
   if(!ports || type != 0)
@@ -232,7 +236,7 @@ static int16_t sys_port_get(unsigned char port) {
   mcu_hw_spi_tx_u08(port);
   mcu_hw_spi_tx_u08(1);              // read one byte from fifo
   uint8_t d = mcu_hw_spi_tx_u08(0);  // read last byte without increasing fifo pointer
-  mcu_hw_spi_end();
+  spi_end();
   
   return d;
 }
@@ -247,7 +251,7 @@ static void sys_handle_event(bool ignore_coldboot) {
   sys_begin(SPI_SYS_IRQ_SRC);
   mcu_hw_spi_tx_u08(0);
   unsigned char irq_src = mcu_hw_spi_tx_u08(0);
-  mcu_hw_spi_end();
+  spi_end();
 
   if(irq_src & 2) {
     // read port 0 data for wifi emulation
@@ -295,8 +299,106 @@ void sys_handle_interrupts(unsigned char pending, bool ignore_coldboot) {
   if(pending & 0x08) // irq 3 = SDC
     sdc_handle_event();
   
-  //  if(pending & 0x10) // irq 4 = AUDIO
-  //    audio_handle_event();
+  if(pending & 0x10) // irq 4 = AUDIO
+    audio_handle_event();
+}
+
+// SPI clocks tried during calibration in MHz. The first one is
+// the default all backends start with
+static const uint8_t spi_clocks[] = { 20, 24, 30, 32, 40, 48, 60 };
+#define SPI_CLOCKS  (sizeof(spi_clocks)/sizeof(*spi_clocks))
+
+#define SPI_ECHO_LEN     64
+#define SPI_ECHO_PASSES   8
+
+static int spi_clock_cal = 0;   // calibrated clock in MHz, 0 if not calibrated
+static int spi_clock = 0;       // clock currently used in MHz
+
+// send a few test patterns through the core and verify the echoed
+// data as well as the core's checksum of the received bytes. Cores
+// not implementing SPI_SYS_ECHO return zeros and fail this test
+static bool sys_spi_echo_test(void) {
+  uint8_t lfsr = 0x5a;
+  
+  for(int pass=0;pass<SPI_ECHO_PASSES;pass++) {
+    uint8_t data[SPI_ECHO_LEN], sum = 0;
+    bool ok = true;
+
+    // alternating bits, full byte toggles, a counter and random data
+    for(int i=0;i<SPI_ECHO_LEN;i++) {
+      switch(pass & 3) {
+      case 0:  data[i] = (i&1)?0xaa:0x55; break;
+      case 1:  data[i] = (i&1)?0x00:0xff; break;
+      case 2:  data[i] = i + pass;        break;
+      default: lfsr = (lfsr >> 1) ^ ((lfsr & 1)?0xb8:0x00); data[i] = lfsr; break;
+      }
+      sum += data[i];
+    }
+
+    // the core returns each byte while the next one is being sent and
+    // the 8 bit sum of all bytes it has received after that
+    sys_begin(SPI_SYS_ECHO);
+    mcu_hw_spi_tx_u08(data[0]);
+    for(int i=1;i<SPI_ECHO_LEN;i++)
+      if(mcu_hw_spi_tx_u08(data[i]) != data[i-1]) ok = false;
+    if(mcu_hw_spi_tx_u08(0) != data[SPI_ECHO_LEN-1]) ok = false;
+    if(mcu_hw_spi_tx_u08(0) != sum) ok = false;
+    spi_end();
+
+    if(!ok) return false;
+  }
+  return true;
+}
+
+static void sys_spi_calibrate(void) {
+  // make sure the link works at the default clock at all
+  if(!sys_spi_echo_test()) {
+    sys_debugf("SPI echo not supported by core, keeping %dMHz", spi_clocks[0]);
+    return;
+  }
+
+  // raise the clock until the link fails
+  int best = 0;
+  for(unsigned int i=1;i<SPI_CLOCKS;i++) {
+    int hz = spi_set_clock(1000000*spi_clocks[i]);
+    bool ok = sys_spi_echo_test();
+    sys_debugf("SPI clock %d.%03dMHz %s", hz/1000000, (hz/1000)%1000, ok?"ok":"failed");
+    if(!ok) break;
+    best = i;
+  }
+
+  // keep one step of margin below the fastest working clock
+  if(best) best--;
+
+  spi_clock_cal = spi_clock = spi_clocks[best];
+  int hz = spi_set_clock(1000000*spi_clock_cal);
+  sys_debugf("SPI clock calibrated to %d.%03dMHz", hz/1000000, (hz/1000)%1000);
+
+  // the ini file option is the user's limit and is never changed here
+  sys_set_spi_clock(inifile_option_get(INIFILE_OPTION_SPI_CLOCK));
+}
+
+void sys_set_spi_clock(int mhz) {
+  // the ini file can only lower the clock below the calibrated one
+  if(!spi_clock_cal) return;
+  if(!mhz || mhz > spi_clock_cal) mhz = spi_clock_cal;
+  if(mhz == spi_clock) return;
+
+  spi_clock = mhz;
+  int hz = spi_set_clock(1000000*mhz);
+  sys_debugf("SPI clock set to %d.%03dMHz", hz/1000000, (hz/1000)%1000);
+}
+
+// ask the core to use CRC protected transfers. Cores not implementing
+// this return zero and all transfers stay unprotected
+static void sys_crc_negotiate(void) {
+  sys_begin(SPI_SYS_CRC);
+  mcu_hw_spi_tx_u08(SPI_CRC_TARGETS);
+  spi_crc_targets = mcu_hw_spi_tx_u08(0) & SPI_CRC_TARGETS;
+  spi_end();
+
+  if(spi_crc_targets)
+    sys_debugf("CRC protection enabled for targets %02x", spi_crc_targets);
 }
 
 bool sys_wait4fpga(void) {
@@ -316,6 +418,12 @@ bool sys_wait4fpga(void) {
   if(timeout) {
     sys_debugf("FPGA ready after %dms!", (500-timeout)*10);
 
+    // protect sd card and config transfers if the core supports it
+    sys_crc_negotiate();
+    
+    // find the fastest SPI clock the link reliably works at
+    sys_spi_calibrate();
+
     // core_id is set now, so handle the legacy cores. The
     // new config driven cores will (hopefully) handle this
     // in the init action
@@ -375,6 +483,43 @@ void sys_run_action(config_action_t *action) {
       sys_debugf("LINK");
       sys_run_action(action->commands[i].action);
       break;
+
+    case CONFIG_ACTION_COMMAND_DEFRAG:
+      sys_debugf("DEFRAG(%d)", action->commands[i].image.drive);
+      sdc_image_defrag(action->commands[i].image.drive, menu_progress);
+      break;
+
+    case CONFIG_ACTION_COMMAND_NEWIMAGE:
+      sys_debugf("NEWIMAGE(%d,%d)", action->commands[i].image.drive,
+		 action->commands[i].image.format);
+      sdc_image_create(action->commands[i].image.drive, action->commands[i].image.format,
+		       1024ul * action->commands[i].image.size, menu_progress);
+      break;
+
+    case CONFIG_ACTION_COMMAND_UPLOAD:
+      sys_debugf("UPLOAD %s", action->commands[i].mem.filename);
+      coremem_upload(action->commands[i].mem.filename, action->commands[i].mem.address);
+      break;
+
+    case CONFIG_ACTION_COMMAND_SNAPSHOT:
+      sys_debugf("SNAPSHOT %s", action->commands[i].mem.filename);
+      coremem_snapshot(action->commands[i].mem.filename);
+      break;
+
+    case CONFIG_ACTION_COMMAND_RESTORE:
+      sys_debugf("RESTORE %s", action->commands[i].mem.filename);
+      coremem_restore(action->commands[i].mem.filename);
+      break;
+
+    case CONFIG_ACTION_COMMAND_PLAY:
+      sys_debugf("PLAY %s", action->commands[i].filename);
+      audio_play_wav(action->commands[i].filename);
+      break;
+
+    case CONFIG_ACTION_COMMAND_STOP:
+      sys_debugf("STOP");
+      audio_stop();
+      break;
     }
   }
 }
@@ -390,7 +535,18 @@ static unsigned char puff_get_byte(void) {
   return mcu_hw_spi_tx_u08(0);
 }
 
-char *sys_get_config(void) {
+// CRC32 as used by gzip to verify the uncompressed config
+static uint32_t sys_crc32(const unsigned char *data, unsigned long len) {
+  uint32_t crc = 0xffffffff;
+  while(len--) {
+    crc ^= *data++;
+    for(int i=0;i<8;i++)
+      crc = (crc >> 1) ^ ((crc & 1)?0xedb88320:0);
+  }
+  return ~crc;
+}
+
+static char *sys_read_config(bool *ok) {
   char *ret = NULL;
   // (try to) read xml directly from core
 
@@ -410,7 +566,7 @@ char *sys_get_config(void) {
     for(len=0;len < 8191 && c;len++)
       c = mcu_hw_spi_tx_u08(0);
 
-    mcu_hw_spi_end();  
+    spi_end();  
 
     sys_debugf("core xml config size: %d", len);
     if(len < 100) return NULL;
@@ -423,10 +579,23 @@ char *sys_get_config(void) {
     mcu_hw_spi_tx_u08(0);
     
     unsigned int i;
-    for(i=0;i<len;i++) ret[i] = mcu_hw_spi_tx_u08(0);
+    uint16_t crc = SPI_CRC_INIT;
+    for(i=0;i<len;i++) {
+      ret[i] = mcu_hw_spi_tx_u08(0);
+      crc = spi_crc16(crc, ret[i]);
+    }
     ret[i] = '\0';
+
+    // with CRC enabled the terminating zero byte is followed by
+    // a CRC16 over the entire string including the zero byte
+    if(spi_crc_targets & (1<<SPI_TARGET_SYS)) {
+      crc = spi_crc16(crc, mcu_hw_spi_tx_u08(0));
+      uint16_t rx = mcu_hw_spi_tx_u08(0) << 8;
+      rx |= mcu_hw_spi_tx_u08(0);
+      *ok = (rx == crc);
+    }
     
-    mcu_hw_spi_end();
+    spi_end();
 
     return ret;
   }
@@ -441,7 +610,7 @@ char *sys_get_config(void) {
     // is "filename"
     if((id1 != 0x8b)||(method != 8)||(flags & ~8)) {
       sys_debugf("Unexpected GZIP header %02x/%02x/%02x", id1, method, flags);
-      mcu_hw_spi_end();
+      spi_end();
       return NULL;
     }
 
@@ -454,7 +623,7 @@ char *sys_get_config(void) {
     // first run to determine uncompressed size
     unsigned long dstlen = 0, srclen = 65536;
     int ret = puff(NULL, &dstlen, puff_get_byte, &srclen);
-    mcu_hw_spi_end();
+    spi_end();
 
     if(ret) {
       sys_debugf("Config gzip puff failed");
@@ -474,10 +643,18 @@ char *sys_get_config(void) {
     // and again, skip filename if present
     if(flags & 8) while(mcu_hw_spi_tx_u08(0));
     
-    // first run to determine uncompressed size
+    // second run to actually uncompress
     srclen = 65536;
     ret = puff(dst, &dstlen, puff_get_byte, &srclen);
-    mcu_hw_spi_end();
+
+    // the deflate stream is followed by the gzip trailer with
+    // the CRC32 and the size of the uncompressed data
+    uint32_t trailer[2] = { 0, 0 };
+    for(int i=0;i<8;i++)
+      trailer[i/4] |= (uint32_t)mcu_hw_spi_tx_u08(0) << (8*(i&3));
+    spi_end();
+
+    *ok = !ret && (trailer[0] == sys_crc32(dst, dstlen)) && (trailer[1] == dstlen);
 
     // terminate the config string
     dst[dstlen-1] = '\0';
@@ -487,3 +664,20 @@ char *sys_get_config(void) {
   
   return NULL;
 }
+
+#define SYS_CONFIG_RETRIES  3
+
+char *sys_get_config(void) {
+  static unsigned long crc_errors = 0;
+  
+  for(int retry=0;retry<=SYS_CONFIG_RETRIES;retry++) {
+    bool ok = true;
+    char *cfg = sys_read_config(&ok);
+    if(ok) return cfg;
+
+    // the config has been damaged during transfer
+    if(cfg) free(cfg);
+    sys_debugf("Config CRC error (%lu total)", ++crc_errors);
+  }
+  return NULL;
+}
@@ -48,6 +48,7 @@ void sys_set_val(char, uint8_t);
 unsigned char sys_irq_ctrl(unsigned char);
 void sys_handle_interrupts(unsigned char, bool);
 bool sys_wait4fpga(void);
+void sys_set_spi_clock(int);
 char *sys_get_config(void);
 
 void sys_run_action(config_action_t *);
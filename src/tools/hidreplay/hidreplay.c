@@ -0,0 +1,550 @@
+//
+// hidreplay.c
+//
+// Replay HID traces recorded with HID_TRACE enabled in hid.c on the
+// host. Descriptors and reports are fed through the unmodified hid.c
+// and hidparser.c and the SPI messages they generate are compared
+// against the ones recorded on the device. Usage:
+//
+//   hidreplay [-p] [-b <runs>] capture.hidt
+//
+// -p prints the SPI messages generated on the host in trace format,
+// e.g. to add them to a capture. -b replays the capture the given
+// number of times and reports the time spent per report.
+//
+// Besides the HIDT lines a capture may contain lines of the form
+//   option <id> <value>
+// to replace the defaults of the inifile options (see inifile.h)
+// the capture was recorded with.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <setjmp.h>
+
+#include "hid.h"
+#include "spi.h"
+#include "osd.h"
+#include "menu.h"
+#include "inifile.h"
+#include "sysctrl.h"
+#include "mcu_hw.h"
+
+#define MAX_DEVICES   16     // interfaces and xinput pads in one capture
+#define MAX_TIMERS     4
+#define MAX_TASKS      4
+#define MAX_SPI_MSG   64     // bytes per SPI message
+#define MAX_LINE    4096
+
+// ------------------------- FreeRTOS replacement --------------------------
+
+static TickType_t now = 0;
+
+TickType_t xTaskGetTickCount(void) {
+  return now;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  static int dummy;
+  return &dummy;
+}
+
+BaseType_t xSemaphoreTake(__attribute__((unused)) SemaphoreHandle_t sem,
+			  __attribute__((unused)) TickType_t ticks) {
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(__attribute__((unused)) SemaphoreHandle_t sem) {
+  return pdTRUE;
+}
+
+// A task runs right when it has been notified. Once it waits again
+// without pending notification it is left via longjmp() and restarted
+// from its beginning next time. So only tasks not keeping any state
+// across their wait loop are supported
+struct host_task_S {
+  TaskFunction_t code;
+  void *parms;
+  uint32_t notified;
+};
+
+static struct host_task_S tasks[MAX_TASKS];
+static int task_count = 0;
+static struct host_task_S *task_current = NULL;
+static jmp_buf task_wait;
+
+BaseType_t xTaskCreate(TaskFunction_t code, __attribute__((unused)) const char *name,
+		       __attribute__((unused)) uint32_t stack, void *parms,
+		       __attribute__((unused)) UBaseType_t prio, TaskHandle_t *handle) {
+  if(task_count == MAX_TASKS) {
+    fprintf(stderr, "Out of tasks\n");
+    exit(1);
+  }
+
+  tasks[task_count].code = code;
+  tasks[task_count].parms = parms;
+  tasks[task_count].notified = 0;
+  if(handle) *handle = &tasks[task_count];
+  task_count++;
+  return pdPASS;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  task->notified++;
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, __attribute__((unused)) TickType_t ticks) {
+  if(!task_current || !task_current->notified)
+    longjmp(task_wait, 1);
+
+  uint32_t value = task_current->notified;
+  task_current->notified = clear?0:value-1;
+  return value;
+}
+
+static void tasks_run(void) {
+  for(int i=0;i<task_count;i++) {
+    while(tasks[i].notified) {
+      task_current = &tasks[i];
+      if(!setjmp(task_wait))
+	tasks[i].code(tasks[i].parms);
+      task_current = NULL;
+    }
+  }
+}
+
+struct host_timer_S {
+  TimerCallbackFunction_t callback;
+  bool active;
+  TickType_t expiry;
+};
+
+static struct host_timer_S timers[MAX_TIMERS];
+static int timer_count = 0;
+
+TimerHandle_t xTimerCreate(__attribute__((unused)) const char *name,
+			   __attribute__((unused)) TickType_t period,
+			   __attribute__((unused)) UBaseType_t reload,
+			   __attribute__((unused)) void *id,
+			   TimerCallbackFunction_t callback) {
+  if(timer_count == MAX_TIMERS) {
+    fprintf(stderr, "Out of timers\n");
+    exit(1);
+  }
+
+  timers[timer_count].callback = callback;
+  timers[timer_count].active = false;
+  return &timers[timer_count++];
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+  return timer->active;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period,
+			      __attribute__((unused)) TickType_t ticks) {
+  timer->active = true;
+  timer->expiry = now + period;
+  return pdPASS;
+}
+
+// fire all timers expiring up to the given tick in order
+static void timers_run(TickType_t until, bool all) {
+  for(;;) {
+    struct host_timer_S *next = NULL;
+    for(int i=0;i<timer_count;i++)
+      if(timers[i].active && (all || (int32_t)(timers[i].expiry - until) <= 0) &&
+	 (!next || (int32_t)(timers[i].expiry - next->expiry) < 0))
+	next = &timers[i];
+
+    if(!next) break;
+
+    now = next->expiry;
+    next->active = false;
+    next->callback(next);
+    tasks_run();
+  }
+
+  if(!all) now = until;
+}
+
+// ----------------------- recording SPI backend ---------------------------
+
+// features byte returned for SPI_HID_STATUS
+static uint8_t hid_features = 0;
+
+static struct {
+  uint8_t data[MAX_SPI_MSG];
+  int len;
+} spi_msg;
+
+typedef struct {
+  uint8_t len;
+  uint8_t data[MAX_SPI_MSG];
+} message_t;
+
+static message_t *recorded = NULL;
+static int recorded_count = 0, recorded_size = 0;
+
+static void message_add(message_t **list, int *count, int *size, const uint8_t *data, int len) {
+  if(*count == *size) {
+    *size = *size?2 * *size:256;
+    *list = realloc(*list, *size * sizeof(message_t));
+    if(!*list) { fprintf(stderr, "Out of memory\n"); exit(1); }
+  }
+
+  (*list)[*count].len = len;
+  memcpy((*list)[*count].data, data, len);
+  (*count)++;
+}
+
+void spi_begin(__attribute__((unused)) int prio) {
+  spi_msg.len = 0;
+}
+
+unsigned char mcu_hw_spi_tx_u08(unsigned char b) {
+  if(spi_msg.len == MAX_SPI_MSG) {
+    fprintf(stderr, "SPI message exceeds %d bytes\n", MAX_SPI_MSG);
+    exit(1);
+  }
+  spi_msg.data[spi_msg.len++] = b;
+
+  // the sixth byte of the status request returns the core's features
+  if(spi_msg.len == 6 && spi_msg.data[0] == SPI_TARGET_HID && spi_msg.data[1] == SPI_HID_STATUS)
+    return hid_features;
+
+  return 0;
+}
+
+void spi_end(void) {
+  message_add(&recorded, &recorded_count, &recorded_size, spi_msg.data, spi_msg.len);
+}
+
+// ------------------------- firmware replacement --------------------------
+
+unsigned char core_id = 0;
+static bool osd_visible = false;
+// same defaults as inifile.c, a capture may override them
+static int options[INIFILE_OPTION_FLOPPY_SOUND+1] = { 0x45, 0, 0, 0, 0 };
+
+int osd_is_visible(void) {
+  return osd_visible;
+}
+
+void menu_notify(unsigned long msg) {
+  // only track what kbd_parse needs to know
+  if(msg == MENU_EVENT_SHOW) osd_visible = true;
+  if(msg == MENU_EVENT_HIDE || msg == MENU_EVENT_BACK) osd_visible = false;
+}
+
+int inifile_option_get(int id) {
+  return options[id];
+}
+
+void sdc_set_default(__attribute__((unused)) int drive, __attribute__((unused)) const char *name) { }
+
+// -------------------------------- replay ---------------------------------
+
+typedef struct {
+  TickType_t tick;
+  char tag;
+  int device;
+  uint16_t len;
+  uint8_t *data;
+} event_t;
+
+static event_t *events = NULL;
+static int event_count = 0, event_size = 0;
+static int report_count = 0;
+
+static message_t *expected = NULL;
+static int expected_count = 0, expected_size = 0;
+
+static struct {
+  char token[32];
+  bool is_pad;
+  bool in_use;
+  union {
+    hid_iface_t iface;
+    struct hid_xinput_state_S pad;
+  };
+} devices[MAX_DEVICES];
+static int device_count = 0;
+
+// devices are identified by the address printed on the device. These
+// may be reused once a device has been removed
+static int device_lookup(const char *token) {
+  for(int i=0;i<device_count;i++)
+    if(!strcmp(devices[i].token, token))
+      return i;
+
+  if(device_count == MAX_DEVICES) {
+    fprintf(stderr, "Too many devices\n");
+    exit(1);
+  }
+
+  snprintf(devices[device_count].token, sizeof(devices[device_count].token), "%s", token);
+  return device_count++;
+}
+
+// the status request is sent when hid_init() runs and the DB9 request
+// on core interrupts. Both don't depend on the HID input
+static bool message_relevant(const uint8_t *data, int len) {
+  return !(len >= 2 && data[0] == SPI_TARGET_HID &&
+	   (data[1] == SPI_HID_STATUS || data[1] == SPI_HID_GET_DB9));
+}
+
+static int parse_hex(char **p, uint8_t *data, int max) {
+  int len = 0;
+  char *end;
+  for(;;) {
+    unsigned long v = strtoul(*p, &end, 16);
+    if(end == *p) break;
+    if(len == max) {
+      fprintf(stderr, "Trace line too long\n");
+      exit(1);
+    }
+    data[len++] = v;
+    *p = end;
+  }
+  return len;
+}
+
+static bool load(const char *name) {
+  FILE *file = fopen(name, "r");
+  if(!file) {
+    perror(name);
+    return false;
+  }
+
+  static char line[MAX_LINE];
+  static uint8_t data[MAX_LINE/3];
+  int lineno = 0;
+
+  while(fgets(line, sizeof(line), file)) {
+    lineno++;
+
+    int id, value;
+    if(sscanf(line, "option %d %d", &id, &value) == 2) {
+      if(id < 0 || id > INIFILE_OPTION_FLOPPY_SOUND) {
+	fprintf(stderr, "%s:%d: unknown option %d\n", name, lineno, id);
+	return false;
+      }
+      options[id] = value;
+      continue;
+    }
+
+    // lines may be preceeded by other debug output
+    char *p = strstr(line, "HIDT ");
+    if(!p) continue;
+
+    unsigned long tick;
+    char tag;
+    int n;
+    if(sscanf(p, "HIDT %lu %c%n", &tick, &tag, &n) != 2) {
+      fprintf(stderr, "%s:%d: malformed line\n", name, lineno);
+      return false;
+    }
+    p += n;
+
+    if(tag == 'S') {
+      int len = parse_hex(&p, data, MAX_SPI_MSG);
+      if(message_relevant(data, len))
+	message_add(&expected, &expected_count, &expected_size, data, len);
+      continue;
+    }
+
+    if(!strchr("FDRPXU", tag)) {
+      fprintf(stderr, "%s:%d: unknown tag %c\n", name, lineno, tag);
+      return false;
+    }
+
+    int device = -1;
+    if(tag != 'F') {
+      char token[32];
+      if(sscanf(p, "%31s%n", token, &n) != 1) {
+	fprintf(stderr, "%s:%d: device missing\n", name, lineno);
+	return false;
+      }
+      p += n;
+      device = device_lookup(token);
+    }
+
+    if(event_count == event_size) {
+      event_size = event_size?2*event_size:256;
+      events = realloc(events, event_size * sizeof(event_t));
+      if(!events) { fprintf(stderr, "Out of memory\n"); exit(1); }
+    }
+
+    event_t *ev = &events[event_count++];
+    ev->tick = tick;
+    ev->tag = tag;
+    ev->device = device;
+    ev->len = parse_hex(&p, data, sizeof(data));
+    ev->data = malloc(ev->len?ev->len:1);
+    memcpy(ev->data, data, ev->len);
+
+    if(tag == 'R' || tag == 'X') report_count++;
+  }
+
+  fclose(file);
+  return true;
+}
+
+static void replay(void) {
+  bool initialized = false;
+
+  recorded_count = 0;
+  timer_count = 0;
+  task_count = 0;
+  osd_visible = false;
+  now = event_count?events[0].tick:0;
+
+  for(int i=0;i<event_count;i++) {
+    event_t *ev = &events[i];
+
+    timers_run(ev->tick, false);
+
+    if(ev->tag == 'F' || !initialized) {
+      hid_features = (ev->tag == 'F' && ev->len)?ev->data[0]:0;
+      hid_init();
+      initialized = true;
+      if(ev->tag == 'F') continue;
+    }
+
+    // reports of devices attached before the capture started are ignored
+    if(ev->tag != 'D' && ev->tag != 'P' && !devices[ev->device].in_use)
+      continue;
+
+    switch(ev->tag) {
+    case 'D':
+      devices[ev->device].in_use = true;
+      devices[ev->device].is_pad = false;
+      hid_iface_init(&devices[ev->device].iface, ev->data, ev->len);
+      break;
+
+    case 'R':
+      hid_parse(&devices[ev->device].iface, ev->data, ev->len);
+      break;
+
+    case 'P':
+      devices[ev->device].in_use = true;
+      devices[ev->device].is_pad = true;
+      xinput_init(&devices[ev->device].pad);
+      break;
+
+    case 'X':
+      if(ev->len == 6)
+	xinput_parse(&devices[ev->device].pad, ev->data[0] | ev->data[1]<<8,
+		     (int16_t)(ev->data[2] | ev->data[3]<<8), (int16_t)(ev->data[4] | ev->data[5]<<8));
+      break;
+
+    case 'U':
+      if(devices[ev->device].is_pad)
+	xinput_release(&devices[ev->device].pad);
+      else
+	hid_iface_release(&devices[ev->device].iface);
+      devices[ev->device].in_use = false;
+      break;
+    }
+  }
+
+  // let pending timers expire and remove everything still attached
+  timers_run(now, true);
+  for(int i=0;i<device_count;i++) {
+    if(devices[i].in_use) {
+      if(devices[i].is_pad) xinput_release(&devices[i].pad);
+      else                  hid_iface_release(&devices[i].iface);
+      devices[i].in_use = false;
+    }
+  }
+}
+
+static void message_print(FILE *file, const char *prefix, const message_t *msg) {
+  fprintf(file, "%s", prefix);
+  for(int i=0;i<msg->len;i++) fprintf(file, " %02x", msg->data[i]);
+  fprintf(file, "\n");
+}
+
+static bool verify(const char *name) {
+  int j = 0;
+  for(int i=0;i<recorded_count;i++) {
+    if(!message_relevant(recorded[i].data, recorded[i].len))
+      continue;
+
+    if(j == expected_count) {
+      fprintf(stderr, "%s: unexpected SPI message #%d\n", name, j);
+      message_print(stderr, "  got:", &recorded[i]);
+      return false;
+    }
+
+    if(recorded[i].len != expected[j].len ||
+       memcmp(recorded[i].data, expected[j].data, expected[j].len)) {
+      fprintf(stderr, "%s: SPI message #%d differs\n", name, j);
+      message_print(stderr, "  expected:", &expected[j]);
+      message_print(stderr, "  got:     ", &recorded[i]);
+      return false;
+    }
+    j++;
+  }
+
+  if(j != expected_count) {
+    fprintf(stderr, "%s: SPI message #%d missing\n", name, j);
+    message_print(stderr, "  expected:", &expected[j]);
+    return false;
+  }
+
+  return true;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: hidreplay [-p] [-b <runs>] capture.hidt\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bool print = false;
+  int runs = 0;
+
+  int i;
+  for(i=1;i<argc && argv[i][0] == '-';i++) {
+    if(!strcmp(argv[i], "-p"))
+      print = true;
+    else if(!strcmp(argv[i], "-b") && i+1 < argc)
+      runs = atoi(argv[++i]);
+    else
+      usage();
+  }
+  if(i != argc-1) usage();
+
+  const char *name = argv[i];
+  if(!load(name)) return 1;
+
+  replay();
+
+  if(print)
+    for(int m=0;m<recorded_count;m++)
+      if(message_relevant(recorded[m].data, recorded[m].len))
+	message_print(stdout, "HIDT 0 S", &recorded[m]);
+
+  if(!verify(name)) return 1;
+
+  printf("%s: %d reports, %d SPI messages OK\n", name, report_count, expected_count);
+
+  if(runs > 0 && report_count > 0) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int r=0;r<runs;r++)
+      replay();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%s: %.1f ns/report (%d runs)\n", name, ns / runs / report_count, runs);
+  }
+
+  return 0;
+}
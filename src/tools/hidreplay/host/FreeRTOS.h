@@ -0,0 +1,21 @@
+// FreeRTOS.h - minimal host replacement for the hid replay harness
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE              0
+#define pdTRUE               1
+#define pdPASS               pdTRUE
+#define portMAX_DELAY        ((TickType_t)0xffffffffUL)
+#define configMAX_PRIORITIES 8
+
+// the harness runs at one tick per millisecond
+#define pdMS_TO_TICKS(ms)    ((TickType_t)(ms))
+
+#endif // FREERTOS_H
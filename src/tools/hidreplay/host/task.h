@@ -0,0 +1,18 @@
+// task.h - host replacement, the tick is driven by the harness and
+// tasks only run when notified
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "FreeRTOS.h"
+
+typedef struct host_task_S *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack,
+		       void *parms, UBaseType_t prio, TaskHandle_t *handle);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+#endif // TASK_H
@@ -0,0 +1,16 @@
+// timers.h - host replacement, timers are fired by the harness
+
+#ifndef TIMERS_H
+#define TIMERS_H
+
+#include "FreeRTOS.h"
+
+typedef struct host_timer_S *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+			   void *id, TimerCallbackFunction_t callback);
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks);
+
+#endif // TIMERS_H
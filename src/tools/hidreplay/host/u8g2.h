@@ -0,0 +1,8 @@
+// u8g2.h - host replacement, only the type osd.h refers to
+
+#ifndef U8G2_H
+#define U8G2_H
+
+typedef struct u8g2_struct u8g2_t;
+
+#endif // U8G2_H
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# trace_decode.py - decode the event trace of the FPGA Companion
+#
+# Firmware built with TRACE defined in trace.h periodically prints lines
+# of the form "TRC:<hex>" to the debug output. Capture that output into
+# a file and run
+#
+#   trace_decode.py capture.log
+#
+# to get latency statistics and histograms of the recorded intervals.
+#
+
+import sys
+import re
+import argparse
+from collections import defaultdict, deque
+
+# event ids from trace.h
+LOST, SPI_WAIT, SPI_BEGIN, SPI_END, SDC_LOCK, SDC_LOCKED, SDC_UNLOCK, \
+IRQ, SDC_REQUEST, SDC_CORE_RW, SDC_DONE, HID_REPORT, HID_SPI, \
+MENU_DRAW, MENU_DRAWN = range(15)
+
+SPI_CLASSES = [ "SDC", "AUDIO", "HID", "SYS", "OSD" ]
+
+def parse(lines):
+    # yield (time, id, arg) for all events found in the log
+    for line in lines:
+        m = re.search(r"TRC:([0-9a-f]+)", line)
+        if not m: continue
+        data = bytes.fromhex(m.group(1))
+        for i in range(0, len(data) - len(data) % 7, 7):
+            time = int.from_bytes(data[i:i+4], "little")
+            yield time, data[i+4], int.from_bytes(data[i+5:i+7], "little")
+
+def delta(start, end):
+    # timestamps are 32 bit microseconds and wrap after ~71 minutes
+    return (end - start) & 0xffffffff
+
+class Interval:
+    def __init__(self):
+        self.samples = []
+
+    def add(self, us):
+        self.samples.append(us)
+
+    def report(self, name):
+        s = self.samples
+        if not s: return
+        print("%s: %d samples, min %d us, avg %.1f us, max %d us" %
+              (name, len(s), min(s), sum(s)/len(s), max(s)))
+
+        # histogram with power of two buckets
+        buckets = defaultdict(int)
+        for v in s: buckets[v.bit_length()] += 1
+        peak = max(buckets.values())
+        for b in range(min(buckets), max(buckets)+1):
+            lo = 0 if b == 0 else 1 << (b-1)
+            bar = "#" * (50 * buckets[b] // peak)
+            print("  %8d us %7d %s" % (lo, buckets[b], bar))
+        print()
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode FPGA Companion event traces")
+    parser.add_argument("log", nargs="?", help="captured debug output (default stdin)")
+    args = parser.parse_args()
+
+    f = open(args.log, errors="ignore") if args.log else sys.stdin
+
+    stats = defaultdict(Interval)
+    spi_wait = defaultdict(deque)
+    spi_begin = None
+    lock_wait = deque()
+    lock_taken = None
+    irq = None
+    core_rw = None
+    hid_report = None
+    menu_draw = None
+    lost = 0
+
+    for time, ev, arg in parse(f):
+        if ev == LOST:
+            lost += arg
+            # intervals spanning lost events are meaningless
+            spi_wait.clear(); lock_wait.clear()
+            spi_begin = lock_taken = irq = core_rw = hid_report = menu_draw = None
+        elif ev == SPI_WAIT:
+            spi_wait[arg].append(time)
+        elif ev == SPI_BEGIN:
+            cls = SPI_CLASSES[arg] if arg < len(SPI_CLASSES) else str(arg)
+            if spi_wait[arg]:
+                stats["SPI wait " + cls].add(delta(spi_wait[arg].popleft(), time))
+            spi_begin = (time, cls)
+        elif ev == SPI_END:
+            if spi_begin:
+                stats["SPI hold " + spi_begin[1]].add(delta(spi_begin[0], time))
+            spi_begin = None
+        elif ev == SDC_LOCK:
+            lock_wait.append(time)
+        elif ev == SDC_LOCKED:
+            if lock_wait:
+                stats["sdc_lock wait"].add(delta(lock_wait.popleft(), time))
+            lock_taken = time
+        elif ev == SDC_UNLOCK:
+            if lock_taken is not None:
+                stats["sdc_lock hold"].add(delta(lock_taken, time))
+            lock_taken = None
+        elif ev == IRQ:
+            irq = time
+        elif ev == SDC_CORE_RW:
+            if irq is not None:
+                stats["IRQ to SDC_CORE_RW"].add(delta(irq, time))
+                irq = None
+            core_rw = time
+        elif ev == SDC_DONE:
+            if core_rw is not None:
+                stats["core sector io"].add(delta(core_rw, time))
+            core_rw = None
+        elif ev == HID_REPORT:
+            hid_report = time
+        elif ev == HID_SPI:
+            if hid_report is not None:
+                stats["HID report to SPI"].add(delta(hid_report, time))
+            hid_report = None
+        elif ev == MENU_DRAW:
+            menu_draw = time
+        elif ev == MENU_DRAWN:
+            if menu_draw is not None:
+                stats["menu redraw"].add(delta(menu_draw, time))
+            menu_draw = None
+
+    for name in sorted(stats):
+        stats[name].report(name)
+
+    if lost:
+        print("%d events lost" % lost)
+
+if __name__ == "__main__":
+    main()
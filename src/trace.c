@@ -0,0 +1,137 @@
+//
+// trace.c
+//
+// Events may be recorded from any task or interrupt. Writers only
+// claim a slot in the ring buffer and never wait. A low priority
+// task sends the recorded events as hex encoded binary records via
+// the debug output, so the stdio line ending translation doesn't
+// corrupt them:
+//
+//   TRC:<7 bytes per event: time (4), id (1), arg (2), little endian>
+//
+
+#include "trace.h"
+
+#ifdef TRACE
+
+#include "mcu_hw.h"
+#include "debug.h"
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#endif
+
+#define TRACE_SIZE        512   // must be a power of two
+#define TRACE_PER_LINE     16
+
+typedef struct {
+  uint32_t time;          // microseconds
+  uint16_t arg;
+  uint8_t id;
+  uint8_t lap;            // index / TRACE_SIZE, written last
+} trace_entry_t;
+
+static trace_entry_t trace_buf[TRACE_SIZE];
+static volatile uint32_t head = 0;     // next slot to be claimed
+static uint32_t tail = 0;              // next slot to be sent
+
+static uint32_t trace_claim(void) {
+#if defined(__ARM_ARCH_6M__)
+  // the Cortex-M0+ of the RP2040 has no atomic read-modify-write
+  // instructions. FreeRTOS runs on one core, so masking interrupts
+  // is sufficient
+  UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR();
+  uint32_t idx = head++;
+  portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+  return idx;
+#else
+  return __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void trace_event(uint8_t id, uint16_t arg) {
+  uint32_t idx = trace_claim();
+  trace_entry_t *e = &trace_buf[idx % TRACE_SIZE];
+
+  e->time = mcu_hw_time_us();
+  e->id = id;
+  e->arg = arg;
+  __atomic_store_n(&e->lap, (uint8_t)(idx / TRACE_SIZE), __ATOMIC_RELEASE);
+}
+
+static char *trace_hex(char *p, uint32_t val, int bytes) {
+  static const char hex[] = "0123456789abcdef";
+
+  while(bytes--) {
+    *p++ = hex[(val >> 4) & 15];
+    *p++ = hex[val & 15];
+    val >>= 8;
+  }
+  return p;
+}
+
+static void trace_task(__attribute__((unused)) void *parms) {
+  char line[14*TRACE_PER_LINE+1];
+  uint32_t lost = 0;
+
+  for(;;) {
+    vTaskDelay(pdMS_TO_TICKS(100));
+
+    // writers have overtaken us?
+    uint32_t h = head;
+    if(h - tail > TRACE_SIZE) {
+      lost += h - tail - TRACE_SIZE;
+      tail = h - TRACE_SIZE;
+    }
+
+    char *p = line;
+    if(lost) {
+      p = trace_hex(p, mcu_hw_time_us(), 4);
+      p = trace_hex(p, TRACE_LOST, 1);
+      p = trace_hex(p, (lost > 0xffff)?0xffff:lost, 2);
+      lost = 0;
+    }
+
+    while(tail != h) {
+      trace_entry_t *e = &trace_buf[tail % TRACE_SIZE];
+      uint8_t lap = __atomic_load_n(&e->lap, __ATOMIC_ACQUIRE);
+
+      // slot claimed but not written, yet
+      if(lap == (uint8_t)(tail / TRACE_SIZE - 1)) break;
+
+      if(lap != (uint8_t)(tail / TRACE_SIZE))
+	lost++;   // already overwritten
+      else {
+	p = trace_hex(p, e->time, 4);
+	p = trace_hex(p, e->id, 1);
+	p = trace_hex(p, e->arg, 2);
+      }
+      tail++;
+
+      if(p == line + 14*TRACE_PER_LINE) {
+	*p = 0;
+	debugf("TRC:%s", line);
+	p = line;
+      }
+    }
+
+    if(p != line) {
+      *p = 0;
+      debugf("TRC:%s", line);
+    }
+  }
+}
+
+void trace_init(void) {
+  // mark all slots as not yet written in lap 0
+  for(int i=0;i<TRACE_SIZE;i++)
+    trace_buf[i].lap = 0xff;
+
+  xTaskCreate(trace_task, (char *)"trace_task", 2048, NULL, tskIDLE_PRIORITY+1, NULL);
+}
+
+#endif // TRACE
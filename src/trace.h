@@ -0,0 +1,42 @@
+//
+// trace.h
+//
+// Lightweight event tracing with microsecond timestamps. Events are
+// recorded into a ring buffer and periodically dumped via the debug
+// output. src/tools/trace_decode.py turns a captured log into latency
+// statistics.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// enable to record timing events
+// #define TRACE
+
+#define TRACE_LOST          0   // arg: number of events lost
+#define TRACE_SPI_WAIT      1   // arg: SPI priority class
+#define TRACE_SPI_BEGIN     2   // arg: SPI priority class
+#define TRACE_SPI_END       3   // arg: SPI priority class
+#define TRACE_SDC_LOCK      4   // waiting for file system lock
+#define TRACE_SDC_LOCKED    5
+#define TRACE_SDC_UNLOCK    6
+#define TRACE_IRQ           7   // interrupt from core
+#define TRACE_SDC_REQUEST   8   // arg: drive
+#define TRACE_SDC_CORE_RW   9   // arg: drive
+#define TRACE_SDC_DONE     10   // arg: drive
+#define TRACE_HID_REPORT   11   // arg: report length
+#define TRACE_HID_SPI      12
+#define TRACE_MENU_DRAW    13
+#define TRACE_MENU_DRAWN   14
+
+#ifdef TRACE
+void trace_init(void);
+void trace_event(uint8_t id, uint16_t arg);
+#else
+#define trace_init()
+#define trace_event(id, arg)
+#endif
+
+#endif // TRACE_H